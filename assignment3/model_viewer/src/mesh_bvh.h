@@ -0,0 +1,635 @@
+#pragma once
+
+#include "utils2.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif // __SSE__
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Bounding volume hierarchy over the triangles of a mesh, built with the
+// binned surface area heuristic of Wald, "On fast Construction of SAH-based
+// Bounding Volume Hierarchies" (2007). The nodes are stored flat with the
+// two children of a node next to each other, so that both boxes are tested
+// from one cache line, and the triangles of the leaves are stored in
+// blocks of four for testing a ray against a block at once.
+
+// Number of bins along the split axis, and the largest leaf the heuristic may choose
+// over a split (smaller ones are always made leaves)
+const int bvhBins = 16;
+const std::size_t bvhMaxLeafTriangles = 8;
+
+// Nodes with at least this many triangles are binned by all threads
+const std::size_t bvhParallelTriangles = 1 << 16;
+
+// Depth of the traversal stacks, which no tree exceeds. Nodes deeper than
+// bvhMedianDepth are split at the median instead of by the heuristic, which
+// halves them each level, so fewer than 2^32 triangles stay within the
+// remaining levels however degenerate the mesh.
+const int bvhMaxDepth = 128;
+const int bvhMedianDepth = bvhMaxDepth - 32;
+
+const std::uint32_t bvhNoTriangle = 0xffffffff;
+
+// A node is a leaf if count is nonzero. Then its triangles are in the
+// blocks from first on; otherwise its children are nodes first and
+// first + 1.
+struct BVHNode {
+    glm::vec3 boundsMin;
+    std::uint32_t first;
+    glm::vec3 boundsMax;
+    std::uint32_t count;
+};
+
+// Four triangles as a vertex and two edges, one triangle per lane. Lanes
+// past the end of a leaf have zero edges and never hit.
+struct BVHTriangles4 {
+    float v0[3][4];
+    float e1[3][4];
+    float e2[3][4];
+    std::uint32_t triangle[4]; // Triangle number in the mesh, or bvhNoTriangle
+};
+
+struct MeshBVH {
+    std::vector<BVHNode> nodes;
+    std::vector<BVHTriangles4> blocks;
+};
+
+struct BVHHit {
+    float t;
+    std::uint32_t triangle;
+    float u, v; // Barycentric coordinates of the hit relative to the second and third vertex
+};
+
+struct BVHClosestPoint {
+    glm::vec3 point;
+    float distance;
+    std::uint32_t triangle;
+};
+
+namespace {
+struct BVHBounds {
+    glm::vec3 lo;
+    glm::vec3 hi;
+};
+
+BVHBounds bvhBoundsEmpty()
+{
+    BVHBounds bounds = { glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) };
+    return bounds;
+}
+
+void bvhBoundsMerge(BVHBounds &bounds, const BVHBounds &other)
+{
+    bounds.lo = glm::min(bounds.lo, other.lo);
+    bounds.hi = glm::max(bounds.hi, other.hi);
+}
+
+float bvhBoundsArea(const BVHBounds &bounds)
+{
+    glm::vec3 d = bounds.hi - bounds.lo;
+    return d.x < 0.0f ? 0.0f : 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// Triangle bounds and centroids, indexed by triangle number
+struct BVHBuildInput {
+    std::vector<BVHBounds> bounds;
+    std::vector<glm::vec3> centroids;
+};
+
+// Bins of the centroids along the split axis
+struct BVHBins {
+    BVHBounds bounds[bvhBins];
+    std::uint32_t counts[bvhBins];
+};
+
+// Subtree left for one thread to build: node with the triangle references
+// refs[begin] to refs[end - 1]
+struct BVHTask {
+    std::uint32_t node;
+    std::uint32_t begin;
+    std::uint32_t end;
+    int depth;
+};
+
+int bvhBin(const glm::vec3 &centroid, float lo, float scale, int axis)
+{
+    int bin = int((centroid[axis] - lo) * scale);
+    return std::min(std::max(bin, 0), bvhBins - 1);
+}
+
+// Call function(from, to, chunk) over numChunks chunks of [begin, end),
+// one per thread
+template <typename Function>
+void bvhForChunks(int numChunks, std::uint32_t begin, std::uint32_t end, Function function)
+{
+    parallelRun(numChunks, [&](int chunk) {
+        function(begin + std::uint32_t(std::uint64_t(end - begin) * chunk / numChunks),
+                 begin + std::uint32_t(std::uint64_t(end - begin) * (chunk + 1) / numChunks), chunk);
+    });
+}
+
+// Bounds of the triangles refs[from] to refs[to - 1] and of their centroids
+void bvhBoundsOf(const std::uint32_t *refs, std::uint32_t from, std::uint32_t to, const BVHBuildInput &input,
+                 BVHBounds &bounds, BVHBounds &centroidBounds)
+{
+    bounds = centroidBounds = bvhBoundsEmpty();
+    for (std::uint32_t i = from; i < to; i++) {
+        bvhBoundsMerge(bounds, input.bounds[refs[i]]);
+        centroidBounds.lo = glm::min(centroidBounds.lo, input.centroids[refs[i]]);
+        centroidBounds.hi = glm::max(centroidBounds.hi, input.centroids[refs[i]]);
+    }
+}
+
+void bvhBinsOf(const std::uint32_t *refs, std::uint32_t from, std::uint32_t to, const BVHBuildInput &input,
+               float lo, float scale, int axis, BVHBins &bins)
+{
+    for (int b = 0; b < bvhBins; b++) {
+        bins.bounds[b] = bvhBoundsEmpty();
+        bins.counts[b] = 0;
+    }
+    for (std::uint32_t i = from; i < to; i++) {
+        int b = bvhBin(input.centroids[refs[i]], lo, scale, axis);
+        bvhBoundsMerge(bins.bounds[b], input.bounds[refs[i]]);
+        bins.counts[b]++;
+    }
+}
+
+// Build the subtree of node, at the given depth, over refs[begin] to
+// refs[end - 1], adding children to nodes. Leaves point at their first triangle reference until
+// bvhBuild() packs them into blocks. Subtrees of at most taskSize triangles
+// are left in tasks, unless that is null.
+void bvhBuildNode(std::vector<BVHNode> &nodes, std::uint32_t node, int depth, std::uint32_t *refs,
+                  std::uint32_t begin, std::uint32_t end, const BVHBuildInput &input, int numThreads,
+                  std::vector<BVHTask> *tasks, std::size_t taskSize)
+{
+    std::uint32_t count = end - begin;
+    int numChunks = count >= bvhParallelTriangles ? numThreads : 1;
+
+    // -- Bounds of the triangles and of their centroids
+    BVHBounds bounds, centroidBounds;
+    if (numChunks == 1) {
+        bvhBoundsOf(refs, begin, end, input, bounds, centroidBounds);
+    }
+    else {
+        std::vector<BVHBounds> chunkBounds(numChunks), chunkCentroids(numChunks);
+        bvhForChunks(numChunks, begin, end, [&](std::uint32_t from, std::uint32_t to, int chunk) {
+            bvhBoundsOf(refs, from, to, input, chunkBounds[chunk], chunkCentroids[chunk]);
+        });
+        bounds = centroidBounds = bvhBoundsEmpty();
+        for (int chunk = 0; chunk < numChunks; chunk++) {
+            bvhBoundsMerge(bounds, chunkBounds[chunk]);
+            bvhBoundsMerge(centroidBounds, chunkCentroids[chunk]);
+        }
+    }
+    nodes[node].boundsMin = bounds.lo;
+    nodes[node].boundsMax = bounds.hi;
+    nodes[node].first = begin;
+    nodes[node].count = count;
+    if (count <= 4) {
+        return;
+    }
+    if (tasks && count <= taskSize) {
+        BVHTask task = { node, begin, end, depth };
+        tasks->push_back(task);
+        return;
+    }
+
+    // -- Bin the centroids along the axis they spread most on
+    glm::vec3 extent = centroidBounds.hi - centroidBounds.lo;
+    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+    float lo = centroidBounds.lo[axis];
+    float scale = extent[axis] > 0.0f && depth < bvhMedianDepth ? bvhBins * 0.99999f / extent[axis] : 0.0f;
+    BVHBins bins;
+    if (numChunks == 1) {
+        bvhBinsOf(refs, begin, end, input, lo, scale, axis, bins);
+    }
+    else {
+        std::vector<BVHBins> chunkBins(numChunks);
+        bvhForChunks(numChunks, begin, end, [&](std::uint32_t from, std::uint32_t to, int chunk) {
+            bvhBinsOf(refs, from, to, input, lo, scale, axis, chunkBins[chunk]);
+        });
+        bins = chunkBins[0];
+        for (int chunk = 1; chunk < numChunks; chunk++) {
+            for (int b = 0; b < bvhBins; b++) {
+                bvhBoundsMerge(bins.bounds[b], chunkBins[chunk].bounds[b]);
+                bins.counts[b] += chunkBins[chunk].counts[b];
+            }
+        }
+    }
+
+    // -- Cheapest split between bins by the surface area heuristic, with
+    // the cost of a triangle test as one and of a node visit as one
+    float bestCost = FLT_MAX;
+    int bestBin = -1;
+    float rightCosts[bvhBins];
+    BVHBounds right = bvhBoundsEmpty();
+    std::uint32_t rightCount = 0;
+    for (int b = bvhBins - 1; b > 0; b--) {
+        bvhBoundsMerge(right, bins.bounds[b]);
+        rightCount += bins.counts[b];
+        rightCosts[b] = bvhBoundsArea(right) * rightCount;
+    }
+    BVHBounds left = bvhBoundsEmpty();
+    std::uint32_t leftCount = 0;
+    for (int b = 1; b < bvhBins && scale > 0.0f; b++) {
+        bvhBoundsMerge(left, bins.bounds[b - 1]);
+        leftCount += bins.counts[b - 1];
+        float cost = bvhBoundsArea(left) * leftCount + rightCosts[b];
+        if (leftCount > 0 && leftCount < count && cost < bestCost) {
+            bestCost = cost;
+            bestBin = b;
+        }
+    }
+    float area = bvhBoundsArea(bounds);
+    bestCost = area > 0.0f ? 1.0f + bestCost / area : FLT_MAX;
+    if (count <= bvhMaxLeafTriangles && (bestBin < 0 || bestCost >= count)) {
+        return;
+    }
+
+    // -- Split at the chosen bin, or at the median if the centroids all
+    // fall in one bin or the node is too deep for binning
+    std::uint32_t middle;
+    if (bestBin >= 0) {
+        middle = std::partition(refs + begin, refs + end, [&](std::uint32_t triangle) {
+            return bvhBin(input.centroids[triangle], lo, scale, axis) < bestBin;
+        }) - refs;
+    }
+    else {
+        middle = begin + count / 2;
+        std::nth_element(refs + begin, refs + middle, refs + end, [&](std::uint32_t a, std::uint32_t b) {
+            return input.centroids[a][axis] < input.centroids[b][axis];
+        });
+    }
+
+    std::uint32_t children = nodes.size();
+    nodes.resize(nodes.size() + 2);
+    nodes[node].first = children;
+    nodes[node].count = 0;
+    bvhBuildNode(nodes, children, depth + 1, refs, begin, middle, input, numThreads, tasks, taskSize);
+    bvhBuildNode(nodes, children + 1, depth + 1, refs, middle, end, input, numThreads, tasks, taskSize);
+}
+
+// Entry distance of a ray into a box, or FLT_MAX if it misses within
+// [0, tMax]
+float bvhRayBox(const BVHNode &node, const glm::vec3 &origin, const glm::vec3 &inverseDirection, float tMax)
+{
+    glm::vec3 t0 = (node.boundsMin - origin) * inverseDirection;
+    glm::vec3 t1 = (node.boundsMax - origin) * inverseDirection;
+    glm::vec3 tNear = glm::min(t0, t1), tFar = glm::max(t0, t1);
+    float enter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+    float exit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, tMax));
+    return enter <= exit ? enter : FLT_MAX;
+}
+
+// Test a ray against the four triangles of a block with the algorithm of
+// Möller and Trumbore, "Fast, Minimum Storage Ray/Triangle Intersection"
+// (1997), and keep the nearest hit closer than hit.t
+bool bvhRayTriangles4(const BVHTriangles4 &block, const glm::vec3 &origin, const glm::vec3 &direction, BVHHit &hit)
+{
+#ifdef __SSE__
+    __m128 d[3] = { _mm_set1_ps(direction.x), _mm_set1_ps(direction.y), _mm_set1_ps(direction.z) };
+    __m128 e1[3], e2[3], s[3];
+    for (int k = 0; k < 3; k++) {
+        e1[k] = _mm_loadu_ps(block.e1[k]);
+        e2[k] = _mm_loadu_ps(block.e2[k]);
+        s[k] = _mm_sub_ps(_mm_set1_ps(origin[k]), _mm_loadu_ps(block.v0[k]));
+    }
+    // p = d x e2, q = s x e1
+    __m128 p[3], q[3];
+    for (int k = 0; k < 3; k++) {
+        int k1 = (k + 1) % 3, k2 = (k + 2) % 3;
+        p[k] = _mm_sub_ps(_mm_mul_ps(d[k1], e2[k2]), _mm_mul_ps(d[k2], e2[k1]));
+        q[k] = _mm_sub_ps(_mm_mul_ps(s[k1], e1[k2]), _mm_mul_ps(s[k2], e1[k1]));
+    }
+    auto dot = [](const __m128 *a, const __m128 *b) {
+        return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+    };
+    __m128 det = dot(e1, p);
+    __m128 inverseDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+    __m128 u = _mm_mul_ps(dot(s, p), inverseDet);
+    __m128 v = _mm_mul_ps(dot(d, q), inverseDet);
+    __m128 t = _mm_mul_ps(dot(e2, q), inverseDet);
+    __m128 zero = _mm_setzero_ps();
+    __m128 mask = _mm_cmpneq_ps(det, zero);
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+    mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+    mask = _mm_and_ps(mask, _mm_cmpgt_ps(t, zero));
+    mask = _mm_and_ps(mask, _mm_cmplt_ps(t, _mm_set1_ps(hit.t)));
+    int hits = _mm_movemask_ps(mask);
+    if (hits == 0) {
+        return false;
+    }
+    float ts[4], us[4], vs[4];
+    _mm_storeu_ps(ts, t);
+    _mm_storeu_ps(us, u);
+    _mm_storeu_ps(vs, v);
+    for (int lane = 0; lane < 4; lane++) {
+        if ((hits >> lane & 1) && ts[lane] < hit.t) {
+            hit.t = ts[lane];
+            hit.u = us[lane];
+            hit.v = vs[lane];
+            hit.triangle = block.triangle[lane];
+        }
+    }
+    return true;
+#else
+    bool found = false;
+    for (int lane = 0; lane < 4; lane++) {
+        glm::vec3 e1(block.e1[0][lane], block.e1[1][lane], block.e1[2][lane]);
+        glm::vec3 e2(block.e2[0][lane], block.e2[1][lane], block.e2[2][lane]);
+        glm::vec3 s = origin - glm::vec3(block.v0[0][lane], block.v0[1][lane], block.v0[2][lane]);
+        glm::vec3 p = glm::cross(direction, e2), q = glm::cross(s, e1);
+        float det = glm::dot(e1, p);
+        if (det == 0.0f) {
+            continue;
+        }
+        float u = glm::dot(s, p) / det, v = glm::dot(direction, q) / det, t = glm::dot(e2, q) / det;
+        if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t > 0.0f && t < hit.t) {
+            hit.t = t;
+            hit.u = u;
+            hit.v = v;
+            hit.triangle = block.triangle[lane];
+            found = true;
+        }
+    }
+    return found;
+#endif // __SSE__
+}
+
+// Closest point to p on the triangle a, b, c, from Ericson, "Real-Time
+// Collision Detection" (2005), section 5.1.5
+glm::vec3 bvhClosestOnTriangle(const glm::vec3 &p, const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c)
+{
+    glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+    float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f) {
+        return a;
+    }
+    glm::vec3 bp = p - b;
+    float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3) {
+        return b;
+    }
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+        return a + ab * (d1 / (d1 - d3));
+    }
+    glm::vec3 cp = p - c;
+    float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6) {
+        return c;
+    }
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+        return a + ac * (d2 / (d2 - d6));
+    }
+    float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) {
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    }
+    float denominator = 1.0f / (va + vb + vc);
+    return a + ab * (vb * denominator) + ac * (vc * denominator);
+}
+
+// Squared distance from p to a box, zero inside
+float bvhPointBoxDistance2(const BVHNode &node, const glm::vec3 &p)
+{
+    glm::vec3 d = glm::max(glm::max(node.boundsMin - p, p - node.boundsMax), glm::vec3(0.0f));
+    return glm::dot(d, d);
+}
+} // namespace
+
+// Build the hierarchy over the triangles of a mesh. Large nodes are binned
+// by all threads, and the subtrees below them are built in parallel and
+// then spliced into the one node array.
+void bvhBuild(MeshBVH &bvh, const glm::vec3 *vertices, const std::uint32_t *indices, std::size_t numIndices)
+{
+    std::uint32_t numTriangles = numIndices / 3;
+    bvh.nodes.assign(1, BVHNode());
+    bvh.blocks.clear();
+    if (numTriangles == 0) {
+        bvh.nodes[0].boundsMin = glm::vec3(FLT_MAX);
+        bvh.nodes[0].boundsMax = glm::vec3(-FLT_MAX);
+        bvh.nodes[0].first = 0;
+        bvh.nodes[0].count = 0;
+        return;
+    }
+
+    BVHBuildInput input;
+    input.bounds.resize(numTriangles);
+    input.centroids.resize(numTriangles);
+    std::vector<std::uint32_t> refs(numTriangles);
+    int numThreads = hardwareThreads();
+    int numChunks = numTriangles >= bvhParallelTriangles ? numThreads : 1;
+    bvhForChunks(numChunks, 0, numTriangles, [&](std::uint32_t from, std::uint32_t to, int) {
+        for (std::uint32_t t = from; t < to; t++) {
+            const glm::vec3 &a = vertices[indices[3 * t]];
+            const glm::vec3 &b = vertices[indices[3 * t + 1]];
+            const glm::vec3 &c = vertices[indices[3 * t + 2]];
+            input.bounds[t].lo = glm::min(glm::min(a, b), c);
+            input.bounds[t].hi = glm::max(glm::max(a, b), c);
+            input.centroids[t] = (a + b + c) / 3.0f;
+            refs[t] = t;
+        }
+    });
+
+    // -- Top of the tree, then the subtrees below it on all threads, about
+    // four per thread for balance
+    std::vector<BVHTask> tasks;
+    std::size_t taskSize = std::max<std::size_t>(numTriangles / (4 * numThreads), bvhParallelTriangles / 4);
+    bvhBuildNode(bvh.nodes, 0, 0, refs.data(), 0, numTriangles, input, numThreads,
+                 numThreads > 1 ? &tasks : nullptr, taskSize);
+
+    std::vector<std::vector<BVHNode> > subtrees(tasks.size());
+    std::atomic<std::size_t> nextTask(0);
+    parallelRun(std::min<int>(numThreads, tasks.size()), [&](int) {
+        for (std::size_t i = nextTask++; i < tasks.size(); i = nextTask++) {
+            subtrees[i].assign(1, BVHNode());
+            bvhBuildNode(subtrees[i], 0, tasks[i].depth, refs.data(), tasks[i].begin, tasks[i].end, input, 1,
+                         nullptr, 0);
+        }
+    });
+    for (std::size_t i = 0; i < tasks.size(); i++) {
+        // Node k > 0 of the subtree goes to base + k - 1, and its root in
+        // place of the task node
+        std::uint32_t base = bvh.nodes.size();
+        std::vector<BVHNode> &subtree = subtrees[i];
+        for (std::size_t k = 0; k < subtree.size(); k++) {
+            if (subtree[k].count == 0) {
+                subtree[k].first += base - 1;
+            }
+        }
+        bvh.nodes[tasks[i].node] = subtree[0];
+        bvh.nodes.insert(bvh.nodes.end(), subtree.begin() + 1, subtree.end());
+    }
+
+    // -- Pack the triangles of each leaf into blocks of four
+    for (std::size_t n = 0; n < bvh.nodes.size(); n++) {
+        BVHNode &node = bvh.nodes[n];
+        if (node.count == 0) {
+            continue;
+        }
+        std::uint32_t firstRef = node.first;
+        node.first = bvh.blocks.size();
+        for (std::uint32_t i = 0; i < node.count; i += 4) {
+            BVHTriangles4 block = BVHTriangles4();
+            for (std::uint32_t lane = 0; lane < 4; lane++) {
+                block.triangle[lane] = bvhNoTriangle;
+                if (i + lane >= node.count) {
+                    for (int k = 0; k < 3; k++) {
+                        block.v0[k][lane] = block.v0[k][0];
+                    }
+                    continue;
+                }
+                std::uint32_t t = refs[firstRef + i + lane];
+                const glm::vec3 &a = vertices[indices[3 * t]];
+                glm::vec3 e1 = vertices[indices[3 * t + 1]] - a, e2 = vertices[indices[3 * t + 2]] - a;
+                for (int k = 0; k < 3; k++) {
+                    block.v0[k][lane] = a[k];
+                    block.e1[k][lane] = e1[k];
+                    block.e2[k][lane] = e2[k];
+                }
+                block.triangle[lane] = t;
+            }
+            bvh.blocks.push_back(block);
+        }
+    }
+}
+
+void bvhBuild(MeshBVH &bvh, const OBJMesh &mesh)
+{
+    bvhBuild(bvh, mesh.vertices.data(), mesh.indices.data(), mesh.indices.size());
+}
+
+// Nearest triangle hit by the ray origin + t * direction for t in (0, tMax).
+// The direction need not be normalized; t is in its units.
+bool bvhRaycast(const MeshBVH &bvh, const glm::vec3 &origin, const glm::vec3 &direction, float tMax, BVHHit &hit)
+{
+    hit.t = tMax;
+    hit.triangle = bvhNoTriangle;
+    glm::vec3 inverseDirection = 1.0f / direction;
+    if (bvhRayBox(bvh.nodes[0], origin, inverseDirection, tMax) == FLT_MAX) {
+        return false;
+    }
+
+    // -- Visit the nearer child first and skip boxes behind the hit so far.
+    // The stack holds at most one node per level.
+    std::uint32_t stack[bvhMaxDepth];
+    int stackSize = 0;
+    std::uint32_t node = 0;
+    while (true) {
+        const BVHNode &current = bvh.nodes[node];
+        if (current.count > 0) {
+            for (std::uint32_t b = current.first; b < current.first + (current.count + 3) / 4; b++) {
+                bvhRayTriangles4(bvh.blocks[b], origin, direction, hit);
+            }
+        }
+        else {
+            std::uint32_t nearChild = current.first, farChild = current.first + 1;
+            float tNear = bvhRayBox(bvh.nodes[nearChild], origin, inverseDirection, hit.t);
+            float tFar = bvhRayBox(bvh.nodes[farChild], origin, inverseDirection, hit.t);
+            if (tFar < tNear) {
+                std::swap(nearChild, farChild);
+                std::swap(tNear, tFar);
+            }
+            if (tNear != FLT_MAX) {
+                if (tFar != FLT_MAX) {
+                    stack[stackSize++] = farChild;
+                }
+                node = nearChild;
+                continue;
+            }
+        }
+        if (stackSize == 0) {
+            break;
+        }
+        node = stack[--stackSize];
+    }
+    return hit.triangle != bvhNoTriangle;
+}
+
+// Point on the mesh closest to p within maxDistance
+bool bvhClosestPoint(const MeshBVH &bvh, const glm::vec3 &p, float maxDistance, BVHClosestPoint &result)
+{
+    float best2 = maxDistance * maxDistance;
+    result.triangle = bvhNoTriangle;
+    result.distance = maxDistance;
+
+    std::uint32_t stack[bvhMaxDepth];
+    int stackSize = 0;
+    std::uint32_t node = 0;
+    if (bvhPointBoxDistance2(bvh.nodes[0], p) > best2) {
+        return false;
+    }
+    while (true) {
+        const BVHNode &current = bvh.nodes[node];
+        if (current.count > 0) {
+            for (std::uint32_t b = current.first; b < current.first + (current.count + 3) / 4; b++) {
+                const BVHTriangles4 &block = bvh.blocks[b];
+                for (int lane = 0; lane < 4 && block.triangle[lane] != bvhNoTriangle; lane++) {
+                    glm::vec3 a(block.v0[0][lane], block.v0[1][lane], block.v0[2][lane]);
+                    glm::vec3 e1(block.e1[0][lane], block.e1[1][lane], block.e1[2][lane]);
+                    glm::vec3 e2(block.e2[0][lane], block.e2[1][lane], block.e2[2][lane]);
+                    glm::vec3 point = bvhClosestOnTriangle(p, a, a + e1, a + e2);
+                    float distance2 = glm::dot(point - p, point - p);
+                    if (distance2 <= best2) {
+                        best2 = distance2;
+                        result.point = point;
+                        result.triangle = block.triangle[lane];
+                    }
+                }
+            }
+        }
+        else {
+            std::uint32_t nearChild = current.first, farChild = current.first + 1;
+            float dNear = bvhPointBoxDistance2(bvh.nodes[nearChild], p);
+            float dFar = bvhPointBoxDistance2(bvh.nodes[farChild], p);
+            if (dFar < dNear) {
+                std::swap(nearChild, farChild);
+                std::swap(dNear, dFar);
+            }
+            if (dNear <= best2) {
+                if (dFar <= best2) {
+                    stack[stackSize++] = farChild;
+                }
+                node = nearChild;
+                continue;
+            }
+        }
+
+        // Boxes on the stack may have fallen out of reach meanwhile
+        node = bvhNoTriangle;
+        while (stackSize > 0 && node == bvhNoTriangle) {
+            std::uint32_t candidate = stack[--stackSize];
+            if (bvhPointBoxDistance2(bvh.nodes[candidate], p) <= best2) {
+                node = candidate;
+            }
+        }
+        if (node == bvhNoTriangle) {
+            break;
+        }
+    }
+    if (result.triangle == bvhNoTriangle) {
+        return false;
+    }
+    result.distance = std::sqrt(best2);
+    return true;
+}
+
+// Distance from p to the mesh, or FLT_MAX for an empty mesh
+float bvhDistance(const MeshBVH &bvh, const glm::vec3 &p)
+{
+    BVHClosestPoint result;
+    return bvhClosestPoint(bvh, p, FLT_MAX, result) ? result.distance : FLT_MAX;
+}
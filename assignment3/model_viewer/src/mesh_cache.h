@@ -0,0 +1,290 @@
+#pragma once
+
+#include "utils2.h"
+#include "mesh_simplify.h"
+#include "mesh_meshlets.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Binary mesh cache, written next to an OBJ file after it has been parsed
+// once. The file is a header followed by the vertex, normal and index
+// arrays, the levels of detail with their indices and the meshlets, each
+// starting at a multiple of meshCacheAlignment, so that the mapped file can
+// be handed to glBufferData() without copying. The cache is only used while the size,
+// modification time and contents hash of the OBJ file match the ones
+// recorded in the header.
+
+const char meshCacheMagic[8] = { 'M', 'V', 'M', 'E', 'S', 'H', '\0', '\0' };
+// 2: triangles and vertices are stored optimized, 3: levels of detail, 4: meshlets
+const std::uint32_t meshCacheVersion = 4;
+const std::uint64_t meshCacheAlignment = 64;
+
+// Extension appended to the OBJ file name
+const std::string meshCacheExtension(".meshcache");
+
+// Flags for how the arrays are stored. The arrays are plain floats and
+// 32-bit indices when no flags are set, which is all this version writes.
+enum MeshCacheFlags {
+    MESH_CACHE_KNOWN_FLAGS = 0
+};
+
+struct MeshCacheHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t flags;
+
+    // OBJ file the cache was built from
+    std::uint64_t sourceSize;
+    std::int64_t sourceTime;
+    std::uint64_t sourceHash;
+
+    glm::vec3 boundsMin;
+    glm::vec3 boundsMax;
+    std::uint32_t numVertices;
+    std::uint32_t numIndices;
+
+    // Byte offsets of the arrays from the start of the file
+    std::uint64_t vertexOffset;
+    std::uint64_t normalOffset;
+    std::uint64_t indexOffset;
+
+    // Levels of detail, the first being the full mesh
+    std::uint32_t numLods;
+    std::uint32_t numLodIndices;
+    std::uint64_t lodOffset;
+    std::uint64_t lodIndexOffset;
+
+    // Meshlets of all levels, sorted by their first index
+    std::uint32_t numMeshlets;
+    std::uint32_t padding;
+    std::uint64_t meshletOffset;
+};
+
+// Struct for a mesh mapped from its cache. The arrays point into the
+// mapped file and stay valid as long as the struct lives.
+struct MeshCache {
+    MappedFile file;
+    const MeshCacheHeader *header;
+    const glm::vec3 *vertices;
+    const glm::vec3 *normals;
+    const std::uint32_t *indices;
+    const MeshLod *lods;
+    const std::uint32_t *lodIndices;
+    const Meshlet *meshlets;
+
+    MeshCache() : header(nullptr), vertices(nullptr), normals(nullptr), indices(nullptr),
+                  lods(nullptr), lodIndices(nullptr), meshlets(nullptr) {}
+};
+
+namespace {
+// 64-bit hash of a block of memory, taking eight bytes per step. Not
+// cryptographic, but any edit to the OBJ file changes it.
+std::uint64_t meshCacheHash(const char *data, std::size_t size)
+{
+    std::uint64_t hash = 0xcbf29ce484222325ull ^ size;
+    std::size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 32;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ std::uint8_t(data[i])) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Size, modification time and contents hash of an OBJ file
+bool meshCacheSourceKey(const std::string &filename, MeshCacheHeader &header)
+{
+    struct stat status;
+    if (stat(filename.c_str(), &status) != 0) {
+        return false;
+    }
+    MappedFile source;
+    if (!mappedFileOpen(source, filename)) {
+        return false;
+    }
+    header.sourceSize = source.size;
+    header.sourceTime = status.st_mtime;
+    header.sourceHash = meshCacheHash(source.data, source.size);
+    return true;
+}
+
+std::uint64_t meshCacheAlign(std::uint64_t offset)
+{
+    return (offset + meshCacheAlignment - 1) / meshCacheAlignment * meshCacheAlignment;
+}
+
+// Whether an array of `size` bytes at `offset` lies within the file
+bool meshCacheInFile(const MappedFile &file, std::uint64_t offset, std::uint64_t size)
+{
+    return offset % meshCacheAlignment == 0 && offset <= file.size && size <= file.size - offset;
+}
+} // namespace
+
+// Write the cache of a mesh parsed from the given OBJ file, along with its
+// levels of detail from meshBuildLods() and the meshlets of all levels
+// from meshletsBuild(). The cache is written to a
+// temporary file and renamed, so a concurrent or interrupted run never sees
+// a partial cache.
+bool meshCacheWrite(const OBJMesh &mesh, const std::vector<MeshLod> &lods,
+                    const std::vector<std::uint32_t> &lodIndices, const std::vector<Meshlet> &meshlets,
+                    const std::string &objFilename)
+{
+    MeshCacheHeader header = MeshCacheHeader();
+    std::memcpy(header.magic, meshCacheMagic, sizeof(header.magic));
+    header.version = meshCacheVersion;
+    header.flags = 0;
+    if (!meshCacheSourceKey(objFilename, header)) {
+        return false;
+    }
+
+    header.numVertices = mesh.vertices.size();
+    header.numIndices = mesh.indices.size();
+    header.numLods = lods.size();
+    header.numLodIndices = lodIndices.size();
+    header.numMeshlets = meshlets.size();
+    header.boundsMin = header.boundsMax = mesh.vertices.empty() ? glm::vec3(0.0f) : mesh.vertices[0];
+    for (std::size_t i = 0; i < mesh.vertices.size(); i++) {
+        header.boundsMin = glm::min(header.boundsMin, mesh.vertices[i]);
+        header.boundsMax = glm::max(header.boundsMax, mesh.vertices[i]);
+    }
+
+    std::uint64_t vertexBytes = mesh.vertices.size() * sizeof(glm::vec3);
+    std::uint64_t indexBytes = mesh.indices.size() * sizeof(std::uint32_t);
+    header.vertexOffset = meshCacheAlign(sizeof(header));
+    header.normalOffset = meshCacheAlign(header.vertexOffset + vertexBytes);
+    header.indexOffset = meshCacheAlign(header.normalOffset + vertexBytes);
+    header.lodOffset = meshCacheAlign(header.indexOffset + indexBytes);
+    header.lodIndexOffset = meshCacheAlign(header.lodOffset + lods.size() * sizeof(MeshLod));
+    header.meshletOffset = meshCacheAlign(header.lodIndexOffset + lodIndices.size() * sizeof(std::uint32_t));
+
+    std::string filename = objFilename + meshCacheExtension;
+    std::string temporaryFilename = filename + ".tmp";
+    std::ofstream f(temporaryFilename.c_str(), std::ios::binary);
+    if (!f.is_open()) {
+        std::cerr << "Could not write " << temporaryFilename << std::endl;
+        return false;
+    }
+
+    // -- Write the header and the arrays, zero-padded to their offsets
+    const char padding[meshCacheAlignment] = {};
+    std::uint64_t offset = 0;
+    auto writeAt = [&](std::uint64_t at, const void *data, std::uint64_t size) {
+        f.write(padding, at - offset);
+        f.write(static_cast<const char *>(data), size);
+        offset = at + size;
+    };
+    writeAt(0, &header, sizeof(header));
+    writeAt(header.vertexOffset, mesh.vertices.data(), vertexBytes);
+    writeAt(header.normalOffset, mesh.normals.data(), vertexBytes);
+    writeAt(header.indexOffset, mesh.indices.data(), indexBytes);
+    writeAt(header.lodOffset, lods.data(), lods.size() * sizeof(MeshLod));
+    writeAt(header.lodIndexOffset, lodIndices.data(), lodIndices.size() * sizeof(std::uint32_t));
+    writeAt(header.meshletOffset, meshlets.data(), meshlets.size() * sizeof(Meshlet));
+    f.close();
+    if (!f) {
+        std::cerr << "Could not write " << temporaryFilename << std::endl;
+        std::remove(temporaryFilename.c_str());
+        return false;
+    }
+
+    // Renaming onto an existing file fails on Windows
+    std::remove(filename.c_str());
+    if (std::rename(temporaryFilename.c_str(), filename.c_str()) != 0) {
+        std::remove(temporaryFilename.c_str());
+        return false;
+    }
+    std::cout << "Wrote mesh cache " << filename << std::endl;
+    return true;
+}
+
+// Map the cache of the given OBJ file. Returns false if there is no cache
+// or it is stale or damaged, in which case the OBJ file has to be parsed.
+bool meshCacheLoad(MeshCache &cache, const std::string &objFilename)
+{
+    std::string filename = objFilename + meshCacheExtension;
+    if (!mappedFileOpen(cache.file, filename)) {
+        return false;
+    }
+    MappedFile &file = cache.file;
+    if (file.size < sizeof(MeshCacheHeader)) {
+        mappedFileClose(file);
+        return false;
+    }
+    const MeshCacheHeader *header = reinterpret_cast<const MeshCacheHeader *>(file.data);
+
+    // -- Check that the cache was written by this version from the OBJ
+    // file as it is now
+    MeshCacheHeader source;
+    if (std::memcmp(header->magic, meshCacheMagic, sizeof(header->magic)) != 0 ||
+        header->version != meshCacheVersion || (header->flags & ~MESH_CACHE_KNOWN_FLAGS) != 0 ||
+        !meshCacheSourceKey(objFilename, source) || header->sourceSize != source.sourceSize ||
+        header->sourceTime != source.sourceTime || header->sourceHash != source.sourceHash) {
+        mappedFileClose(file);
+        return false;
+    }
+
+    // -- Check that the arrays lie within the file and the indices within
+    // the vertices before trusting them
+    std::uint64_t vertexBytes = std::uint64_t(header->numVertices) * sizeof(glm::vec3);
+    std::uint64_t indexBytes = std::uint64_t(header->numIndices) * sizeof(std::uint32_t);
+    std::uint64_t lodBytes = std::uint64_t(header->numLods) * sizeof(MeshLod);
+    std::uint64_t lodIndexBytes = std::uint64_t(header->numLodIndices) * sizeof(std::uint32_t);
+    std::uint64_t meshletBytes = std::uint64_t(header->numMeshlets) * sizeof(Meshlet);
+    bool valid = meshCacheInFile(file, header->vertexOffset, vertexBytes) &&
+                 meshCacheInFile(file, header->normalOffset, vertexBytes) &&
+                 meshCacheInFile(file, header->indexOffset, indexBytes) &&
+                 meshCacheInFile(file, header->lodOffset, lodBytes) &&
+                 meshCacheInFile(file, header->lodIndexOffset, lodIndexBytes) &&
+                 meshCacheInFile(file, header->meshletOffset, meshletBytes) && header->numLods > 0;
+    const std::uint32_t *indices = reinterpret_cast<const std::uint32_t *>(file.data + header->indexOffset);
+    const std::uint32_t *lodIndices = reinterpret_cast<const std::uint32_t *>(file.data + header->lodIndexOffset);
+    const MeshLod *lods = reinterpret_cast<const MeshLod *>(file.data + header->lodOffset);
+    const Meshlet *meshlets = reinterpret_cast<const Meshlet *>(file.data + header->meshletOffset);
+    std::uint32_t maxIndex = 0;
+    for (std::uint32_t i = 0; valid && i < header->numIndices; i++) {
+        maxIndex = std::max(maxIndex, indices[i]);
+    }
+    for (std::uint32_t i = 0; valid && i < header->numLodIndices; i++) {
+        maxIndex = std::max(maxIndex, lodIndices[i]);
+    }
+    std::uint64_t numAllIndices = std::uint64_t(header->numIndices) + header->numLodIndices;
+    for (std::uint32_t i = 0; valid && i < header->numLods; i++) {
+        valid = std::uint64_t(lods[i].firstIndex) + lods[i].numIndices <= numAllIndices;
+    }
+    for (std::uint32_t i = 0; valid && i < header->numMeshlets; i++) {
+        valid = std::uint64_t(meshlets[i].firstIndex) + meshlets[i].numIndices <= numAllIndices &&
+                (i == 0 || meshlets[i].firstIndex >= meshlets[i - 1].firstIndex);
+    }
+    if (!valid || (numAllIndices > 0 && maxIndex >= header->numVertices)) {
+        std::cerr << "Damaged mesh cache " << filename << std::endl;
+        mappedFileClose(file);
+        return false;
+    }
+
+    cache.header = header;
+    cache.vertices = reinterpret_cast<const glm::vec3 *>(file.data + header->vertexOffset);
+    cache.normals = reinterpret_cast<const glm::vec3 *>(file.data + header->normalOffset);
+    cache.indices = indices;
+    cache.lods = lods;
+    cache.lodIndices = lodIndices;
+    cache.meshlets = meshlets;
+
+    std::cout << "Loaded mesh cache " << filename << std::endl;
+    std::cout << "Number of triangles: " << header->numIndices / 3 << std::endl;
+    return true;
+}
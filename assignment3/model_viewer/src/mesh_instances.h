@@ -0,0 +1,214 @@
+#pragma once
+
+#include "mesh_simplify.h"
+#include "parallel.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif // __SSE__
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+// Instances are culled in chunks of this many, a multiple of four, which
+// the threads of the pool take in turn
+const std::size_t instancesChunkSize = 1 << 11;
+
+// Transform of an instance as stored in the instance attribute buffer: a
+// position and uniform scale, and a rotation as a unit quaternion (x, y, z, w)
+struct InstanceTransform {
+    glm::vec4 positionScale;
+    glm::vec4 rotation;
+};
+
+// Struct for a scene of instances of one mesh. The bounding spheres of the
+// instances are kept apart as arrays of each component, padded to a
+// multiple of four, for culling four at a time.
+struct InstanceScene {
+    std::vector<InstanceTransform> transforms;
+    std::vector<float> centerX, centerY, centerZ, radius;
+    std::size_t numInstances;
+
+    InstanceScene() : numInstances(0) {}
+};
+
+// Struct for the instances that survived culling, with their transforms
+// packed level of detail by level of detail for upload
+struct InstanceDraws {
+    std::vector<InstanceTransform> transforms;
+    std::vector<std::uint32_t> levelFirst;
+    std::vector<std::uint32_t> levelCount;
+
+    // Visible instances found in each chunk, per level
+    std::vector<std::vector<std::vector<std::uint32_t> > > chunkVisible;
+};
+
+// Rotate v by the unit quaternion q
+glm::vec3 quaternionRotate(const glm::vec4 &q, const glm::vec3 &v)
+{
+    glm::vec3 u(q);
+    return v + 2.0f * glm::cross(u, glm::cross(u, v) + q.w * v);
+}
+
+// Scatter numInstances upright instances of a mesh with the given bounding
+// sphere over a square of ground below the origin, six mesh radii from the
+// origin to each side, each turned and scaled at random. The instances
+// shrink as their number grows so that the square stays the same; the same
+// seed gives the same scene.
+void instanceSceneCreate(InstanceScene &scene, std::size_t numInstances, const glm::vec3 &meshCenter,
+                         float meshRadius, unsigned seed)
+{
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    int side = int(std::ceil(std::sqrt(double(numInstances))));
+    float half = 6.0f * meshRadius;
+    float spacing = 2.0f * half / std::max(side, 1);
+    std::size_t padded = (numInstances + 3) / 4 * 4;
+    scene.numInstances = numInstances;
+    scene.transforms.resize(numInstances);
+    scene.centerX.assign(padded, 0.0f);
+    scene.centerY.assign(padded, 0.0f);
+    scene.centerZ.assign(padded, 0.0f);
+    scene.radius.assign(padded, 0.0f);
+
+    for (std::size_t i = 0; i < numInstances; i++) {
+        float scale = (0.3f + 0.15f * unit(random)) * spacing / meshRadius;
+        float angle = 6.2831853f * unit(random);
+        glm::vec3 position(-half + spacing * (i % side + 0.25f + 0.5f * unit(random)),
+                           -meshRadius,
+                           -half + spacing * (i / side + 0.25f + 0.5f * unit(random)));
+        glm::vec4 rotation(0.0f, std::sin(0.5f * angle), 0.0f, std::cos(0.5f * angle));
+        scene.transforms[i].positionScale = glm::vec4(position, scale);
+        scene.transforms[i].rotation = rotation;
+
+        glm::vec3 center = position + scale * quaternionRotate(rotation, meshCenter);
+        scene.centerX[i] = center.x;
+        scene.centerY[i] = center.y;
+        scene.centerZ[i] = center.z;
+        scene.radius[i] = scale * meshRadius;
+    }
+}
+
+namespace {
+// Append the instances in [begin, end) whose spheres are inside all frustum
+// planes to visible, by level of detail
+void instancesCullRange(const InstanceScene &scene, std::size_t begin, std::size_t end, const glm::vec4 planes[6],
+                        const glm::vec4 &camera, float pixelsPerUnit, float maxPixelError, const MeshLod *lods,
+                        int numLods, std::vector<std::vector<std::uint32_t> > &visible)
+{
+    for (std::size_t i = begin; i < end; i += 4) {
+        // -- Inside mask of four spheres, one bit each
+        int inside;
+#ifdef __SSE__
+        __m128 x = _mm_loadu_ps(&scene.centerX[i]);
+        __m128 y = _mm_loadu_ps(&scene.centerY[i]);
+        __m128 z = _mm_loadu_ps(&scene.centerZ[i]);
+        __m128 minusRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&scene.radius[i]));
+        __m128 mask = _mm_cmpeq_ps(x, x);
+        for (int p = 0; p < 6; p++) {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(planes[p].x)),
+                                                    _mm_mul_ps(y, _mm_set1_ps(planes[p].y))),
+                                         _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(planes[p].z)),
+                                                    _mm_set1_ps(planes[p].w)));
+            mask = _mm_and_ps(mask, _mm_cmpge_ps(distance, minusRadius));
+        }
+        inside = _mm_movemask_ps(mask);
+#else
+        inside = 0;
+        for (int lane = 0; lane < 4; lane++) {
+            bool in = true;
+            for (int p = 0; p < 6 && in; p++) {
+                in = scene.centerX[i + lane] * planes[p].x + scene.centerY[i + lane] * planes[p].y +
+                     scene.centerZ[i + lane] * planes[p].z + planes[p].w >= -scene.radius[i + lane];
+            }
+            inside |= int(in) << lane;
+        }
+#endif // __SSE__
+        if (i + 4 > end) {
+            inside &= (1 << (end - i)) - 1;
+        }
+
+        // -- Coarsest level whose error stays within maxPixelError, with
+        // pixelsPerUnit at unit distance for perspective projection
+        for (int lane = 0; lane < 4; lane++) {
+            if (!(inside >> lane & 1)) {
+                continue;
+            }
+            std::size_t instance = i + lane;
+            float scale = scene.transforms[instance].positionScale.w;
+            float pixels = pixelsPerUnit * scale;
+            if (camera.w != 0.0f) {
+                glm::vec3 center(scene.centerX[instance], scene.centerY[instance], scene.centerZ[instance]);
+                pixels /= std::max(glm::length(center - glm::vec3(camera)), 1e-6f);
+            }
+            int level = 0;
+            while (level + 1 < numLods && lods[level + 1].error * pixels <= maxPixelError) {
+                level++;
+            }
+            visible[level].push_back(instance);
+        }
+    }
+}
+} // namespace
+
+// Cull the instances of a scene against frustum planes in scene space, four
+// at a time and in chunks spread over the threads of the pool, pick a level of detail for each
+// survivor and pack their transforms by level. The camera is a scene-space
+// position with w = 1, or for parallel projection anything with w = 0.
+// pixelsPerUnit is the size of one scene unit on screen at unit distance
+// from the camera, or at any distance for parallel projection.
+void instancesCull(InstanceDraws &draws, const InstanceScene &scene, const glm::vec4 planes[6],
+                   const glm::vec4 &camera, float pixelsPerUnit, float maxPixelError, const MeshLod *lods,
+                   int numLods, ThreadPool &pool)
+{
+    int numChunks = int((scene.numInstances + instancesChunkSize - 1) / instancesChunkSize);
+    numLods = std::max(numLods, 1);
+
+    draws.chunkVisible.resize(numChunks);
+    parallelFor(pool, numChunks, 1, [&](int first, int last, int) {
+        for (int chunk = first; chunk < last; chunk++) {
+            std::vector<std::vector<std::uint32_t> > &visible = draws.chunkVisible[chunk];
+            visible.resize(numLods);
+            for (int level = 0; level < numLods; level++) {
+                visible[level].clear();
+            }
+            std::size_t begin = chunk * instancesChunkSize;
+            std::size_t end = std::min(begin + instancesChunkSize, scene.numInstances);
+            instancesCullRange(scene, begin, end, planes, camera, pixelsPerUnit, maxPixelError, lods, numLods,
+                               visible);
+        }
+    });
+
+    // -- Compact the survivors, level by level and chunk by chunk
+    draws.levelFirst.assign(numLods, 0);
+    draws.levelCount.assign(numLods, 0);
+    std::vector<std::uint32_t> offsets(numLods * numChunks);
+    std::uint32_t total = 0;
+    for (int level = 0; level < numLods; level++) {
+        draws.levelFirst[level] = total;
+        for (int chunk = 0; chunk < numChunks; chunk++) {
+            offsets[level * numChunks + chunk] = total;
+            total += draws.chunkVisible[chunk][level].size();
+        }
+        draws.levelCount[level] = total - draws.levelFirst[level];
+    }
+    draws.transforms.resize(total);
+    parallelFor(pool, numChunks, 1, [&](int first, int last, int) {
+        for (int chunk = first; chunk < last; chunk++) {
+            for (int level = 0; level < numLods; level++) {
+                const std::vector<std::uint32_t> &visible = draws.chunkVisible[chunk][level];
+                InstanceTransform *out = draws.transforms.data() + offsets[level * numChunks + chunk];
+                for (std::size_t i = 0; i < visible.size(); i++) {
+                    out[i] = scene.transforms[visible[i]];
+                }
+            }
+        }
+    });
+}
@@ -0,0 +1,267 @@
+#pragma once
+
+#include "mesh_optimize.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Size limits of a meshlet, and how far a triangle may face away from the
+// average normal of a meshlet to join it (the cosine of the angle). Tight
+// normal cones are what make meshlets cullable as back-facing.
+const std::size_t maxMeshletTriangles = 128;
+const std::size_t maxMeshletVertices = 64;
+const float meshletJoinCos = 0.7f;
+
+// A run of triangles in the index buffer with bounds for culling it as a
+// whole: a bounding sphere, and a cone around coneAxis holding the normals
+// of all its triangles. coneCos is at most 0 when the normals spread over a
+// half space or more, and such meshlets are never back-facing.
+struct Meshlet {
+    std::uint32_t firstIndex;
+    std::uint32_t numIndices;
+    glm::vec3 center;
+    float radius;
+    glm::vec3 coneAxis;
+    float coneCos;
+    float coneSin;
+};
+
+namespace {
+glm::vec3 meshletFaceNormal(const glm::vec3 *vertices, const std::uint32_t *triangle)
+{
+    const glm::vec3 &v0 = vertices[triangle[0]];
+    glm::vec3 normal = glm::cross(vertices[triangle[1]] - v0, vertices[triangle[2]] - v0);
+    float length = glm::length(normal);
+    return length > 0.0f ? normal / length : glm::vec3(0.0f);
+}
+
+// Bounding sphere and normal cone of the triangles of a meshlet
+void meshletBounds(Meshlet &meshlet, const glm::vec3 *vertices, const std::uint32_t *triangles)
+{
+    glm::vec3 lo = vertices[triangles[0]], hi = lo;
+    glm::vec3 normalSum(0.0f);
+    for (std::uint32_t i = 0; i < meshlet.numIndices; i++) {
+        lo = glm::min(lo, vertices[triangles[i]]);
+        hi = glm::max(hi, vertices[triangles[i]]);
+        if (i % 3 == 0) {
+            normalSum += meshletFaceNormal(vertices, triangles + i);
+        }
+    }
+    meshlet.center = (lo + hi) * 0.5f;
+    meshlet.radius = 0.0f;
+    for (std::uint32_t i = 0; i < meshlet.numIndices; i++) {
+        meshlet.radius = std::max(meshlet.radius, glm::length(vertices[triangles[i]] - meshlet.center));
+    }
+
+    float length = glm::length(normalSum);
+    meshlet.coneAxis = length > 0.0f ? normalSum / length : glm::vec3(0.0f, 0.0f, 1.0f);
+    meshlet.coneCos = length > 0.0f ? 1.0f : -1.0f;
+    for (std::uint32_t i = 0; i < meshlet.numIndices; i += 3) {
+        glm::vec3 normal = meshletFaceNormal(vertices, triangles + i);
+        if (normal != glm::vec3(0.0f)) {
+            meshlet.coneCos = std::min(meshlet.coneCos, glm::dot(normal, meshlet.coneAxis));
+        }
+    }
+    meshlet.coneSin = std::sqrt(std::max(1.0f - meshlet.coneCos * meshlet.coneCos, 0.0f));
+}
+} // namespace
+
+// Group the triangles of indices[0] to indices[numIndices - 1] into
+// meshlets, reordering them in place, and append the meshlets, whose first
+// index is counted from firstIndex. A meshlet is grown from the first
+// triangle left in the current order by repeatedly adding the adjacent
+// triangle that brings the fewest new vertices, and among those the one
+// closest to its average normal, until it is full or no neighbour is
+// within the join angle. The triangles of each meshlet are then reordered
+// for the vertex cache.
+void meshletsBuild(std::vector<Meshlet> &meshlets, const glm::vec3 *vertices, std::size_t numVertices,
+                   std::uint32_t *indices, std::size_t numIndices, std::uint32_t firstIndex)
+{
+    std::vector<std::uint32_t> input(indices, indices + numIndices);
+    std::size_t numTriangles = numIndices / 3;
+    VertexTriangles adjacency;
+    vertexTrianglesBuild(adjacency, input, numVertices);
+    std::vector<glm::vec3> normals(numTriangles);
+    for (std::size_t t = 0; t < numTriangles; t++) {
+        normals[t] = meshletFaceNormal(vertices, &input[3 * t]);
+    }
+
+    std::vector<char> emitted(numTriangles, 0);
+    std::vector<std::uint32_t> stamp(numVertices, 0); // Number of the last meshlet using a vertex
+    std::vector<std::uint32_t> localIndex(numVertices);
+    std::vector<std::uint32_t> meshletVertices;
+    std::vector<std::uint32_t> candidates;
+    std::vector<std::uint32_t> local;
+    std::uint32_t meshletNumber = 0;
+    std::size_t numEmitted = 0;
+    std::size_t cursor = 0; // Triangles before it have been emitted
+
+    while (numEmitted < numIndices) {
+        meshletNumber++;
+        Meshlet meshlet = Meshlet();
+        meshlet.firstIndex = firstIndex + numEmitted;
+        meshletVertices.clear();
+        candidates.clear();
+        glm::vec3 normalSum(0.0f);
+
+        while (emitted[cursor]) {
+            cursor++;
+        }
+        std::int64_t next = cursor;
+        while (next >= 0) {
+            // -- Add the triangle and queue the ones around its new vertices
+            std::uint32_t t = next;
+            emitted[t] = 1;
+            for (int k = 0; k < 3; k++) {
+                std::uint32_t v = input[3 * t + k];
+                indices[numEmitted++] = v;
+                if (stamp[v] == meshletNumber) {
+                    continue;
+                }
+                stamp[v] = meshletNumber;
+                localIndex[v] = meshletVertices.size();
+                meshletVertices.push_back(v);
+                for (std::uint32_t j = adjacency.start[v]; j < adjacency.start[v + 1]; j++) {
+                    if (!emitted[adjacency.triangles[j]]) {
+                        candidates.push_back(adjacency.triangles[j]);
+                    }
+                }
+            }
+            meshlet.numIndices += 3;
+            normalSum += normals[t];
+            if (meshlet.numIndices / 3 == maxMeshletTriangles) {
+                break;
+            }
+
+            // -- Pick the next triangle, dropping the emitted ones from the
+            // candidates on the way
+            float length = glm::length(normalSum);
+            glm::vec3 axis = length > 0.0f ? normalSum / length : glm::vec3(0.0f);
+            next = -1;
+            int bestNewVertices = 4;
+            float bestCos = -2.0f;
+            std::size_t numCandidates = 0;
+            for (std::size_t i = 0; i < candidates.size(); i++) {
+                std::uint32_t c = candidates[i];
+                if (emitted[c]) {
+                    continue;
+                }
+                candidates[numCandidates++] = c;
+                int newVertices = 0;
+                for (int k = 0; k < 3; k++) {
+                    newVertices += stamp[input[3 * c + k]] != meshletNumber;
+                }
+                float cosine = glm::dot(normals[c], axis);
+                if (meshletVertices.size() + newVertices > maxMeshletVertices ||
+                    (cosine < meshletJoinCos && normals[c] != glm::vec3(0.0f))) {
+                    continue;
+                }
+                if (newVertices < bestNewVertices || (newVertices == bestNewVertices && cosine > bestCos)) {
+                    bestNewVertices = newVertices;
+                    bestCos = cosine;
+                    next = c;
+                }
+            }
+            candidates.resize(numCandidates);
+        }
+
+        // -- Order the triangles of the meshlet for the vertex cache, on
+        // vertices numbered within the meshlet
+        std::uint32_t *triangles = indices + (meshlet.firstIndex - firstIndex);
+        local.resize(meshlet.numIndices);
+        for (std::uint32_t i = 0; i < meshlet.numIndices; i++) {
+            local[i] = localIndex[triangles[i]];
+        }
+        meshOptimizeVertexCache(local, meshletVertices.size(), vertexCacheSize, nullptr);
+        for (std::uint32_t i = 0; i < meshlet.numIndices; i++) {
+            triangles[i] = meshletVertices[local[i]];
+        }
+
+        meshletBounds(meshlet, vertices, triangles);
+        meshlets.push_back(meshlet);
+    }
+}
+
+// Planes of the view frustum of a model-view-projection matrix, in model
+// space, from Gribb and Hartmann, "Fast Extraction of Viewing Frustum Planes
+// from the World-View-Projection Matrix" (2001). Points inside have
+// dot(plane.xyz, p) + plane.w >= 0 for all planes, and the planes are
+// normalized so that this is the distance.
+void frustumPlanes(const glm::mat4 &mvp, glm::vec4 planes[6])
+{
+    glm::vec4 row[4];
+    for (int i = 0; i < 4; i++) {
+        row[i] = glm::vec4(mvp[0][i], mvp[1][i], mvp[2][i], mvp[3][i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        planes[2 * i + 0] = row[3] + row[i];
+        planes[2 * i + 1] = row[3] - row[i];
+    }
+    for (int i = 0; i < 6; i++) {
+        planes[i] /= std::max(glm::length(glm::vec3(planes[i])), 1e-20f);
+    }
+}
+
+// Struct for the meshlets that survived culling, merged where they are
+// adjacent in the index buffer, as arguments for glMultiDrawElements()
+struct MeshletDraws {
+    std::vector<int> counts;
+    std::vector<const void *> offsets;
+    std::size_t numTriangles;
+};
+
+// Cull meshlets outside the frustum planes or, optionally, facing away from
+// the camera. The camera is a model-space position with w = 1, or for
+// parallel projection the view direction with w = 0. Offsets are in bytes
+// for indices of indexSize bytes.
+void meshletsCull(MeshletDraws &draws, const Meshlet *meshlets, std::size_t numMeshlets,
+                  const glm::vec4 planes[6], const glm::vec4 &camera, bool cullBackFaces, std::size_t indexSize)
+{
+    draws.counts.clear();
+    draws.offsets.clear();
+    draws.numTriangles = 0;
+    std::uint32_t end = 0; // One past the last index drawn
+
+    for (std::size_t m = 0; m < numMeshlets; m++) {
+        const Meshlet &meshlet = meshlets[m];
+
+        // -- Outside one of the planes
+        bool visible = true;
+        for (int i = 0; i < 6 && visible; i++) {
+            visible = glm::dot(glm::vec3(planes[i]), meshlet.center) + planes[i].w >= -meshlet.radius;
+        }
+
+        // -- All triangles face away: the view direction to every point of
+        // the sphere is within 90 degrees of every normal in the cone. With
+        // theta the angle of the view direction to the center from the cone
+        // axis, that is cos(theta + cone angle) > radius / distance.
+        if (visible && cullBackFaces && meshlet.coneCos > 0.0f) {
+            glm::vec3 view = camera.w != 0.0f ? meshlet.center - glm::vec3(camera) : glm::vec3(camera);
+            float distance = glm::length(view);
+            float margin = camera.w != 0.0f ? meshlet.radius : 0.0f;
+            if (distance > margin) {
+                float cosTheta = glm::dot(view, meshlet.coneAxis) / distance;
+                float sinTheta = std::sqrt(std::max(1.0f - cosTheta * cosTheta, 0.0f));
+                visible = cosTheta * meshlet.coneCos - sinTheta * meshlet.coneSin <= margin / distance;
+            }
+        }
+        if (!visible) {
+            continue;
+        }
+
+        if (!draws.counts.empty() && meshlet.firstIndex == end) {
+            draws.counts.back() += meshlet.numIndices;
+        }
+        else {
+            draws.counts.push_back(meshlet.numIndices);
+            draws.offsets.push_back(reinterpret_cast<const void *>(meshlet.firstIndex * indexSize));
+        }
+        end = meshlet.firstIndex + meshlet.numIndices;
+        draws.numTriangles += meshlet.numIndices / 3;
+    }
+}
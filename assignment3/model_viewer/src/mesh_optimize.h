@@ -0,0 +1,287 @@
+#pragma once
+
+#include "utils2.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+// Size of the post-transform vertex cache the triangles are ordered for and
+// the statistics are simulated with. Real caches vary, but an order that is
+// good for 16 entries is good for any size around it.
+const int vertexCacheSize = 16;
+
+// Statistics of a post-transform vertex cache, simulated as a FIFO
+struct VertexCacheStats {
+    float acmr; // Average cache miss ratio, vertex shader runs per triangle (0.5 at best)
+    float atvr; // Average transformed vertex ratio, vertex shader runs per vertex (1 at best)
+};
+
+VertexCacheStats vertexCacheSimulate(const std::vector<std::uint32_t> &indices, std::size_t numVertices,
+                                     int cacheSize)
+{
+    // A vertex is in the cache if it missed within the last cacheSize misses
+    std::vector<std::uint32_t> missTime(numVertices, 0);
+    std::uint32_t misses = 0;
+    for (std::size_t i = 0; i < indices.size(); i++) {
+        std::uint32_t v = indices[i];
+        if (missTime[v] == 0 || misses + 1 - missTime[v] > std::uint32_t(cacheSize)) {
+            misses++;
+            missTime[v] = misses;
+        }
+    }
+
+    VertexCacheStats stats;
+    stats.acmr = indices.empty() ? 0.0f : float(misses) / (indices.size() / 3);
+    stats.atvr = numVertices == 0 ? 0.0f : float(misses) / numVertices;
+    return stats;
+}
+
+namespace {
+// Triangles around each vertex in compressed form: the triangles of vertex v
+// are triangles[start[v]] to triangles[start[v + 1] - 1]
+struct VertexTriangles {
+    std::vector<std::uint32_t> start;
+    std::vector<std::uint32_t> triangles;
+};
+
+void vertexTrianglesBuild(VertexTriangles &adjacency, const std::vector<std::uint32_t> &indices,
+                          std::size_t numVertices)
+{
+    adjacency.start.assign(numVertices + 1, 0);
+    for (std::size_t i = 0; i < indices.size(); i++) {
+        adjacency.start[indices[i] + 1]++;
+    }
+    for (std::size_t v = 0; v < numVertices; v++) {
+        adjacency.start[v + 1] += adjacency.start[v];
+    }
+    adjacency.triangles.resize(indices.size());
+    std::vector<std::uint32_t> next(adjacency.start.begin(), adjacency.start.end() - 1);
+    for (std::size_t i = 0; i < indices.size(); i++) {
+        adjacency.triangles[next[indices[i]]++] = i / 3;
+    }
+}
+} // namespace
+
+// Reorder triangles for the post-transform vertex cache with Tipsify, from
+// Sander et al., "Fast Triangle Reordering for Vertex Locality and Reduced
+// Overdraw" (2007). Triangles are emitted as fans around a vertex, and the
+// next fan is chosen among the vertices just touched, preferring those that
+// will still be in the cache once their remaining triangles are emitted.
+// The order runs in linear time. Optionally returns the first triangle of
+// each cluster, which starts wherever the fans had to restart outside the
+// cache.
+void meshOptimizeVertexCache(std::vector<std::uint32_t> &indices, std::size_t numVertices, int cacheSize,
+                             std::vector<std::uint32_t> *clusters)
+{
+    std::size_t numTriangles = indices.size() / 3;
+    VertexTriangles adjacency;
+    vertexTrianglesBuild(adjacency, indices, numVertices);
+
+    std::vector<std::uint32_t> liveTriangles(numVertices);
+    for (std::size_t v = 0; v < numVertices; v++) {
+        liveTriangles[v] = adjacency.start[v + 1] - adjacency.start[v];
+    }
+    std::vector<std::uint32_t> cacheTime(numVertices, 0);
+    std::vector<char> emitted(numTriangles, 0);
+    std::vector<std::uint32_t> deadEnds; // Recently touched vertices, to restart from
+    std::vector<std::uint32_t> candidates;
+    std::vector<std::uint32_t> result;
+    result.reserve(indices.size());
+    if (clusters) {
+        clusters->clear();
+    }
+
+    std::uint32_t time = cacheSize + 1;
+    std::size_t cursor = 0; // Vertices before it have no live triangles left
+    std::int64_t fan = numVertices > 0 ? 0 : -1;
+    bool restarted = true;
+    while (fan >= 0) {
+        std::uint32_t first = result.size() / 3;
+        if (restarted && clusters && first < numTriangles && (clusters->empty() || clusters->back() != first)) {
+            clusters->push_back(first);
+        }
+
+        // -- Emit the remaining triangles around the fanning vertex
+        candidates.clear();
+        for (std::uint32_t i = adjacency.start[fan]; i < adjacency.start[fan + 1]; i++) {
+            std::uint32_t t = adjacency.triangles[i];
+            if (emitted[t]) {
+                continue;
+            }
+            emitted[t] = 1;
+            for (int k = 0; k < 3; k++) {
+                std::uint32_t v = indices[3 * t + k];
+                result.push_back(v);
+                deadEnds.push_back(v);
+                candidates.push_back(v);
+                liveTriangles[v]--;
+                if (time - cacheTime[v] > std::uint32_t(cacheSize)) {
+                    cacheTime[v] = time++;
+                }
+            }
+        }
+
+        // -- Pick the touched vertex that has been in the cache longest and
+        // will still be in it after emitting its fan
+        std::int64_t next = -1;
+        std::int64_t bestPriority = -1;
+        for (std::size_t i = 0; i < candidates.size(); i++) {
+            std::uint32_t v = candidates[i];
+            if (liveTriangles[v] == 0) {
+                continue;
+            }
+            std::int64_t priority = 0;
+            if (time - cacheTime[v] + 2 * liveTriangles[v] <= std::uint32_t(cacheSize)) {
+                priority = time - cacheTime[v];
+            }
+            if (priority > bestPriority) {
+                bestPriority = priority;
+                next = v;
+            }
+        }
+        restarted = false;
+
+        // -- Otherwise restart from the most recently touched vertex with
+        // live triangles, or the next one in input order
+        if (next < 0) {
+            while (!deadEnds.empty() && next < 0) {
+                std::uint32_t v = deadEnds.back();
+                deadEnds.pop_back();
+                if (liveTriangles[v] > 0) {
+                    next = v;
+                }
+            }
+            for (; next < 0 && cursor < numVertices; cursor++) {
+                if (liveTriangles[cursor] > 0) {
+                    next = cursor;
+                }
+            }
+            restarted = next >= 0 && time - cacheTime[next] > std::uint32_t(cacheSize);
+        }
+        fan = next;
+    }
+    indices.swap(result);
+}
+
+// Reorder the clusters from meshOptimizeVertexCache() so that the ones
+// likely to occlude others are drawn first, with the view-independent
+// measure of Sander et al.: clusters on the outside of the mesh and facing
+// away from its center come first. The triangle order within each cluster,
+// and with it the cache efficiency, is kept.
+void meshOptimizeOverdraw(const std::vector<glm::vec3> &vertices, std::vector<std::uint32_t> &indices,
+                          const std::vector<std::uint32_t> &clusters)
+{
+    std::size_t numTriangles = indices.size() / 3;
+    std::size_t numClusters = clusters.size();
+    if (numClusters < 2) {
+        return;
+    }
+
+    // -- Area-weighted centroid and normal of each cluster and the mesh
+    std::vector<glm::vec3> centroids(numClusters, glm::vec3(0.0f));
+    std::vector<glm::vec3> normals(numClusters, glm::vec3(0.0f));
+    std::vector<float> areas(numClusters, 0.0f);
+    glm::vec3 meshCentroid(0.0f);
+    float meshArea = 0.0f;
+    for (std::size_t c = 0; c < numClusters; c++) {
+        std::size_t end = c + 1 < numClusters ? clusters[c + 1] : numTriangles;
+        for (std::size_t t = clusters[c]; t < end; t++) {
+            const glm::vec3 &v0 = vertices[indices[3 * t + 0]];
+            const glm::vec3 &v1 = vertices[indices[3 * t + 1]];
+            const glm::vec3 &v2 = vertices[indices[3 * t + 2]];
+            glm::vec3 normal = glm::cross(v1 - v0, v2 - v0);
+            float area = 0.5f * glm::length(normal);
+            centroids[c] += (v0 + v1 + v2) * (area / 3.0f);
+            normals[c] += normal;
+            areas[c] += area;
+        }
+        meshCentroid += centroids[c];
+        meshArea += areas[c];
+        centroids[c] /= std::max(areas[c], 1e-20f);
+    }
+    meshCentroid /= std::max(meshArea, 1e-20f);
+
+    std::vector<float> keys(numClusters);
+    std::vector<std::uint32_t> order(numClusters);
+    for (std::size_t c = 0; c < numClusters; c++) {
+        float length = glm::length(normals[c]);
+        glm::vec3 normal = length > 0.0f ? normals[c] / length : glm::vec3(0.0f);
+        keys[c] = glm::dot(centroids[c] - meshCentroid, normal);
+        order[c] = c;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b) {
+        return keys[a] > keys[b];
+    });
+
+    std::vector<std::uint32_t> result;
+    result.reserve(indices.size());
+    for (std::size_t i = 0; i < numClusters; i++) {
+        std::size_t c = order[i];
+        std::size_t end = c + 1 < numClusters ? clusters[c + 1] : numTriangles;
+        result.insert(result.end(), indices.begin() + 3 * clusters[c], indices.begin() + 3 * end);
+    }
+    indices.swap(result);
+}
+
+// Renumber the vertices in the order the triangles first use them, so that
+// vertex fetches walk through memory. Vertices no triangle uses are dropped.
+void meshOptimizeVertexFetch(OBJMesh &mesh)
+{
+    const std::uint32_t unused = 0xffffffff;
+    std::vector<std::uint32_t> remap(mesh.vertices.size(), unused);
+    std::uint32_t numUsed = 0;
+    for (std::size_t i = 0; i < mesh.indices.size(); i++) {
+        std::uint32_t &index = mesh.indices[i];
+        if (remap[index] == unused) {
+            remap[index] = numUsed++;
+        }
+        index = remap[index];
+    }
+
+    std::vector<glm::vec3> vertices(numUsed), normals(mesh.normals.empty() ? 0 : numUsed);
+    std::vector<glm::vec2> texcoords(mesh.texcoords.empty() ? 0 : numUsed);
+    for (std::size_t v = 0; v < remap.size(); v++) {
+        std::uint32_t to = remap[v];
+        if (to == unused) {
+            continue;
+        }
+        vertices[to] = mesh.vertices[v];
+        if (!normals.empty()) {
+            normals[to] = mesh.normals[v];
+        }
+        if (!texcoords.empty()) {
+            texcoords[to] = mesh.texcoords[v];
+        }
+    }
+    mesh.vertices.swap(vertices);
+    mesh.normals.swap(normals);
+    mesh.texcoords.swap(texcoords);
+}
+
+// Reorder the triangles of a mesh for the vertex cache and, optionally,
+// overdraw, then its vertices for fetch locality, and log the cache
+// statistics before and after
+void meshOptimize(OBJMesh &mesh, bool overdraw)
+{
+    VertexCacheStats before = vertexCacheSimulate(mesh.indices, mesh.vertices.size(), vertexCacheSize);
+
+    std::vector<std::uint32_t> clusters;
+    meshOptimizeVertexCache(mesh.indices, mesh.vertices.size(), vertexCacheSize, overdraw ? &clusters : nullptr);
+    if (overdraw) {
+        meshOptimizeOverdraw(mesh.vertices, mesh.indices, clusters);
+    }
+    meshOptimizeVertexFetch(mesh);
+
+    VertexCacheStats after = vertexCacheSimulate(mesh.indices, mesh.vertices.size(), vertexCacheSize);
+    std::cout << "Vertex cache ACMR " << before.acmr << " -> " << after.acmr
+              << ", ATVR " << before.atvr << " -> " << after.atvr;
+    if (overdraw) {
+        std::cout << " (" << clusters.size() << " overdraw clusters)";
+    }
+    std::cout << std::endl;
+}
@@ -0,0 +1,267 @@
+#pragma once
+
+#include "utils2.h"
+#include "mesh_optimize.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// A level of detail of a mesh. All levels share the vertices of the full
+// mesh and differ in their indices, which for level i > 0 are a range of
+// one array holding all levels.
+struct MeshLod {
+    std::uint32_t firstIndex;
+    std::uint32_t numIndices;
+    float error; // Distance to the full mesh estimated by the quadrics, in model units
+    float padding;
+};
+
+// Levels are added by halving the triangle count down to this many
+// triangles, or until maxMeshLods levels in total
+const std::size_t minLodTriangles = 256;
+const int maxMeshLods = 8;
+
+// Struct for the error quadric of Garland and Heckbert, "Surface
+// Simplification Using Quadric Error Metrics" (1997): the symmetric 4x4
+// matrix of summed plane equations, each weighted by the area of its face
+struct Quadric {
+    double a00, a01, a02, a03, a11, a12, a13, a22, a23, a33;
+    double weight;
+};
+
+namespace {
+Quadric quadricFromPlane(const glm::vec3 &normal, float d, float weight)
+{
+    double a = normal.x, b = normal.y, c = normal.z;
+    Quadric q = { a * a * weight, a * b * weight, a * c * weight, a * d * weight,
+                  b * b * weight, b * c * weight, b * d * weight,
+                  c * c * weight, c * d * weight, double(d) * d * weight, weight };
+    return q;
+}
+
+void quadricAdd(Quadric &q, const Quadric &other)
+{
+    q.a00 += other.a00; q.a01 += other.a01; q.a02 += other.a02; q.a03 += other.a03;
+    q.a11 += other.a11; q.a12 += other.a12; q.a13 += other.a13;
+    q.a22 += other.a22; q.a23 += other.a23; q.a33 += other.a33;
+    q.weight += other.weight;
+}
+
+// Mean squared distance of p to the planes of a quadric
+double quadricError(const Quadric &q, const glm::vec3 &p)
+{
+    double x = p.x, y = p.y, z = p.z;
+    double error = q.a00 * x * x + 2.0 * q.a01 * x * y + 2.0 * q.a02 * x * z + 2.0 * q.a03 * x +
+                   q.a11 * y * y + 2.0 * q.a12 * y * z + 2.0 * q.a13 * y +
+                   q.a22 * z * z + 2.0 * q.a23 * z + q.a33;
+    return q.weight > 0.0 ? std::max(error, 0.0) / q.weight : 0.0;
+}
+
+struct EdgeCollapse {
+    std::uint32_t from, to;
+    double error;
+};
+} // namespace
+
+// Simplify a mesh to at most targetNumIndices indices by collapsing edges
+// onto one of their vertices, cheapest first by the quadric error, so that
+// the result indexes the original vertices. Each pass collapses edges with
+// no vertex in common and then rebuilds the triangles. Vertices on borders
+// (including attribute seams) are never moved, and collapses that would
+// flip a triangle are skipped. Returns the largest error of a collapse as a
+// distance.
+float meshSimplify(const std::vector<glm::vec3> &vertices, const std::vector<std::uint32_t> &indices,
+                   std::size_t targetNumIndices, std::vector<std::uint32_t> &result)
+{
+    std::size_t numVertices = vertices.size();
+    result = indices;
+
+    // -- Quadrics of the faces around each vertex
+    std::vector<Quadric> quadrics(numVertices, quadricFromPlane(glm::vec3(0.0f), 0.0f, 0.0f));
+    for (std::size_t t = 0; t < indices.size() / 3; t++) {
+        const glm::vec3 &v0 = vertices[indices[3 * t + 0]];
+        glm::vec3 normal = glm::cross(vertices[indices[3 * t + 1]] - v0, vertices[indices[3 * t + 2]] - v0);
+        float length = glm::length(normal);
+        if (length == 0.0f) {
+            continue;
+        }
+        normal /= length;
+        Quadric q = quadricFromPlane(normal, -glm::dot(normal, v0), 0.5f * length);
+        for (int k = 0; k < 3; k++) {
+            quadricAdd(quadrics[indices[3 * t + k]], q);
+        }
+    }
+
+    // -- Lock the vertices on borders, that is on an edge without a twin
+    // running the other way
+    VertexTriangles adjacency;
+    vertexTrianglesBuild(adjacency, indices, numVertices);
+    std::vector<char> locked(numVertices, 0);
+    for (std::size_t i = 0; i < indices.size(); i++) {
+        std::uint32_t a = indices[i];
+        std::uint32_t b = indices[i % 3 == 2 ? i - 2 : i + 1];
+        bool twin = false;
+        for (std::uint32_t j = adjacency.start[b]; j < adjacency.start[b + 1] && !twin; j++) {
+            const std::uint32_t *t = &indices[3 * adjacency.triangles[j]];
+            twin = (t[0] == b && t[1] == a) || (t[1] == b && t[2] == a) || (t[2] == b && t[0] == a);
+        }
+        if (!twin) {
+            locked[a] = locked[b] = 1;
+        }
+    }
+
+    std::vector<std::uint32_t> remap(numVertices);
+    for (std::size_t v = 0; v < numVertices; v++) {
+        remap[v] = v;
+    }
+    std::vector<char> touched(numVertices);
+    std::vector<EdgeCollapse> collapses;
+    double maxError = 0.0;
+
+    while (result.size() > targetNumIndices) {
+        vertexTrianglesBuild(adjacency, result, numVertices);
+
+        // -- Cheapest direction of every edge that can collapse. Interior
+        // edges appear once in each direction, so one of them is taken.
+        collapses.clear();
+        for (std::size_t i = 0; i < result.size(); i++) {
+            std::uint32_t a = result[i];
+            std::uint32_t b = result[i % 3 == 2 ? i - 2 : i + 1];
+            if (a > b) {
+                continue;
+            }
+            Quadric q = quadrics[a];
+            quadricAdd(q, quadrics[b]);
+            EdgeCollapse ab = { a, b, locked[a] ? HUGE_VAL : quadricError(q, vertices[b]) };
+            EdgeCollapse ba = { b, a, locked[b] ? HUGE_VAL : quadricError(q, vertices[a]) };
+            const EdgeCollapse &best = ab.error <= ba.error ? ab : ba;
+            if (best.error != HUGE_VAL) {
+                collapses.push_back(best);
+            }
+        }
+        std::sort(collapses.begin(), collapses.end(), [](const EdgeCollapse &x, const EdgeCollapse &y) {
+            return x.error < y.error;
+        });
+
+        // -- Collapse the cheapest edges with untouched vertices until
+        // enough triangles are gone
+        std::size_t trianglesToRemove = (result.size() - targetNumIndices + 2) / 3;
+        std::size_t removed = 0;
+        std::fill(touched.begin(), touched.end(), 0);
+        for (std::size_t i = 0; i < collapses.size() && removed < trianglesToRemove; i++) {
+            const EdgeCollapse &c = collapses[i];
+            if (touched[c.from] || touched[c.to]) {
+                continue;
+            }
+
+            std::size_t shared = 0;
+            bool flips = false;
+            for (std::uint32_t j = adjacency.start[c.from]; j < adjacency.start[c.from + 1] && !flips; j++) {
+                const std::uint32_t *t = &result[3 * adjacency.triangles[j]];
+                std::uint32_t corners[] = { remap[t[0]], remap[t[1]], remap[t[2]] };
+                if (corners[0] == c.to || corners[1] == c.to || corners[2] == c.to) {
+                    shared++;
+                    continue;
+                }
+                glm::vec3 before = glm::cross(vertices[corners[1]] - vertices[corners[0]],
+                                              vertices[corners[2]] - vertices[corners[0]]);
+                for (int k = 0; k < 3; k++) {
+                    corners[k] = corners[k] == c.from ? c.to : corners[k];
+                }
+                glm::vec3 after = glm::cross(vertices[corners[1]] - vertices[corners[0]],
+                                             vertices[corners[2]] - vertices[corners[0]]);
+                flips = glm::dot(before, after) <= 0.0f && glm::dot(before, before) > 0.0f;
+            }
+            if (flips) {
+                continue;
+            }
+
+            remap[c.from] = c.to;
+            quadricAdd(quadrics[c.to], quadrics[c.from]);
+            touched[c.from] = touched[c.to] = 1;
+            removed += shared;
+            maxError = std::max(maxError, c.error);
+        }
+        if (removed == 0) {
+            break;
+        }
+
+        // -- Move the collapsed corners and drop the triangles that became
+        // degenerate
+        std::size_t numIndices = 0;
+        for (std::size_t i = 0; i < result.size(); i += 3) {
+            std::uint32_t a = remap[result[i]], b = remap[result[i + 1]], c = remap[result[i + 2]];
+            if (a != b && b != c && c != a) {
+                result[numIndices++] = a;
+                result[numIndices++] = b;
+                result[numIndices++] = c;
+            }
+        }
+        result.resize(numIndices);
+    }
+
+    return float(std::sqrt(maxError));
+}
+
+// Build the levels of detail of a mesh by halving the triangle count. Each
+// level is simplified from the full mesh, all in parallel, and ordered for
+// the vertex cache. Levels that do not shrink by a quarter are dropped. The
+// first level is the full mesh itself; the others index into lodIndices.
+void meshBuildLods(const OBJMesh &mesh, std::vector<MeshLod> &lods, std::vector<std::uint32_t> &lodIndices)
+{
+    std::size_t numTriangles = mesh.indices.size() / 3;
+    std::vector<std::size_t> targets;
+    for (std::size_t n = numTriangles / 2; n >= minLodTriangles && int(targets.size()) + 1 < maxMeshLods; n /= 2) {
+        targets.push_back(n * 3);
+    }
+
+    std::vector<std::vector<std::uint32_t> > levels(targets.size());
+    std::vector<float> errors(targets.size());
+    parallelRun(targets.size(), [&](int i) {
+        errors[i] = meshSimplify(mesh.vertices, mesh.indices, targets[i], levels[i]);
+        meshOptimizeVertexCache(levels[i], mesh.vertices.size(), vertexCacheSize, nullptr);
+    });
+
+    MeshLod full = { 0, std::uint32_t(mesh.indices.size()), 0.0f, 0.0f };
+    lods.assign(1, full);
+    lodIndices.clear();
+    for (std::size_t i = 0; i < levels.size(); i++) {
+        if (levels[i].size() * 4 > lods.back().numIndices * 3) {
+            continue;
+        }
+        MeshLod lod = { std::uint32_t(mesh.indices.size() + lodIndices.size()), std::uint32_t(levels[i].size()),
+                        std::max(errors[i], lods.back().error), 0.0f };
+        lods.push_back(lod);
+        lodIndices.insert(lodIndices.end(), levels[i].begin(), levels[i].end());
+    }
+}
+
+// Pick the level of detail for a mesh whose model units cover
+// pixelsPerUnit pixels on screen: the coarsest level whose error stays
+// within maxPixelError. A coarser level than the current one is only taken
+// once its error is below the threshold by the hysteresis fraction, so the
+// level does not flicker back and forth at a boundary.
+int meshSelectLod(const MeshLod *lods, int numLods, float pixelsPerUnit, float maxPixelError,
+                  float hysteresis, int current)
+{
+    int coarsest = 0;
+    int coarsestWithMargin = 0;
+    for (int i = 0; i < numLods; i++) {
+        float pixelError = lods[i].error * pixelsPerUnit;
+        if (pixelError <= maxPixelError) {
+            coarsest = i;
+        }
+        if (pixelError <= maxPixelError * (1.0f - hysteresis)) {
+            coarsestWithMargin = i;
+        }
+    }
+    if (coarsest < current) {
+        return coarsest;
+    }
+    return std::max(coarsestWithMargin, std::min(current, numLods - 1));
+}
@@ -5,6 +5,14 @@
 
 #include "utils.h"
 #include "utils2.h"
+#include "mesh_bvh.h"
+#include "mesh_cache.h"
+#include "mesh_instances.h"
+#include "mesh_meshlets.h"
+#include "mesh_optimize.h"
+#include "mesh_simplify.h"
+#include "parallel.h"
+#include "vertex_format.h"
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
@@ -66,28 +74,72 @@ GLfloat skyboxVertices[] = {
   1.0f, -1.0f,  1.0f
 };
 
+// Worker threads for culling the instances of the scene
+ThreadPool threadPool;
+
 // The attribute locations we will use in the vertex shader
 enum AttributeLocation {
     POSITION = 0,
-    NORMAL = 1
+    NORMAL = 1,
+    INSTANCE_POSITION_SCALE = 2,
+    INSTANCE_ROTATION = 3
 };
 
-// Struct for representing an indexed triangle mesh
+// Struct for representing an indexed triangle mesh. The arrays live in the
+// vectors when the mesh was parsed from its OBJ file and in the mapped
+// cache when it was loaded from there; the pointers refer to them either way.
 struct Mesh {
     std::vector<glm::vec3> vertices;
     std::vector<glm::vec3> normals;
     std::vector<uint32_t> indices;
+    std::vector<MeshLod> lods;
+    std::vector<uint32_t> lodIndices;
+    std::vector<Meshlet> meshlets;
+    MeshCache cache;
+
+    const glm::vec3 *vertexData;
+    const glm::vec3 *normalData;
+    const uint32_t *indexData;
+    const MeshLod *lodData;
+    const uint32_t *lodIndexData;
+    const Meshlet *meshletData;
+    int numVertices;
+    int numIndices;
+    int numLods;
+    int numLodIndices;
+    int numMeshlets;
+
+    // Bounding sphere
+    glm::vec3 center;
+    float radius;
+
+    Mesh() : vertexData(nullptr), normalData(nullptr), indexData(nullptr), lodData(nullptr),
+             lodIndexData(nullptr), meshletData(nullptr), numVertices(0), numIndices(0), numLods(0),
+             numLodIndices(0), numMeshlets(0), center(0.0f), radius(0.0f) {}
 };
 
 // Struct for representing a vertex array object (VAO) created from a
 // mesh. Used for rendering.
 struct MeshVAO {
     GLuint vao;
-    GLuint vertexVBO;
-    GLuint normalVBO;
+    GLuint vertexVBO; // Interleaved positions and normals
     GLuint indexVBO;
     int numVertices;
     int numIndices;
+
+    VertexFormat vertexFormat;
+    GLenum indexType; // GL_UNSIGNED_SHORT when the vertices allow, else GL_UNSIGNED_INT
+    glm::vec3 positionScale;
+    glm::vec3 positionOffset;
+    int vertexBytes;
+    int indexBytes;
+
+    // Levels of detail, all drawn from the one index buffer, and the
+    // meshlets of all levels
+    std::vector<MeshLod> lods;
+    std::vector<Meshlet> meshlets;
+    glm::vec3 center;
+    float radius;
 };
 
 // Struct for resources and state
@@ -103,6 +155,50 @@ struct Context {
     GLuint defaultVAO;
     float elapsed_time;
 
+    // Layout of the mesh vertex buffer. The VAO is rebuilt when it changes.
+    VertexFormat vertex_format;
+    int mesh_buffer_kb; // Size of the vertex and index buffers
+
+    // Level of detail selection
+    bool lod_enabled;
+    float lod_pixel_error; // Largest allowed simplification error on screen
+    float lod_hysteresis;  // Fraction below the error a coarser level must get to be picked
+    int lod_level;
+    int lod_triangles;
+
+    // Meshlet culling
+    bool meshlet_culling;
+    bool meshlet_cone_culling;
+    MeshletDraws meshlet_draws;
+    float meshlet_culled_percent; // Triangles of the level culled
+    int meshlet_draw_count;       // Ranges passed to glMultiDrawElements
+
+    // Picking and distance queries on the full mesh, with the transforms
+    // of the last frame
+    MeshBVH bvh;
+    glm::mat4 mesh_mv;
+    glm::mat4 mesh_mvp;
+    int pick_triangle;      // -1 if the last click missed the mesh
+    float pick_time_ms;
+    float surface_distance; // From the eye to the mesh, in model units
+
+    // Scene mode: instances of the mesh scattered on the ground, culled
+    // and given a level of detail each on the CPU, then drawn instanced
+    bool scene_mode;
+    bool instancing_supported;
+    int scene_instances;
+    InstanceScene scene;
+    InstanceDraws instance_draws;
+    GLuint instanceVBO;
+    int scene_visible;
+    int scene_triangles;
+    float scene_cull_ms;
+
+    // Frame timing, smoothed over recent frames
+    double frame_start;
+    float frame_ms;
+    float fps;
+
     // My settings
     bool ambient_toggle;
     bool diffuse_toggle;
@@ -193,48 +289,148 @@ std::string cubemapDir(void)
 
 void loadMesh(const std::string &filename, Mesh *mesh)
 {
-    OBJMesh obj_mesh;
-    objMeshLoad(obj_mesh, filename);
-    mesh->vertices = obj_mesh.vertices;
-    mesh->normals = obj_mesh.normals;
-    mesh->indices = obj_mesh.indices;
+    // Map the binary cache if it is up to date with the OBJ file
+    if (meshCacheLoad(mesh->cache, filename)) {
+        mesh->vertexData = mesh->cache.vertices;
+        mesh->normalData = mesh->cache.normals;
+        mesh->indexData = mesh->cache.indices;
+        mesh->lodData = mesh->cache.lods;
+        mesh->lodIndexData = mesh->cache.lodIndices;
+        mesh->meshletData = mesh->cache.meshlets;
+        mesh->numVertices = mesh->cache.header->numVertices;
+        mesh->numIndices = mesh->cache.header->numIndices;
+        mesh->numLods = mesh->cache.header->numLods;
+        mesh->numLodIndices = mesh->cache.header->numLodIndices;
+        mesh->numMeshlets = mesh->cache.header->numMeshlets;
+    }
+    else {
+        // Otherwise parse and optimize the OBJ file, build its levels of
+        // detail and meshlets and write the cache for the next start. The
+        // meshlets regroup the triangles, so the vertices are put back in
+        // fetch order before the levels of detail refer to them.
+        OBJMesh obj_mesh;
+        if (objMeshLoad(obj_mesh, filename)) {
+            meshOptimize(obj_mesh, true);
+            meshletsBuild(mesh->meshlets, obj_mesh.vertices.data(), obj_mesh.vertices.size(),
+                          obj_mesh.indices.data(), obj_mesh.indices.size(), 0);
+            meshOptimizeVertexFetch(obj_mesh);
+            meshBuildLods(obj_mesh, mesh->lods, mesh->lodIndices);
+            for (size_t i = 1; i < mesh->lods.size(); i++) {
+                const MeshLod &lod = mesh->lods[i];
+                meshletsBuild(mesh->meshlets, obj_mesh.vertices.data(), obj_mesh.vertices.size(),
+                              &mesh->lodIndices[lod.firstIndex - obj_mesh.indices.size()], lod.numIndices,
+                              lod.firstIndex);
+            }
+            meshCacheWrite(obj_mesh, mesh->lods, mesh->lodIndices, mesh->meshlets, filename);
+        }
+        else {
+            MeshLod empty = { 0, 0, 0.0f, 0.0f };
+            mesh->lods.assign(1, empty);
+        }
+        mesh->vertices.swap(obj_mesh.vertices);
+        mesh->normals.swap(obj_mesh.normals);
+        mesh->indices.swap(obj_mesh.indices);
+        mesh->vertexData = mesh->vertices.data();
+        mesh->normalData = mesh->normals.data();
+        mesh->indexData = mesh->indices.data();
+        mesh->lodData = mesh->lods.data();
+        mesh->lodIndexData = mesh->lodIndices.data();
+        mesh->meshletData = mesh->meshlets.data();
+        mesh->numVertices = mesh->vertices.size();
+        mesh->numIndices = mesh->indices.size();
+        mesh->numLods = mesh->lods.size();
+        mesh->numLodIndices = mesh->lodIndices.size();
+        mesh->numMeshlets = mesh->meshlets.size();
+    }
+
+    // Bounding sphere around the center of the bounding box
+    glm::vec3 lo(0.0f), hi(0.0f);
+    if (mesh->numVertices > 0) {
+        lo = hi = mesh->vertexData[0];
+    }
+    for (int i = 1; i < mesh->numVertices; i++) {
+        lo = glm::min(lo, mesh->vertexData[i]);
+        hi = glm::max(hi, mesh->vertexData[i]);
+    }
+    mesh->center = (lo + hi) * 0.5f;
+    mesh->radius = 0.0f;
+    for (int i = 0; i < mesh->numVertices; i++) {
+        mesh->radius = std::max(mesh->radius, glm::length(mesh->vertexData[i] - mesh->center));
+    }
 }
 
 void createMeshVAO(Context &ctx, const Mesh &mesh, MeshVAO *meshVAO)
 {
+    // Packs the vertices into one interleaved buffer. Normals are packed
+    // into 10 bits per component where the type is supported.
+    bool normals1010102 = GLEW_VERSION_3_3 || GLEW_ARB_vertex_type_2_10_10_10_rev;
+    PackedVertices packed;
+    packVertices(packed, ctx.vertex_format, normals1010102, mesh.vertexData, mesh.normalData, mesh.numVertices);
+
     // Generates and populates a VBO for the vertices
     glGenBuffers(1, &(meshVAO->vertexVBO));
     glBindBuffer(GL_ARRAY_BUFFER, meshVAO->vertexVBO);
-    auto verticesNBytes = mesh.vertices.size() * sizeof(mesh.vertices[0]);
-    glBufferData(GL_ARRAY_BUFFER, verticesNBytes, mesh.vertices.data(), GL_STATIC_DRAW);
-
-    // Generates and populates a VBO for the vertex normals
-    glGenBuffers(1, &(meshVAO->normalVBO));
-    glBindBuffer(GL_ARRAY_BUFFER, meshVAO->normalVBO);
-    auto normalsNBytes = mesh.normals.size() * sizeof(mesh.normals[0]);
-    glBufferData(GL_ARRAY_BUFFER, normalsNBytes, mesh.normals.data(), GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, packed.data.size(), packed.data.data(), GL_STATIC_DRAW);
 
-    // Generates and populates a VBO for the element indices
+    // Generates and populates a VBO for the element indices of all levels
+    // of detail, with 16-bit indices if all vertices can be addressed with them
     glGenBuffers(1, &(meshVAO->indexVBO));
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshVAO->indexVBO);
-    auto indicesNBytes = mesh.indices.size() * sizeof(mesh.indices[0]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indicesNBytes, mesh.indices.data(), GL_STATIC_DRAW);
+    if (mesh.numVertices <= 0x10000) {
+        std::vector<uint16_t> indices(mesh.indexData, mesh.indexData + mesh.numIndices);
+        indices.insert(indices.end(), mesh.lodIndexData, mesh.lodIndexData + mesh.numLodIndices);
+        meshVAO->indexType = GL_UNSIGNED_SHORT;
+        meshVAO->indexBytes = indices.size() * sizeof(indices[0]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, meshVAO->indexBytes, indices.data(), GL_STATIC_DRAW);
+    }
+    else {
+        int levelBytes = mesh.numIndices * sizeof(mesh.indexData[0]);
+        int lodBytes = mesh.numLodIndices * sizeof(mesh.lodIndexData[0]);
+        meshVAO->indexType = GL_UNSIGNED_INT;
+        meshVAO->indexBytes = levelBytes + lodBytes;
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, meshVAO->indexBytes, nullptr, GL_STATIC_DRAW);
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, levelBytes, mesh.indexData);
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, levelBytes, lodBytes, mesh.lodIndexData);
+    }
 
     // Creates a vertex array object (VAO) for drawing the mesh
     glGenVertexArrays(1, &(meshVAO->vao));
     glBindVertexArray(meshVAO->vao);
     glBindBuffer(GL_ARRAY_BUFFER, meshVAO->vertexVBO);
     glEnableVertexAttribArray(POSITION);
-    glVertexAttribPointer(POSITION, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
-    glBindBuffer(GL_ARRAY_BUFFER, meshVAO->normalVBO);
     glEnableVertexAttribArray(NORMAL);
-    glVertexAttribPointer(NORMAL, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+    if (packed.format == VERTEX_FORMAT_QUANTIZED) {
+        glVertexAttribPointer(POSITION, 3, GL_UNSIGNED_SHORT, GL_TRUE, packed.stride,
+                              (void *)offsetof(QuantizedVertex, position));
+        glVertexAttribPointer(NORMAL, 4, normals1010102 ? GL_INT_2_10_10_10_REV : GL_BYTE, GL_TRUE,
+                              packed.stride, (void *)offsetof(QuantizedVertex, normal));
+    }
+    else {
+        glVertexAttribPointer(POSITION, 3, GL_FLOAT, GL_FALSE, packed.stride, (void *)offsetof(FloatVertex, position));
+        glVertexAttribPointer(NORMAL, 3, GL_FLOAT, GL_FALSE, packed.stride, (void *)offsetof(FloatVertex, normal));
+    }
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshVAO->indexVBO);
     glBindVertexArray(ctx.defaultVAO); // unbinds the VAO
 
     // Additional information required by draw calls
-    meshVAO->numVertices = mesh.vertices.size();
-    meshVAO->numIndices = mesh.indices.size();
+    meshVAO->numVertices = mesh.numVertices;
+    meshVAO->numIndices = mesh.numIndices;
+    meshVAO->vertexFormat = packed.format;
+    meshVAO->positionScale = packed.positionScale;
+    meshVAO->positionOffset = packed.positionOffset;
+    meshVAO->vertexBytes = packed.data.size();
+    meshVAO->lods.assign(mesh.lodData, mesh.lodData + mesh.numLods);
+    meshVAO->meshlets.assign(mesh.meshletData, mesh.meshletData + mesh.numMeshlets);
+    meshVAO->center = mesh.center;
+    meshVAO->radius = mesh.radius;
+    ctx.mesh_buffer_kb = (meshVAO->vertexBytes + meshVAO->indexBytes) / 1024;
+}
+
+void destroyMeshVAO(MeshVAO *meshVAO)
+{
+    glDeleteVertexArrays(1, &(meshVAO->vao));
+    glDeleteBuffers(1, &(meshVAO->vertexVBO));
+    glDeleteBuffers(1, &(meshVAO->indexVBO));
 }
 
 void createSkyboxVAO(Context &ctx)
@@ -284,6 +480,27 @@ void init(Context &ctx)
     ctx.normal_toggle    = false;
     ctx.zoom_factor      = 1.0f;
     ctx.ortho_projection = false;
+    ctx.vertex_format    = VERTEX_FORMAT_QUANTIZED;
+    ctx.lod_enabled      = true;
+    ctx.lod_pixel_error  = 1.0f;
+    ctx.lod_hysteresis   = 0.2f;
+    ctx.lod_level        = 0;
+    ctx.lod_triangles    = 0;
+    ctx.meshlet_culling  = true;
+    ctx.meshlet_cone_culling = true;
+    ctx.meshlet_culled_percent = 0.0f;
+    ctx.meshlet_draw_count = 0;
+    ctx.pick_triangle    = -1;
+    ctx.pick_time_ms     = 0.0f;
+    ctx.surface_distance = 0.0f;
+    ctx.scene_mode       = false;
+    ctx.scene_instances  = 10000;
+    ctx.scene_visible    = 0;
+    ctx.scene_triangles  = 0;
+    ctx.scene_cull_ms    = 0.0f;
+    ctx.frame_start      = glfwGetTime();
+    ctx.frame_ms         = 0.0f;
+    ctx.fps              = 0.0f;
 
     ctx.background_color[0] = 0.3f;
     ctx.background_color[1] = 0.3f;
@@ -311,6 +528,12 @@ void init(Context &ctx)
     // Mesh
     loadMesh((modelDir() + "bunny.obj"), &ctx.mesh);
     createMeshVAO(ctx, ctx.mesh, &ctx.meshVAO);
+    bvhBuild(ctx.bvh, ctx.mesh.vertexData, ctx.mesh.indexData, ctx.mesh.numIndices);
+
+    // Instance buffer for scene mode, filled every frame. Per-instance
+    // attributes need OpenGL 3.3 or ARB_instanced_arrays.
+    ctx.instancing_supported = GLEW_VERSION_3_3 || GLEW_ARB_instanced_arrays;
+    glGenBuffers(1, &ctx.instanceVBO);
 
     // Skybox
     ctx.skyboxCubemap = loadCubemap(cubemapDir() + "/RomeChurch/prefiltered/2048");
@@ -331,6 +554,105 @@ void init(Context &ctx)
     initializeTrackball(ctx);
 }
 
+// Pick the level of detail from the size of the bounding sphere of the mesh
+// on screen. The model matrix must only rotate and scale uniformly by `scale`.
+int selectMeshLod(Context &ctx, const MeshVAO &meshVAO, const glm::mat4 &mv, float scale)
+{
+    int numLods = meshVAO.lods.size();
+    if (!ctx.lod_enabled || numLods <= 1) {
+        return 0;
+    }
+
+    // -- Radius of the bounding sphere in pixels
+    float radius = meshVAO.radius * scale;
+    float projectedRadius;
+    if (ctx.ortho_projection) {
+        projectedRadius = radius * ctx.height / 2.0f;
+    }
+    else {
+        float distance = glm::length(glm::vec3(mv * glm::vec4(meshVAO.center, 1.0f)));
+        if (distance <= radius) {
+            return 0; // The camera is inside the sphere
+        }
+        float tanHalfFov = std::tan((3.14159f / 2) * ctx.zoom_factor / 2.0f);
+        projectedRadius = radius / (std::sqrt(distance * distance - radius * radius) * tanHalfFov) * ctx.height / 2.0f;
+    }
+
+    float pixelsPerUnit = projectedRadius / std::max(meshVAO.radius, 1e-20f);
+    return meshSelectLod(meshVAO.lods.data(), numLods, pixelsPerUnit, ctx.lod_pixel_error,
+                         ctx.lod_hysteresis, ctx.lod_level);
+}
+
+// Draw the instances of the scene that are in the frustum, those of each
+// level of detail with one instanced draw call. The uniforms must be set.
+void drawInstances(Context &ctx, const MeshVAO &meshVAO, const glm::mat4 &mv, const glm::mat4 &mvp)
+{
+    if (ctx.scene.numInstances != size_t(ctx.scene_instances)) {
+        instanceSceneCreate(ctx.scene, ctx.scene_instances, meshVAO.center, meshVAO.radius, 1);
+    }
+
+    // -- Cull in scene space. Pixels per unit are taken at unit distance
+    // for the perspective projection, where the scale of the model matrix
+    // cancels out.
+    double start = glfwGetTime();
+    glm::vec4 planes[6];
+    frustumPlanes(mvp, planes);
+    glm::mat4 inverseMV = glm::inverse(mv);
+    glm::vec4 camera = inverseMV * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    float pixelsPerUnit;
+    if (ctx.ortho_projection) {
+        camera = glm::vec4(glm::normalize(glm::vec3(inverseMV * glm::vec4(0.0f, 0.0f, -1.0f, 0.0f))), 0.0f);
+        pixelsPerUnit = 0.5f * ctx.height / 2.0f;
+    }
+    else {
+        pixelsPerUnit = ctx.height / 2.0f / std::tan((3.14159f / 2) * ctx.zoom_factor / 2.0f);
+    }
+    float maxPixelError = ctx.lod_enabled ? ctx.lod_pixel_error : 0.0f;
+    InstanceDraws &draws = ctx.instance_draws;
+    instancesCull(draws, ctx.scene, planes, camera, pixelsPerUnit, maxPixelError, meshVAO.lods.data(),
+                  meshVAO.lods.size(), threadPool);
+    ctx.scene_cull_ms = float((glfwGetTime() - start) * 1000.0);
+
+    // -- Upload the transforms of the visible instances
+    glBindBuffer(GL_ARRAY_BUFFER, ctx.instanceVBO);
+    glBufferData(GL_ARRAY_BUFFER, draws.transforms.size() * sizeof(InstanceTransform), nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, draws.transforms.size() * sizeof(InstanceTransform),
+                    draws.transforms.data());
+
+    // Draw!
+    size_t indexSize = meshVAO.indexType == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t);
+    ctx.scene_visible = draws.transforms.size();
+    ctx.scene_triangles = 0;
+    glBindVertexArray(meshVAO.vao);
+    glEnableVertexAttribArray(INSTANCE_POSITION_SCALE);
+    glEnableVertexAttribArray(INSTANCE_ROTATION);
+    if (GLEW_VERSION_3_3) {
+        glVertexAttribDivisor(INSTANCE_POSITION_SCALE, 1);
+        glVertexAttribDivisor(INSTANCE_ROTATION, 1);
+    }
+    else {
+        glVertexAttribDivisorARB(INSTANCE_POSITION_SCALE, 1);
+        glVertexAttribDivisorARB(INSTANCE_ROTATION, 1);
+    }
+    for (size_t level = 0; level < draws.levelCount.size(); level++) {
+        if (draws.levelCount[level] == 0) {
+            continue;
+        }
+        size_t offset = draws.levelFirst[level] * sizeof(InstanceTransform);
+        glVertexAttribPointer(INSTANCE_POSITION_SCALE, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceTransform),
+                              (void *)(offset + offsetof(InstanceTransform, positionScale)));
+        glVertexAttribPointer(INSTANCE_ROTATION, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceTransform),
+                              (void *)(offset + offsetof(InstanceTransform, rotation)));
+        const MeshLod &lod = meshVAO.lods[level];
+        glDrawElementsInstanced(GL_TRIANGLES, lod.numIndices, meshVAO.indexType,
+                                (void *)(lod.firstIndex * indexSize), draws.levelCount[level]);
+        ctx.scene_triangles += lod.numIndices / 3 * draws.levelCount[level];
+    }
+    glDisableVertexAttribArray(INSTANCE_POSITION_SCALE);
+    glDisableVertexAttribArray(INSTANCE_ROTATION);
+    glBindVertexArray(ctx.defaultVAO);
+}
+
 // MODIFY THIS FUNCTION
 void drawMesh(Context &ctx, GLuint program, const MeshVAO &meshVAO)
 {
@@ -350,6 +672,8 @@ void drawMesh(Context &ctx, GLuint program, const MeshVAO &meshVAO)
 
     glm::mat4 mv  = view * model;
     glm::mat4 mvp = projection * mv;
+    ctx.mesh_mv   = mv;
+    ctx.mesh_mvp  = mvp;
 
     // --- Skybox
 
@@ -387,6 +711,8 @@ void drawMesh(Context &ctx, GLuint program, const MeshVAO &meshVAO)
     // Pass uniforms
     glUniformMatrix4fv(glGetUniformLocation(ctx.program, "u_mv"), 1, GL_FALSE, &mv[0][0]);
     glUniformMatrix4fv(glGetUniformLocation(ctx.program, "u_mvp"), 1, GL_FALSE, &mvp[0][0]);
+    glUniform3fv(glGetUniformLocation(ctx.program, "u_position_scale"),  1, &meshVAO.positionScale[0]);
+    glUniform3fv(glGetUniformLocation(ctx.program, "u_position_offset"), 1, &meshVAO.positionOffset[0]);
     glUniform1f(glGetUniformLocation(ctx.program, "u_time"), ctx.elapsed_time);
     glUniform3fv(glGetUniformLocation(ctx.program, "u_light_position"), 1, &ctx.light_position[0]);
     glUniform3fv(glGetUniformLocation(ctx.program, "u_light_color"),    1, &ctx.light_color[0]);
@@ -406,9 +732,55 @@ void drawMesh(Context &ctx, GLuint program, const MeshVAO &meshVAO)
     glUniform1i(glGetUniformLocation(ctx.program, "u_invert_toggle"),   ctx.invert_toggle);
     glUniform1i(glGetUniformLocation(ctx.program, "u_normal_toggle"),   ctx.normal_toggle);
 
+    // Scene of instances
+    bool instanced = ctx.scene_mode && ctx.instancing_supported;
+    glUniform1i(glGetUniformLocation(ctx.program, "u_instanced"), instanced);
+    if (instanced) {
+        drawInstances(ctx, meshVAO, mv, mvp);
+        return;
+    }
+
+    // Level of detail
+    ctx.lod_level = selectMeshLod(ctx, meshVAO, mv, 0.5f);
+    const MeshLod &lod = meshVAO.lods[ctx.lod_level];
+    ctx.lod_triangles = lod.numIndices / 3;
+    size_t indexSize = meshVAO.indexType == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t);
+
+    // Meshlets of the level that are in the frustum and, unless disabled,
+    // not facing away. The camera is found in model space; with the
+    // orthographic projection only the view direction matters.
+    auto beforeIndex = [](const Meshlet &meshlet, uint32_t index) { return meshlet.firstIndex < index; };
+    const Meshlet *meshletsEnd = meshVAO.meshlets.data() + meshVAO.meshlets.size();
+    const Meshlet *firstMeshlet = std::lower_bound(meshVAO.meshlets.data(), meshletsEnd, lod.firstIndex, beforeIndex);
+    const Meshlet *lastMeshlet = std::lower_bound(firstMeshlet, meshletsEnd, lod.firstIndex + lod.numIndices, beforeIndex);
+    bool culling = ctx.meshlet_culling && firstMeshlet != lastMeshlet;
+    if (culling) {
+        glm::vec4 planes[6];
+        frustumPlanes(mvp, planes);
+        glm::mat4 inverseMV = glm::inverse(mv);
+        glm::vec4 camera = inverseMV * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+        if (ctx.ortho_projection) {
+            camera = glm::vec4(glm::normalize(glm::vec3(inverseMV * glm::vec4(0.0f, 0.0f, -1.0f, 0.0f))), 0.0f);
+        }
+        meshletsCull(ctx.meshlet_draws, firstMeshlet, lastMeshlet - firstMeshlet, planes, camera,
+                     ctx.meshlet_cone_culling, indexSize);
+        ctx.meshlet_culled_percent = 100.0f * (1.0f - float(ctx.meshlet_draws.numTriangles) / ctx.lod_triangles);
+        ctx.meshlet_draw_count = ctx.meshlet_draws.counts.size();
+    }
+    else {
+        ctx.meshlet_culled_percent = 0.0f;
+        ctx.meshlet_draw_count = 1;
+    }
+
     // Draw!
     glBindVertexArray(meshVAO.vao);
-    glDrawElements(GL_TRIANGLES, meshVAO.numIndices, GL_UNSIGNED_INT, 0);
+    if (culling) {
+        glMultiDrawElements(GL_TRIANGLES, ctx.meshlet_draws.counts.data(), meshVAO.indexType,
+                            ctx.meshlet_draws.offsets.data(), ctx.meshlet_draws.counts.size());
+    }
+    else {
+        glDrawElements(GL_TRIANGLES, lod.numIndices, meshVAO.indexType, (void *)(lod.firstIndex * indexSize));
+    }
     glBindVertexArray(ctx.defaultVAO);
 }
 
@@ -417,6 +789,12 @@ void display(Context &ctx)
     glClearColor(ctx.background_color[0], ctx.background_color[1], ctx.background_color[2], ctx.background_intensity);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+    // Rebuild the mesh buffers if their format was changed
+    if (ctx.meshVAO.vertexFormat != ctx.vertex_format) {
+        destroyMeshVAO(&ctx.meshVAO);
+        createMeshVAO(ctx, ctx.mesh, &ctx.meshVAO);
+    }
+
     glEnable(GL_DEPTH_TEST); // ensures that polygons overlap correctly
     drawMesh(ctx, ctx.program, ctx.meshVAO);
 }
@@ -428,9 +806,30 @@ void reloadShaders(Context *ctx)
                                      shaderDir() + "mesh.frag");
 }
 
+// Find the triangle under the mouse by casting a ray from the near to the
+// far plane through the BVH, and the distance from the eye to the mesh
+void pickMesh(Context *ctx, int x, int y)
+{
+    glm::mat4 inverseMVP = glm::inverse(ctx->mesh_mvp);
+    glm::vec2 ndc(2.0f * x / ctx->width - 1.0f, 1.0f - 2.0f * y / ctx->height);
+    glm::vec4 nearPoint = inverseMVP * glm::vec4(ndc, -1.0f, 1.0f);
+    glm::vec4 farPoint = inverseMVP * glm::vec4(ndc, 1.0f, 1.0f);
+    glm::vec3 origin = glm::vec3(nearPoint) / nearPoint.w;
+
+    double start = glfwGetTime();
+    BVHHit hit;
+    bool found = bvhRaycast(ctx->bvh, origin, glm::vec3(farPoint) / farPoint.w - origin, 1.0f, hit);
+    ctx->pick_time_ms = float((glfwGetTime() - start) * 1000.0);
+    ctx->pick_triangle = found ? int(hit.triangle) : -1;
+
+    glm::vec3 eye = glm::vec3(glm::inverse(ctx->mesh_mv) * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+    ctx->surface_distance = bvhDistance(ctx->bvh, eye);
+}
+
 void mouseButtonPressed(Context *ctx, int button, int x, int y)
 {
     if (button == GLFW_MOUSE_BUTTON_LEFT) {
+        pickMesh(ctx, x, y);
         ctx->trackball.center = glm::vec2(x, y);
         trackballStartTracking(ctx->trackball, glm::vec2(x, y));
     }
@@ -577,8 +976,47 @@ int main(void)
     TwAddVarRW(tweakbar, "Zoom",           TW_TYPE_FLOAT, &ctx.zoom_factor,    "min=0.1 max=1.9 step=0.01");
     TwAddVarRW(tweakbar, "Cubemap",        TW_TYPE_INT32, &ctx.cubemap_choice, "min=0 max=8");
     TwAddVarRW(tweakbar, "Eye Direction",  TW_TYPE_DIR3F, &ctx.eye_position, "");
+
+    // Mesh buffers
+    TwAddSeparator(tweakbar, NULL, "");
+    TwType vertexFormatType = TwDefineEnumFromString("VertexFormat", "Float,Quantized");
+    TwAddVarRW(tweakbar, "Vertex Format", vertexFormatType, &ctx.vertex_format, "");
+    TwAddVarRO(tweakbar, "Mesh Buffers (KB)", TW_TYPE_INT32, &ctx.mesh_buffer_kb, "");
+
+    // Level of detail
+    TwAddSeparator(tweakbar, NULL, "");
+    TwAddVarRW(tweakbar, "LOD",                TW_TYPE_BOOLCPP, &ctx.lod_enabled, "");
+    TwAddVarRW(tweakbar, "LOD Pixel Error",    TW_TYPE_FLOAT, &ctx.lod_pixel_error, "min=0.1 step=0.1");
+    TwAddVarRW(tweakbar, "LOD Hysteresis",     TW_TYPE_FLOAT, &ctx.lod_hysteresis, "min=0 max=0.9 step=0.05");
+    TwAddVarRO(tweakbar, "LOD Level",          TW_TYPE_INT32, &ctx.lod_level, "");
+    TwAddVarRO(tweakbar, "LOD Triangles",      TW_TYPE_INT32, &ctx.lod_triangles, "");
+
+    // Meshlet culling
+    TwAddSeparator(tweakbar, NULL, "");
+    TwAddVarRW(tweakbar, "Meshlet Culling",    TW_TYPE_BOOLCPP, &ctx.meshlet_culling, "");
+    TwAddVarRW(tweakbar, "Backface Cones",     TW_TYPE_BOOLCPP, &ctx.meshlet_cone_culling, "");
+    TwAddVarRO(tweakbar, "Culled (%)",         TW_TYPE_FLOAT, &ctx.meshlet_culled_percent, "precision=1");
+    TwAddVarRO(tweakbar, "Draw Ranges",        TW_TYPE_INT32, &ctx.meshlet_draw_count, "");
+
+    // Picking
+    TwAddSeparator(tweakbar, NULL, "");
+    TwAddVarRO(tweakbar, "Picked Triangle",    TW_TYPE_INT32, &ctx.pick_triangle, "");
+    TwAddVarRO(tweakbar, "Pick Time (ms)",     TW_TYPE_FLOAT, &ctx.pick_time_ms, "precision=3");
+    TwAddVarRO(tweakbar, "Surface Distance",   TW_TYPE_FLOAT, &ctx.surface_distance, "precision=3");
+
+    // Scene mode
+    TwAddSeparator(tweakbar, NULL, "");
+    TwAddVarRW(tweakbar, "Scene Mode",         TW_TYPE_BOOLCPP, &ctx.scene_mode, "");
+    TwAddVarRW(tweakbar, "Instances",          TW_TYPE_INT32, &ctx.scene_instances, "min=1 max=1000000 step=1000");
+    TwAddVarRO(tweakbar, "Visible Instances",  TW_TYPE_INT32, &ctx.scene_visible, "");
+    TwAddVarRO(tweakbar, "Scene Triangles",    TW_TYPE_INT32, &ctx.scene_triangles, "");
+    TwAddVarRO(tweakbar, "Cull Time (ms)",     TW_TYPE_FLOAT, &ctx.scene_cull_ms, "precision=3");
+    TwAddVarRO(tweakbar, "Frame Time (ms)",    TW_TYPE_FLOAT, &ctx.frame_ms, "precision=2");
+    TwAddVarRO(tweakbar, "FPS",                TW_TYPE_FLOAT, &ctx.fps, "precision=1");
 #endif // WITH_TWEAKBAR
 
+    threadPoolStart(threadPool, 0);
+
     // Initialize rendering
     glGenVertexArrays(1, &ctx.defaultVAO);
     glBindVertexArray(ctx.defaultVAO);
@@ -589,6 +1027,15 @@ int main(void)
     while (!glfwWindowShouldClose(ctx.window)) {
         glfwPollEvents();
         ctx.elapsed_time = glfwGetTime();
+
+        // Frame time as a moving average, from the start of one frame to
+        // the start of the next
+        double now = glfwGetTime();
+        float frameMs = float((now - ctx.frame_start) * 1000.0);
+        ctx.frame_start = now;
+        ctx.frame_ms = ctx.frame_ms > 0.0f ? 0.95f * ctx.frame_ms + 0.05f * frameMs : frameMs;
+        ctx.fps = ctx.frame_ms > 0.0f ? 1000.0f / ctx.frame_ms : 0.0f;
+
         display(ctx);
 #ifdef WITH_TWEAKBAR
         TwDraw();
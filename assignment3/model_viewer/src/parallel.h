@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Function run over a range [begin, end) by the thread with the given index
+typedef std::function<void(int begin, int end, int threadIndex)> ParallelTask;
+
+// Struct for a pool of persistent worker threads. parallelFor() splits a
+// range into chunks that the workers and the calling thread take in turn,
+// so there is no thread creation per call. The calling thread has index 0
+// and the workers 1 to numThreads - 1. Calls must not be nested.
+struct ThreadPool {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+
+    // Current task
+    const ParallelTask *task;
+    int count;
+    int grainSize;
+    std::atomic<int> nextBegin;
+    int numBusy;
+    unsigned generation;
+    bool quit;
+
+    int numThreads;
+
+    ThreadPool() : task(nullptr), count(0), grainSize(1), nextBegin(0), numBusy(0),
+                   generation(0), quit(false), numThreads(1)
+    {}
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for (std::size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+        }
+    }
+};
+
+namespace {
+// Take chunks of the current task until the range is exhausted
+void threadPoolRunChunks(ThreadPool &pool, int threadIndex)
+{
+    for (;;) {
+        int begin = pool.nextBegin.fetch_add(pool.grainSize);
+        if (begin >= pool.count) {
+            break;
+        }
+        (*pool.task)(begin, std::min(begin + pool.grainSize, pool.count), threadIndex);
+    }
+}
+
+void threadPoolWorker(ThreadPool *pool, int threadIndex)
+{
+    unsigned generation = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            while (!pool->quit && pool->generation == generation) {
+                pool->wake.wait(lock);
+            }
+            if (pool->quit) {
+                return;
+            }
+            generation = pool->generation;
+        }
+
+        threadPoolRunChunks(*pool, threadIndex);
+
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if (--pool->numBusy == 0) {
+            pool->finished.notify_one();
+        }
+    }
+}
+} // namespace
+
+// Start the worker threads. With numThreads <= 0 one thread per hardware
+// thread is used (including the calling thread).
+void threadPoolStart(ThreadPool &pool, int numThreads)
+{
+    if (numThreads <= 0) {
+        numThreads = std::max(int(std::thread::hardware_concurrency()), 1);
+    }
+    pool.numThreads = numThreads;
+    for (int i = 1; i < numThreads; i++) {
+        pool.workers.push_back(std::thread(threadPoolWorker, &pool, i));
+    }
+}
+
+// Run task(begin, end, threadIndex) over [0, count) in chunks of grainSize
+// and return when all chunks are done
+void parallelFor(ThreadPool &pool, int count, int grainSize, const ParallelTask &task)
+{
+    if (count <= 0) {
+        return;
+    }
+    grainSize = std::max(grainSize, 1);
+
+    // Not worth waking the workers for a single chunk
+    if (pool.workers.empty() || count <= grainSize) {
+        task(0, count, 0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.task = &task;
+        pool.count = count;
+        pool.grainSize = grainSize;
+        pool.nextBegin = 0;
+        pool.numBusy = pool.workers.size();
+        pool.generation++;
+    }
+    pool.wake.notify_all();
+
+    threadPoolRunChunks(pool, 0);
+
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    while (pool.numBusy > 0) {
+        pool.finished.wait(lock);
+    }
+}
@@ -5,6 +5,11 @@
 layout(location = 0) in vec4 a_position;
 layout(location = 1) in vec3 a_normal;
 
+// Per-instance position and scale, and rotation as a quaternion, used in
+// scene mode
+layout(location = 2) in vec4 a_instance_position_scale;
+layout(location = 3) in vec4 a_instance_rotation;
+
 //out vec3 v_color;
 
 out vec3 v_normal, n_normal, l_normal;
@@ -14,15 +19,35 @@ uniform mat4  u_mv;
 uniform float u_time;
 uniform vec3  u_light_position;
 
+// Dequantization of the position, which may be stored as normalized
+// integers within the bounding box of the mesh
+uniform vec3  u_position_scale;
+uniform vec3  u_position_offset;
+
+uniform bool  u_instanced;
+
+// Rotate v by the unit quaternion q
+vec3 rotate(vec4 q, vec3 v)
+{
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
 void main()
 {
-    gl_Position = u_mvp * a_position;
+    vec4 position = vec4(u_position_offset + u_position_scale * a_position.xyz, 1.0);
+    vec3 normal = a_normal;
+    if (u_instanced) {
+        position.xyz = a_instance_position_scale.xyz +
+                       a_instance_position_scale.w * rotate(a_instance_rotation, position.xyz);
+        normal = rotate(a_instance_rotation, normal);
+    }
+    gl_Position = u_mvp * position;
 
     // Transform the vertex position to view space (eye coordinates)
-    vec3 position_eye = vec3(u_mv * a_position);
+    vec3 position_eye = vec3(u_mv * position);
 
     // Calculate the view-space normal
-    vec3 N = normalize(mat3(u_mv) * a_normal);
+    vec3 N = normalize(mat3(u_mv) * normal);
 
     // Calculate the view-space light direction
     vec3 L = normalize(u_light_position - position_eye);
@@ -0,0 +1,117 @@
+#pragma once
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Layouts of the interleaved vertex buffer of a mesh
+enum VertexFormat {
+    VERTEX_FORMAT_FLOAT,    // float3 position and float3 normal, 24 bytes
+    VERTEX_FORMAT_QUANTIZED // 16-bit normalized position within the bounds and packed normal, 12 bytes
+};
+
+struct FloatVertex {
+    glm::vec3 position;
+    glm::vec3 normal;
+};
+
+// The position is relative to the bounding box of the mesh, with 0 and 65535
+// at its sides. The normal is packed as GL_INT_2_10_10_10_REV, or as four
+// normalized bytes where that type is not supported.
+struct QuantizedVertex {
+    std::uint16_t position[4]; // The fourth is padding, to keep the normal aligned
+    std::uint32_t normal;
+};
+
+// Struct for the interleaved vertices of a mesh, ready for upload. The
+// vertex shader gets the position back as offset + scale * position, where
+// position is the stored value (normalized to [0, 1] when quantized).
+struct PackedVertices {
+    VertexFormat format;
+    bool normals1010102; // Whether quantized normals use GL_INT_2_10_10_10_REV rather than bytes
+    std::vector<char> data;
+    std::size_t stride;
+    glm::vec3 positionScale;
+    glm::vec3 positionOffset;
+};
+
+namespace {
+// Round a value in [-1, 1] to a signed normalized integer of `bits` bits,
+// returned in the low bits of the result
+std::uint32_t packSnorm(float value, int bits)
+{
+    float maxValue = float((1 << (bits - 1)) - 1);
+    int quantized = int(std::floor(std::max(std::min(value, 1.0f), -1.0f) * maxValue + 0.5f));
+    return std::uint32_t(quantized) & ((1u << bits) - 1);
+}
+} // namespace
+
+// Pack a unit normal as GL_INT_2_10_10_10_REV, with x in the low bits
+std::uint32_t packNormal1010102(const glm::vec3 &normal)
+{
+    return packSnorm(normal.x, 10) | packSnorm(normal.y, 10) << 10 | packSnorm(normal.z, 10) << 20;
+}
+
+// Pack a unit normal as four signed normalized bytes, with x in the first
+std::uint32_t packNormalBytes(const glm::vec3 &normal)
+{
+    std::uint8_t bytes[4] = { std::uint8_t(packSnorm(normal.x, 8)), std::uint8_t(packSnorm(normal.y, 8)),
+                              std::uint8_t(packSnorm(normal.z, 8)), 0 };
+    std::uint32_t packed;
+    std::memcpy(&packed, bytes, 4);
+    return packed;
+}
+
+// Interleave the positions and normals of a mesh in the given format
+void packVertices(PackedVertices &packed, VertexFormat format, bool normals1010102,
+                  const glm::vec3 *positions, const glm::vec3 *normals, std::size_t count)
+{
+    packed.format = format;
+    packed.normals1010102 = normals1010102;
+
+    if (format == VERTEX_FORMAT_FLOAT) {
+        packed.stride = sizeof(FloatVertex);
+        packed.data.resize(count * packed.stride);
+        FloatVertex *vertices = reinterpret_cast<FloatVertex *>(packed.data.data());
+        for (std::size_t i = 0; i < count; i++) {
+            vertices[i].position = positions[i];
+            vertices[i].normal = normals[i];
+        }
+        packed.positionScale = glm::vec3(1.0f);
+        packed.positionOffset = glm::vec3(0.0f);
+        return;
+    }
+
+    // -- Quantize the positions within their bounding box
+    glm::vec3 lo(0.0f), hi(0.0f);
+    if (count > 0) {
+        lo = hi = positions[0];
+    }
+    for (std::size_t i = 1; i < count; i++) {
+        lo = glm::min(lo, positions[i]);
+        hi = glm::max(hi, positions[i]);
+    }
+    glm::vec3 extent = hi - lo;
+    glm::vec3 toUnit(extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+                     extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+                     extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+
+    packed.stride = sizeof(QuantizedVertex);
+    packed.data.resize(count * packed.stride);
+    QuantizedVertex *vertices = reinterpret_cast<QuantizedVertex *>(packed.data.data());
+    for (std::size_t i = 0; i < count; i++) {
+        glm::vec3 unit = (positions[i] - lo) * toUnit;
+        for (int k = 0; k < 3; k++) {
+            vertices[i].position[k] = std::uint16_t(std::min(std::max(unit[k], 0.0f), 1.0f) * 65535.0f + 0.5f);
+        }
+        vertices[i].position[3] = 0;
+        vertices[i].normal = normals1010102 ? packNormal1010102(normals[i]) : packNormalBytes(normals[i]);
+    }
+    packed.positionScale = extent;
+    packed.positionOffset = lo;
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Struct for a rectangular region of a sprite atlas. The region holds a
+// flipbook of numFrames frames in a columns x rows grid, ordered left to
+// right and bottom to top. A still image is a flipbook with one frame.
+struct AtlasRegion {
+    float u, v, width, height; // Normalized texture coordinates
+    int columns, rows, numFrames;
+};
+
+// Struct for a sprite atlas built on the CPU and uploaded as one texture
+struct SpriteAtlas {
+    int width;
+    int height;
+    std::vector<unsigned char> pixels; // RGBA, first row at v = 0
+    std::vector<AtlasRegion> regions;
+};
+
+// Function that returns the RGBA color of a flipbook frame at (x, y) in
+// [-1, 1]^2 (y up) and time t in [0, 1)
+typedef void (*FrameGenerator)(float x, float y, float t, unsigned char *rgba);
+
+void atlasInit(SpriteAtlas &atlas, int width, int height)
+{
+    atlas.width = width;
+    atlas.height = height;
+    atlas.pixels.assign(width * height * 4, 0);
+    atlas.regions.clear();
+}
+
+int atlasAddRegion(SpriteAtlas &atlas, int x, int y, int width, int height,
+                   int columns, int rows, int numFrames)
+{
+    AtlasRegion region;
+    region.u = float(x) / atlas.width;
+    region.v = float(y) / atlas.height;
+    region.width = float(width) / atlas.width;
+    region.height = float(height) / atlas.height;
+    region.columns = columns;
+    region.rows = rows;
+    region.numFrames = numFrames;
+    atlas.regions.push_back(region);
+
+    return atlas.regions.size() - 1;
+}
+
+// Copy an RGBA image (rows top to bottom, as decoded by lodepng) into a
+// size x size square at (x, y), resampled with nearest neighbour filtering.
+// Returns the index of the new region.
+int atlasAddImage(SpriteAtlas &atlas, int x, int y, int size,
+                  const std::vector<unsigned char> &image, unsigned imageWidth, unsigned imageHeight)
+{
+    for (int j = 0; j < size; j++) {
+        unsigned srcRow = imageHeight - 1 - std::min(unsigned(j * imageHeight / size), imageHeight - 1);
+        for (int i = 0; i < size; i++) {
+            unsigned srcColumn = std::min(unsigned(i * imageWidth / size), imageWidth - 1);
+            const unsigned char *src = &image[4 * (srcRow * imageWidth + srcColumn)];
+            unsigned char *dst = &atlas.pixels[4 * ((y + j) * atlas.width + x + i)];
+            std::copy(src, src + 4, dst);
+        }
+    }
+
+    return atlasAddRegion(atlas, x, y, size, size, 1, 1, 1);
+}
+
+// Generate a flipbook of columns x rows frames of frameSize pixels at (x, y).
+// Returns the index of the new region.
+int atlasAddFlipbook(SpriteAtlas &atlas, int x, int y, int frameSize, int columns, int rows,
+                     FrameGenerator generator)
+{
+    int numFrames = columns * rows;
+    for (int frame = 0; frame < numFrames; frame++) {
+        float t = float(frame) / numFrames;
+        int frameX = x + (frame % columns) * frameSize;
+        int frameY = y + (frame / columns) * frameSize;
+        for (int j = 0; j < frameSize; j++) {
+            for (int i = 0; i < frameSize; i++) {
+                float px = (i + 0.5f) / frameSize * 2.0f - 1.0f;
+                float py = (j + 0.5f) / frameSize * 2.0f - 1.0f;
+                generator(px, py, t, &atlas.pixels[4 * ((frameY + j) * atlas.width + frameX + i)]);
+            }
+        }
+    }
+
+    return atlasAddRegion(atlas, x, y, columns * frameSize, rows * frameSize, columns, rows, numFrames);
+}
+
+// Helper functions for the procedural flipbooks
+namespace {
+float latticeValue(int x, int y, int z)
+{
+    std::uint32_t h = std::uint32_t(x) * 73856093u ^ std::uint32_t(y) * 19349663u ^ std::uint32_t(z) * 83492791u;
+    h = (h ^ (h >> 13)) * 0x5bd1e995u;
+    h ^= h >> 15;
+    return (h & 0xffffff) / float(0xffffff);
+}
+
+// Smoothly interpolated value noise in [0, 1]
+float valueNoise(float x, float y, float z)
+{
+    int x0 = int(std::floor(x)), y0 = int(std::floor(y)), z0 = int(std::floor(z));
+    float fx = x - x0, fy = y - y0, fz = z - z0;
+    fx = fx * fx * (3.0f - 2.0f * fx);
+    fy = fy * fy * (3.0f - 2.0f * fy);
+    fz = fz * fz * (3.0f - 2.0f * fz);
+
+    float v[2];
+    for (int k = 0; k < 2; k++) {
+        float a = latticeValue(x0, y0, z0 + k) + (latticeValue(x0 + 1, y0, z0 + k) - latticeValue(x0, y0, z0 + k)) * fx;
+        float b = latticeValue(x0, y0 + 1, z0 + k) + (latticeValue(x0 + 1, y0 + 1, z0 + k) - latticeValue(x0, y0 + 1, z0 + k)) * fx;
+        v[k] = a + (b - a) * fy;
+    }
+    return v[0] + (v[1] - v[0]) * fz;
+}
+
+// Three octaves of value noise in [0, 1]
+float fractalNoise(float x, float y, float z)
+{
+    return (valueNoise(x, y, z) * 4.0f + valueNoise(2.0f * x, 2.0f * y, 2.0f * z) * 2.0f +
+            valueNoise(4.0f * x, 4.0f * y, 4.0f * z)) / 7.0f;
+}
+
+unsigned char toByte(float value)
+{
+    return (unsigned char)(std::min(std::max(value, 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+} // namespace
+
+// A puff of smoke that expands and thins out over time
+void smokeFrame(float x, float y, float t, unsigned char *rgba)
+{
+    float radius = 0.55f + 0.4f * t;
+    float r = std::sqrt(x * x + y * y) / radius;
+    float noise = fractalNoise(3.0f * x + 10.0f, 3.0f * y - 2.0f * t, 4.0f * t);
+    float density = std::max(1.0f - r * r, 0.0f) * (0.4f + 0.6f * noise) * (1.0f - 0.5f * t);
+
+    rgba[0] = rgba[1] = rgba[2] = 255;
+    rgba[3] = toByte(density * 1.5f);
+}
+
+// A flickering flame tongue pointing up
+void flameFrame(float x, float y, float t, unsigned char *rgba)
+{
+    float height = 0.5f * (y + 1.0f); // 0 at the bottom, 1 at the top
+    float noise = fractalNoise(4.0f * x, 3.0f * y - 6.0f * t, 2.0f * t + 5.0f);
+    float width = 0.6f * (1.0f - height) * (0.7f + 0.6f * noise);
+    float edge = std::max(1.0f - std::fabs(x) / std::max(width, 1e-3f), 0.0f);
+    float intensity = edge * std::min(height * 6.0f, 1.0f);
+
+    rgba[0] = 255;
+    rgba[1] = toByte(0.8f + 0.2f * edge);
+    rgba[2] = toByte(0.6f + 0.4f * edge);
+    rgba[3] = toByte(intensity * 1.2f);
+}
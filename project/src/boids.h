@@ -0,0 +1,235 @@
+#pragma once
+
+#include "parallel.h"
+#include "spatial_grid.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <vector>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+// Parameters of the flocking rules
+struct SwarmParams {
+    float neighborRadius;   // Agents closer than this align and cohere
+    float separationRadius; // Agents closer than this push each other away
+    float separationWeight;
+    float alignmentWeight;
+    float cohesionWeight;
+    float minSpeed;
+    float maxSpeed;
+    float boundsRadius;     // Agents further from the origin are steered back
+    float boundsWeight;
+    int maxPerCell;         // Agents looked at per grid cell
+
+    SwarmParams() : neighborRadius(1.5f),
+                    separationRadius(0.5f),
+                    separationWeight(1.5f),
+                    alignmentWeight(1.0f),
+                    cohesionWeight(0.5f),
+                    minSpeed(2.0f),
+                    maxSpeed(6.0f),
+                    boundsRadius(12.0f),
+                    boundsWeight(1.0f),
+                    maxPerCell(16)
+    {}
+};
+
+// Struct for a flocking simulation after Reynolds, "Flocks, Herds, and
+// Schools" (1987). Agents are sorted into a grid with cells the size of the
+// neighbour radius and stored by cell in separate coordinate arrays, so the
+// rules read contiguous runs that can be processed four at a time. Only the
+// first maxPerCell agents of a cell are looked at, which bounds the cost per
+// agent however dense the flock gets.
+struct SwarmSolver {
+    SpatialGrid grid;
+
+    // Agent data in grid order
+    std::vector<float> px, py, pz;
+    std::vector<float> vx, vy, vz;
+};
+
+const int swarmGrainSize = 1024;
+
+namespace {
+// Neighbour sums of one agent
+struct SwarmSums {
+    float count;
+    glm::vec3 velocity;   // Sum of the neighbour velocities
+    glm::vec3 position;   // Sum of the neighbour positions
+    glm::vec3 separation; // Sum of the offsets from close neighbours over their squared distance
+};
+
+// Sum up the neighbours of the agent at p over the given grid cells
+void swarmGather(const SwarmSolver &solver, const std::uint32_t *keys, int numKeys,
+                 std::uint32_t maxPerCell, const glm::vec3 &p, float neighborRadiusSquared,
+                 float separationRadiusSquared, SwarmSums &sums)
+{
+    sums.count = 0.0f;
+    sums.velocity = sums.position = sums.separation = glm::vec3(0.0f);
+
+#ifdef __SSE__
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 epsilon = _mm_set1_ps(1e-12f);
+    const __m128 neighborR2 = _mm_set1_ps(neighborRadiusSquared);
+    const __m128 separationR2 = _mm_set1_ps(separationRadiusSquared);
+    const __m128 x = _mm_set1_ps(p.x), y = _mm_set1_ps(p.y), z = _mm_set1_ps(p.z);
+
+    __m128 count = zero;
+    __m128 sumVx = zero, sumVy = zero, sumVz = zero;
+    __m128 sumPx = zero, sumPy = zero, sumPz = zero;
+    __m128 sumSx = zero, sumSy = zero, sumSz = zero;
+#endif
+
+    for (int k = 0; k < numKeys; k++) {
+        std::uint32_t j = solver.grid.cellStart[keys[k]];
+        std::uint32_t end = std::min(solver.grid.cellStart[keys[k] + 1], j + maxPerCell);
+
+#ifdef __SSE__
+        for (; j + 4 <= end; j += 4) {
+            __m128 qx = _mm_loadu_ps(&solver.px[j]);
+            __m128 qy = _mm_loadu_ps(&solver.py[j]);
+            __m128 qz = _mm_loadu_ps(&solver.pz[j]);
+            __m128 dx = _mm_sub_ps(x, qx);
+            __m128 dy = _mm_sub_ps(y, qy);
+            __m128 dz = _mm_sub_ps(z, qz);
+            __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+            // The agent itself is at distance zero and is left out
+            __m128 notSelf = _mm_cmpgt_ps(d2, zero);
+            __m128 neighbor = _mm_and_ps(_mm_cmplt_ps(d2, neighborR2), notSelf);
+            __m128 close = _mm_and_ps(_mm_cmplt_ps(d2, separationR2), notSelf);
+
+            count = _mm_add_ps(count, _mm_and_ps(neighbor, one));
+            sumVx = _mm_add_ps(sumVx, _mm_and_ps(neighbor, _mm_loadu_ps(&solver.vx[j])));
+            sumVy = _mm_add_ps(sumVy, _mm_and_ps(neighbor, _mm_loadu_ps(&solver.vy[j])));
+            sumVz = _mm_add_ps(sumVz, _mm_and_ps(neighbor, _mm_loadu_ps(&solver.vz[j])));
+            sumPx = _mm_add_ps(sumPx, _mm_and_ps(neighbor, qx));
+            sumPy = _mm_add_ps(sumPy, _mm_and_ps(neighbor, qy));
+            sumPz = _mm_add_ps(sumPz, _mm_and_ps(neighbor, qz));
+
+            // The approximate reciprocal is plenty for a steering weight
+            __m128 weight = _mm_and_ps(close, _mm_rcp_ps(_mm_max_ps(d2, epsilon)));
+            sumSx = _mm_add_ps(sumSx, _mm_mul_ps(dx, weight));
+            sumSy = _mm_add_ps(sumSy, _mm_mul_ps(dy, weight));
+            sumSz = _mm_add_ps(sumSz, _mm_mul_ps(dz, weight));
+        }
+#endif
+
+        for (; j < end; j++) {
+            glm::vec3 q(solver.px[j], solver.py[j], solver.pz[j]);
+            glm::vec3 d = p - q;
+            float d2 = glm::dot(d, d);
+            if (d2 <= 0.0f || d2 >= neighborRadiusSquared) {
+                continue;
+            }
+
+            sums.count += 1.0f;
+            sums.velocity += glm::vec3(solver.vx[j], solver.vy[j], solver.vz[j]);
+            sums.position += q;
+            if (d2 < separationRadiusSquared) {
+                sums.separation += d / d2;
+            }
+        }
+    }
+
+#ifdef __SSE__
+    // Add the four lanes of each sum
+    float lanes[10][4];
+    _mm_storeu_ps(lanes[0], count);
+    _mm_storeu_ps(lanes[1], sumVx);
+    _mm_storeu_ps(lanes[2], sumVy);
+    _mm_storeu_ps(lanes[3], sumVz);
+    _mm_storeu_ps(lanes[4], sumPx);
+    _mm_storeu_ps(lanes[5], sumPy);
+    _mm_storeu_ps(lanes[6], sumPz);
+    _mm_storeu_ps(lanes[7], sumSx);
+    _mm_storeu_ps(lanes[8], sumSy);
+    _mm_storeu_ps(lanes[9], sumSz);
+    float total[10];
+    for (int i = 0; i < 10; i++) {
+        total[i] = lanes[i][0] + lanes[i][1] + lanes[i][2] + lanes[i][3];
+    }
+    sums.count += total[0];
+    sums.velocity += glm::vec3(total[1], total[2], total[3]);
+    sums.position += glm::vec3(total[4], total[5], total[6]);
+    sums.separation += glm::vec3(total[7], total[8], total[9]);
+#endif
+}
+} // namespace
+
+// Advance `count` agents by dt seconds. Positions and velocities are read
+// and written in place.
+void swarmStep(SwarmSolver &solver, const SwarmParams &params, glm::vec3 *positions,
+               glm::vec3 *velocities, int count, float dt, ThreadPool &pool)
+{
+    if (count == 0) {
+        return;
+    }
+
+    const float neighborR2 = params.neighborRadius * params.neighborRadius;
+    const float separationR2 = params.separationRadius * params.separationRadius;
+    const std::uint32_t maxPerCell = std::max(params.maxPerCell, 1);
+
+    // -- Sort the agents by cell into the coordinate arrays
+    spatialGridBuild(solver.grid, positions, count, params.neighborRadius, pool);
+
+    solver.px.resize(count);
+    solver.py.resize(count);
+    solver.pz.resize(count);
+    solver.vx.resize(count);
+    solver.vy.resize(count);
+    solver.vz.resize(count);
+
+    parallelFor(pool, count, swarmGrainSize, [&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            std::uint32_t j = solver.grid.sortedIndices[i];
+            solver.px[i] = positions[j].x;
+            solver.py[i] = positions[j].y;
+            solver.pz[i] = positions[j].z;
+            solver.vx[i] = velocities[j].x;
+            solver.vy[i] = velocities[j].y;
+            solver.vz[i] = velocities[j].z;
+        }
+    });
+
+    // -- Apply the rules. Each agent only writes its own result, back in
+    // the caller's order.
+    parallelFor(pool, count, swarmGrainSize, [&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            glm::vec3 p(solver.px[i], solver.py[i], solver.pz[i]);
+            glm::vec3 v(solver.vx[i], solver.vy[i], solver.vz[i]);
+
+            std::uint32_t keys[27];
+            int numKeys = spatialGridNeighborKeys(solver.grid, p, params.neighborRadius, keys);
+            SwarmSums sums;
+            swarmGather(solver, keys, numKeys, maxPerCell, p, neighborR2, separationR2, sums);
+
+            glm::vec3 steer = sums.separation * params.separationWeight;
+            if (sums.count > 0.0f) {
+                steer += (sums.velocity / sums.count - v) * params.alignmentWeight;
+                steer += (sums.position / sums.count - p) * params.cohesionWeight;
+            }
+
+            float distance = glm::length(p);
+            if (distance > params.boundsRadius) {
+                steer -= p * ((distance - params.boundsRadius) / distance * params.boundsWeight);
+            }
+
+            glm::vec3 velocity = v + steer * dt;
+            float speed = glm::length(velocity);
+            if (speed > 0.0f) {
+                velocity *= std::min(std::max(speed, params.minSpeed), params.maxSpeed) / speed;
+            }
+
+            std::uint32_t j = solver.grid.sortedIndices[i];
+            velocities[j] = velocity;
+            positions[j] = p + velocity * dt;
+        }
+    });
+}
@@ -0,0 +1,233 @@
+#pragma once
+
+#include "parallel.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Parameters of the cloth solver
+struct ClothParams {
+    glm::vec3 gravity;
+    int iterations;         // Constraint projections per step
+    float stretchStiffness; // In [0, 1], for the structural and shear constraints
+    float bendStiffness;    // In [0, 1], for the constraints skipping a point
+    float damping;          // Fraction of the velocity lost per second
+    float drag;             // Rate at which the cloth takes on the air velocity along its normal
+
+    ClothParams() : gravity(0.0f, -9.81f, 0.0f),
+                    iterations(8),
+                    stretchStiffness(1.0f),
+                    bendStiffness(0.3f),
+                    damping(0.1f),
+                    drag(3.0f)
+    {}
+};
+
+// A constraint keeping two points at their rest distance
+struct DistanceConstraint {
+    std::uint32_t a, b;
+    float restLength;
+    bool bending;
+};
+
+// Struct for position-based cloth after Mueller et al., "Position Based
+// Dynamics" (2007). The mass points live in a separate array of the caller,
+// which needs pos, speed and weight (inverse mass, 0 for pinned points)
+// members. Constraints are colored so that no two of the same color share a
+// point, which lets each color be projected in parallel while keeping the
+// Gauss-Seidel convergence of a serial solver.
+struct Cloth {
+    std::vector<DistanceConstraint> constraints; // Grouped by color
+    std::vector<int> colorStart;                 // Constraints of color c are [colorStart[c], colorStart[c + 1])
+    std::vector<glm::vec3> predicted;
+
+    // Triangle mesh over the points, for rendering
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::vec3> colors;
+    std::vector<std::uint32_t> indices;
+};
+
+const int clothGrainSize = 256;
+
+void clothAddConstraint(Cloth &cloth, const std::vector<glm::vec3> &positions,
+                        std::uint32_t a, std::uint32_t b, bool bending)
+{
+    DistanceConstraint constraint = { a, b, glm::length(positions[a] - positions[b]), bending };
+    cloth.constraints.push_back(constraint);
+}
+
+// Add a flag of columns x rows points spaced `spacing` apart, starting at
+// `corner` and spanned by the unit vectors `right` and `down`. The first
+// column is pinned to the pole. The points are appended to `points`.
+template <typename Point>
+void clothAddFlag(Cloth &cloth, std::vector<Point> &points, int columns, int rows,
+                  const glm::vec3 &corner, const glm::vec3 &right, const glm::vec3 &down,
+                  float spacing, const glm::vec3 &color)
+{
+    std::uint32_t first = points.size();
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x < columns; x++) {
+            Point p;
+            p.pos = corner + (right * float(x) + down * float(y)) * spacing;
+            p.speed = glm::vec3(0.0f);
+            p.weight = x == 0 ? 0.0f : 1.0f;
+            points.push_back(p);
+
+            cloth.positions.push_back(p.pos);
+            // Darker stripes make the folds easier to follow
+            cloth.colors.push_back((y / 4) % 2 ? color * 0.7f : color);
+        }
+    }
+
+    // Structural and shear constraints between neighbours, bending
+    // constraints between every other point
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x < columns; x++) {
+            std::uint32_t i = first + y * columns + x;
+            if (x + 1 < columns) {
+                clothAddConstraint(cloth, cloth.positions, i, i + 1, false);
+            }
+            if (y + 1 < rows) {
+                clothAddConstraint(cloth, cloth.positions, i, i + columns, false);
+            }
+            if (x + 1 < columns && y + 1 < rows) {
+                clothAddConstraint(cloth, cloth.positions, i, i + columns + 1, false);
+                clothAddConstraint(cloth, cloth.positions, i + 1, i + columns, false);
+            }
+            if (x + 2 < columns) {
+                clothAddConstraint(cloth, cloth.positions, i, i + 2, true);
+            }
+            if (y + 2 < rows) {
+                clothAddConstraint(cloth, cloth.positions, i, i + 2 * columns, true);
+            }
+        }
+    }
+
+    for (int y = 0; y + 1 < rows; y++) {
+        for (int x = 0; x + 1 < columns; x++) {
+            std::uint32_t i = first + y * columns + x;
+            std::uint32_t quad[] = { i, i + columns, i + 1, i + 1, i + columns, i + columns + 1 };
+            cloth.indices.insert(cloth.indices.end(), quad, quad + 6);
+        }
+    }
+}
+
+// Greedily color the constraints so that no two of a color share a point,
+// and group them by color. Call after adding all pieces of cloth.
+void clothColorConstraints(Cloth &cloth)
+{
+    // Colors used by the constraints at each point, one bit per color
+    std::vector<std::uint64_t> usedColors(cloth.positions.size(), 0);
+    std::vector<int> colors(cloth.constraints.size());
+    int numColors = 0;
+
+    for (std::size_t i = 0; i < cloth.constraints.size(); i++) {
+        const DistanceConstraint &c = cloth.constraints[i];
+        std::uint64_t used = usedColors[c.a] | usedColors[c.b];
+        int color = 0;
+        while (color < 63 && (used & (std::uint64_t(1) << color))) {
+            color++;
+        }
+        usedColors[c.a] |= std::uint64_t(1) << color;
+        usedColors[c.b] |= std::uint64_t(1) << color;
+        colors[i] = color;
+        numColors = std::max(numColors, color + 1);
+    }
+
+    cloth.colorStart.assign(numColors + 1, 0);
+    for (std::size_t i = 0; i < colors.size(); i++) {
+        cloth.colorStart[colors[i] + 1]++;
+    }
+    for (int c = 0; c < numColors; c++) {
+        cloth.colorStart[c + 1] += cloth.colorStart[c];
+    }
+
+    std::vector<int> next(cloth.colorStart.begin(), cloth.colorStart.end() - 1);
+    std::vector<DistanceConstraint> sorted(cloth.constraints.size());
+    for (std::size_t i = 0; i < colors.size(); i++) {
+        sorted[next[colors[i]]++] = cloth.constraints[i];
+    }
+    cloth.constraints.swap(sorted);
+}
+
+// Advance the cloth by dt seconds in air moving at `wind`. The drag uses the
+// normals of the render mesh, which lag one step behind.
+template <typename Point>
+void clothStep(Cloth &cloth, const ClothParams &params, std::vector<Point> &points,
+               const glm::vec3 &wind, float dt, ThreadPool &pool)
+{
+    int numPoints = points.size();
+    cloth.predicted.resize(numPoints);
+    bool hasNormals = int(cloth.normals.size()) == numPoints;
+    float damping = std::exp(-params.damping * dt);
+    float drag = std::min(params.drag * dt, 1.0f);
+
+    // -- Apply the external forces and predict the new positions
+    parallelFor(pool, numPoints, clothGrainSize, [&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            Point &p = points[i];
+            if (p.weight == 0.0f) {
+                cloth.predicted[i] = p.pos;
+                continue;
+            }
+
+            p.speed += params.gravity * dt;
+            if (hasNormals) {
+                const glm::vec3 &n = cloth.normals[i];
+                p.speed += n * (glm::dot(wind - p.speed, n) * drag);
+            }
+            p.speed *= damping;
+            cloth.predicted[i] = p.pos + p.speed * dt;
+        }
+    });
+
+    // -- Project the constraints one color at a time. The stiffness is
+    // corrected so that the result does not depend on the iteration count.
+    float exponent = 1.0f / std::max(params.iterations, 1);
+    float stretch = 1.0f - std::pow(1.0f - std::min(params.stretchStiffness, 1.0f), exponent);
+    float bend = 1.0f - std::pow(1.0f - std::min(params.bendStiffness, 1.0f), exponent);
+
+    for (int iteration = 0; iteration < params.iterations; iteration++) {
+        for (std::size_t color = 0; color + 1 < cloth.colorStart.size(); color++) {
+            int first = cloth.colorStart[color];
+            parallelFor(pool, cloth.colorStart[color + 1] - first, clothGrainSize, [&](int begin, int end, int) {
+                for (int i = first + begin; i < first + end; i++) {
+                    const DistanceConstraint &c = cloth.constraints[i];
+                    float wa = points[c.a].weight;
+                    float wb = points[c.b].weight;
+                    if (wa + wb == 0.0f) {
+                        continue;
+                    }
+
+                    glm::vec3 &pa = cloth.predicted[c.a];
+                    glm::vec3 &pb = cloth.predicted[c.b];
+                    glm::vec3 d = pa - pb;
+                    float length = glm::length(d);
+                    if (length < 1e-6f) {
+                        continue;
+                    }
+
+                    float k = c.bending ? bend : stretch;
+                    glm::vec3 correction = d * ((length - c.restLength) / (length * (wa + wb)) * k);
+                    pa -= correction * wa;
+                    pb += correction * wb;
+                }
+            });
+        }
+    }
+
+    // -- Derive the velocities from the corrected positions
+    parallelFor(pool, numPoints, clothGrainSize, [&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            Point &p = points[i];
+            p.speed = (cloth.predicted[i] - p.pos) / dt;
+            p.pos = cloth.predicted[i];
+        }
+    });
+}
@@ -0,0 +1,224 @@
+#pragma once
+
+#include "utils2.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Volumes and surfaces new particles are spawned in
+enum EmitterShape {
+    EMITTER_CUBE,   // Unit cube jittered around the spawn position
+    EMITTER_SPHERE, // Surface of a sphere
+    EMITTER_BOX,    // Volume of a box
+    EMITTER_CONE,   // Point emitting into a cone around the spawn direction
+    EMITTER_MESH    // Surface of an OBJ mesh
+};
+
+// Struct for sampling a discrete distribution in constant time after
+// Walker, "An Efficient Method for Generating Discrete Random Variables with
+// General Distributions" (1977), built with Vose's method. Each column i is
+// split between i itself (with the given probability) and its alias, so a
+// sample takes one uniform column and one comparison.
+struct AliasTable {
+    std::vector<float> probability;
+    std::vector<std::uint32_t> alias;
+};
+
+// Build the table for the given non-negative weights in O(n)
+void aliasTableBuild(AliasTable &table, const std::vector<double> &weights)
+{
+    std::size_t n = weights.size();
+    table.probability.assign(n, 1.0f);
+    table.alias.resize(n);
+    for (std::size_t i = 0; i < n; i++) {
+        table.alias[i] = i;
+    }
+
+    double sum = 0.0;
+    for (std::size_t i = 0; i < n; i++) {
+        sum += weights[i];
+    }
+    if (n == 0 || sum <= 0.0) {
+        return;
+    }
+
+    // Columns scaled to an average of one, split into those below and
+    // above the average
+    std::vector<double> scaled(n);
+    std::vector<std::uint32_t> small, large;
+    for (std::size_t i = 0; i < n; i++) {
+        scaled[i] = weights[i] * n / sum;
+        (scaled[i] < 1.0 ? small : large).push_back(i);
+    }
+
+    // -- Fill each small column up with a large one
+    while (!small.empty() && !large.empty()) {
+        std::uint32_t s = small.back();
+        std::uint32_t l = large.back();
+        small.pop_back();
+        table.probability[s] = scaled[s];
+        table.alias[s] = l;
+
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    // Whatever is left is full up to rounding
+    for (std::size_t i = 0; i < small.size(); i++) {
+        table.probability[small[i]] = 1.0f;
+    }
+    for (std::size_t i = 0; i < large.size(); i++) {
+        table.probability[large[i]] = 1.0f;
+    }
+}
+
+// Draw an index with two uniform numbers in [0, 1)
+inline std::uint32_t aliasTableSample(const AliasTable &table, float u, float v)
+{
+    std::uint32_t n = table.probability.size();
+    std::uint32_t i = std::min(std::uint32_t(u * n), n - 1);
+    return v < table.probability[i] ? i : table.alias[i];
+}
+
+// Struct for emitting from the surface of a mesh. Triangles are picked in
+// proportion to their area with an alias table. The mesh is scaled to fit
+// into the unit sphere around its bounding box center.
+struct MeshEmitter {
+    OBJMesh mesh;
+    AliasTable triangles;
+    glm::vec3 center;
+    float scale;
+    float area; // Surface area of the unscaled mesh
+};
+
+// Loaded mesh emitters by file name, so switching meshes does not load the
+// mesh or build its table again
+typedef std::map<std::string, std::unique_ptr<MeshEmitter> > MeshEmitterCache;
+
+// Load a mesh and build its alias table, or take both from the cache.
+// Returns nullptr if the mesh cannot be loaded.
+const MeshEmitter *meshEmitterGet(MeshEmitterCache &cache, const std::string &filename)
+{
+    MeshEmitterCache::iterator it = cache.find(filename);
+    if (it != cache.end()) {
+        return it->second.get();
+    }
+
+    std::unique_ptr<MeshEmitter> emitter(new MeshEmitter());
+    if (!objMeshLoad(emitter->mesh, filename) || emitter->mesh.indices.empty()) {
+        // Remember the failure too, instead of trying again every frame
+        cache[filename] = nullptr;
+        return nullptr;
+    }
+
+    const OBJMesh &mesh = emitter->mesh;
+    glm::vec3 lo(mesh.vertices[0]), hi(mesh.vertices[0]);
+    for (std::size_t i = 1; i < mesh.vertices.size(); i++) {
+        lo = glm::min(lo, mesh.vertices[i]);
+        hi = glm::max(hi, mesh.vertices[i]);
+    }
+    emitter->center = (lo + hi) * 0.5f;
+    float radius = glm::length(hi - lo) * 0.5f;
+    emitter->scale = radius > 0.0f ? 1.0f / radius : 1.0f;
+
+    std::size_t numTriangles = mesh.indices.size() / 3;
+    std::vector<double> areas(numTriangles);
+    emitter->area = 0.0f;
+    for (std::size_t t = 0; t < numTriangles; t++) {
+        const glm::vec3 &a = mesh.vertices[mesh.indices[3 * t + 0]];
+        const glm::vec3 &b = mesh.vertices[mesh.indices[3 * t + 1]];
+        const glm::vec3 &c = mesh.vertices[mesh.indices[3 * t + 2]];
+        areas[t] = 0.5 * glm::length(glm::cross(b - a, c - a));
+        emitter->area += areas[t];
+    }
+    aliasTableBuild(emitter->triangles, areas);
+
+    std::cout << "Built emitter table over " << numTriangles << " triangles" << std::endl;
+
+    const MeshEmitter *result = emitter.get();
+    cache[filename] = std::move(emitter);
+    return result;
+}
+
+// Position relative to the emitter origin and outward direction of a sample,
+// which is zero for volumes
+struct EmitterSample {
+    glm::vec3 position;
+    glm::vec3 direction;
+};
+
+// Uniform point on the surface of a mesh emitter of radius `size`, from
+// four uniform numbers in [0, 1)
+EmitterSample meshEmitterSample(const MeshEmitter &emitter, float size, const float u[4])
+{
+    const OBJMesh &mesh = emitter.mesh;
+    std::uint32_t t = aliasTableSample(emitter.triangles, u[0], u[1]);
+    const glm::vec3 &a = mesh.vertices[mesh.indices[3 * t + 0]];
+    const glm::vec3 &b = mesh.vertices[mesh.indices[3 * t + 1]];
+    const glm::vec3 &c = mesh.vertices[mesh.indices[3 * t + 2]];
+
+    // Uniform barycentric coordinates
+    float r = std::sqrt(u[2]);
+    float wb = r * (1.0f - u[3]);
+    float wc = r * u[3];
+
+    EmitterSample sample;
+    sample.position = (a + (b - a) * wb + (c - a) * wc - emitter.center) * (emitter.scale * size);
+    glm::vec3 normal = glm::cross(b - a, c - a);
+    float length = glm::length(normal);
+    sample.direction = length > 0.0f ? normal / length : glm::vec3(0.0f, 1.0f, 0.0f);
+    return sample;
+}
+
+// Sample one of the analytic shapes of the given size (sphere radius, half
+// the box edge) from four uniform numbers in [0, 1). The cone has its apex
+// at the origin and opens by coneAngle radians around `axis`.
+EmitterSample emitterSample(EmitterShape shape, float size, const glm::vec3 &axis, float coneAngle,
+                            const float u[4])
+{
+    const float pi = 3.14159265f;
+    EmitterSample sample;
+    switch (shape) {
+    case EMITTER_SPHERE: {
+        float z = 1.0f - 2.0f * u[0];
+        float r = std::sqrt(std::max(1.0f - z * z, 0.0f));
+        float phi = 2.0f * pi * u[1];
+        sample.direction = glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+        sample.position = sample.direction * size;
+        break;
+    }
+    case EMITTER_BOX:
+        sample.position = (glm::vec3(u[0], u[1], u[2]) * 2.0f - 1.0f) * size;
+        sample.direction = glm::vec3(0.0f); // A volume has no outside to face
+        break;
+    case EMITTER_CONE: {
+        // Uniform over the spherical cap around the z axis, then rotated
+        // onto the axis
+        float z = 1.0f - u[0] * (1.0f - std::cos(coneAngle));
+        float r = std::sqrt(std::max(1.0f - z * z, 0.0f));
+        float phi = 2.0f * pi * u[1];
+        glm::vec3 w = glm::length(axis) > 0.0f ? glm::normalize(axis) : glm::vec3(0.0f, 1.0f, 0.0f);
+        glm::vec3 t = std::fabs(w.x) < 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+        glm::vec3 x = glm::normalize(glm::cross(t, w));
+        glm::vec3 y = glm::cross(w, x);
+        sample.direction = x * (r * std::cos(phi)) + y * (r * std::sin(phi)) + w * z;
+        sample.position = glm::vec3(0.0f);
+        break;
+    }
+    default:
+        sample.position = glm::vec3(u[0], u[1], u[2]);
+        sample.direction = glm::vec3(0.0f);
+        break;
+    }
+    return sample;
+}
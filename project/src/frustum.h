@@ -0,0 +1,109 @@
+#pragma once
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <cstdint>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+// Struct for the six clipping planes of a view frustum. Each plane is
+// stored as (a, b, c, d) with a unit normal pointing into the frustum, so
+// dot(plane.xyz, p) + plane.w is the signed distance from p to the plane.
+struct Frustum {
+    glm::vec4 planes[6]; // left, right, bottom, top, near, far
+};
+
+// Extract the frustum planes from a (view-)projection matrix
+Frustum frustumFromMatrix(const glm::mat4 &m)
+{
+    // GLM matrices are column-major, so row i is (m[0][i], m[1][i], m[2][i], m[3][i])
+    glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+    glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+    glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+    glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+
+    Frustum frustum;
+    frustum.planes[0] = row3 + row0;
+    frustum.planes[1] = row3 - row0;
+    frustum.planes[2] = row3 + row1;
+    frustum.planes[3] = row3 - row1;
+    frustum.planes[4] = row3 + row2;
+    frustum.planes[5] = row3 - row2;
+
+    for (int i = 0; i < 6; i++) {
+        frustum.planes[i] /= glm::length(glm::vec3(frustum.planes[i]));
+    }
+
+    return frustum;
+}
+
+// Returns true if the sphere is at least partially inside the frustum
+bool frustumContainsSphere(const Frustum &frustum, const glm::vec3 &center, float radius)
+{
+    for (int i = 0; i < 6; i++) {
+        const glm::vec4 &plane = frustum.planes[i];
+        if (glm::dot(glm::vec3(plane), center) + plane.w < -radius) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Test `count` bounding spheres against the frustum and write the indices of
+// the visible ones to `visible`. The spheres are packed as (x, y, z, size)
+// and the radius of each is size * radiusScale. Returns the number of visible
+// spheres. When SSE is available, four spheres are tested at a time.
+int frustumCullSpheres(const Frustum &frustum, const float *spheres, float radiusScale,
+                       int count, std::uint32_t *visible)
+{
+    int numVisible = 0;
+    int i = 0;
+
+#ifdef __SSE__
+    __m128 planeA[6], planeB[6], planeC[6], planeD[6];
+    for (int j = 0; j < 6; j++) {
+        planeA[j] = _mm_set1_ps(frustum.planes[j].x);
+        planeB[j] = _mm_set1_ps(frustum.planes[j].y);
+        planeC[j] = _mm_set1_ps(frustum.planes[j].z);
+        planeD[j] = _mm_set1_ps(frustum.planes[j].w);
+    }
+    const __m128 scale = _mm_set1_ps(radiusScale);
+
+    for (; i + 4 <= count; i += 4) {
+        // Load four spheres and transpose them into x, y, z and size lanes
+        __m128 x = _mm_loadu_ps(spheres + 4 * i + 0);
+        __m128 y = _mm_loadu_ps(spheres + 4 * i + 4);
+        __m128 z = _mm_loadu_ps(spheres + 4 * i + 8);
+        __m128 r = _mm_loadu_ps(spheres + 4 * i + 12);
+        _MM_TRANSPOSE4_PS(x, y, z, r);
+        __m128 negRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(r, scale));
+
+        __m128 inside = _mm_cmpeq_ps(negRadius, negRadius); // all ones
+        for (int j = 0; j < 6; j++) {
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planeA[j], x), _mm_mul_ps(planeB[j], y)),
+                                  _mm_add_ps(_mm_mul_ps(planeC[j], z), planeD[j]));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(d, negRadius));
+        }
+
+        int mask = _mm_movemask_ps(inside);
+        for (int k = 0; k < 4; k++) {
+            if (mask & (1 << k)) {
+                visible[numVisible++] = i + k;
+            }
+        }
+    }
+#endif // __SSE__
+
+    // Remaining spheres (or all of them without SSE)
+    for (; i < count; i++) {
+        const float *s = spheres + 4 * i;
+        if (frustumContainsSphere(frustum, glm::vec3(s[0], s[1], s[2]), s[3] * radiusScale)) {
+            visible[numVisible++] = i;
+        }
+    }
+
+    return numVisible;
+}
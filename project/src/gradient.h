@@ -0,0 +1,68 @@
+#pragma once
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+
+// A key of a gradient over the lifetime of a particle
+struct GradientKey {
+    float age;       // Normalized age in [0, 1]
+    glm::vec4 color; // RGB color and alpha in [0, 1]
+    float size;      // Scale of the particle size
+};
+
+// Evaluate a piecewise linear gradient. The keys must be sorted by age.
+void gradientEvaluate(const GradientKey *keys, int numKeys, float age,
+                      glm::vec4 *color, float *size)
+{
+    if (age <= keys[0].age) {
+        *color = keys[0].color;
+        *size = keys[0].size;
+        return;
+    }
+
+    for (int i = 1; i < numKeys; i++) {
+        if (age <= keys[i].age) {
+            const GradientKey &a = keys[i - 1];
+            const GradientKey &b = keys[i];
+            float t = (age - a.age) / std::max(b.age - a.age, 1e-6f);
+            *color = glm::mix(a.color, b.color, t);
+            *size = glm::mix(a.size, b.size, t);
+            return;
+        }
+    }
+
+    *color = keys[numKeys - 1].color;
+    *size = keys[numKeys - 1].size;
+}
+
+// Returns the largest size scale of a gradient
+float gradientMaxSize(const GradientKey *keys, int numKeys)
+{
+    float size = keys[0].size;
+    for (int i = 1; i < numKeys; i++) {
+        size = std::max(size, keys[i].size);
+    }
+    return size;
+}
+
+// Bake a gradient into lookup tables with `resolution` entries evenly spaced
+// over the normalized age. `colors` receives RGBA values and `sizes` one
+// value per entry; both are written with the given stride in floats.
+void gradientBake(const GradientKey *keys, int numKeys, int resolution,
+                  float *colors, float *sizes, int stride)
+{
+    for (int i = 0; i < resolution; i++) {
+        float age = float(i) / float(resolution - 1);
+        glm::vec4 color;
+        float size;
+        gradientEvaluate(keys, numKeys, age, &color, &size);
+
+        colors[i * stride + 0] = color.r;
+        colors[i * stride + 1] = color.g;
+        colors[i * stride + 2] = color.b;
+        colors[i * stride + 3] = color.a;
+        sizes[i * stride] = size;
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Things that happen to a particle and can trigger a sub-emitter
+enum ParticleEventType {
+    EVENT_DEATH,
+    EVENT_COLLISION,
+    EVENT_AGE // The normalized age passed a threshold
+};
+
+struct ParticleEvent {
+    glm::vec3 position;
+    glm::vec3 velocity;
+    float size;
+    std::uint8_t type;     // ParticleEventType
+    std::uint8_t material; // Material of the particle that raised the event
+};
+
+// Struct for a bounded queue of events. A slot is claimed with a single
+// atomic increment, so pushing never takes a lock and never waits. Pushes
+// past the capacity are dropped, and the queue remembers how many.
+struct ParticleEventQueue {
+    std::vector<ParticleEvent> events; // Capacity slots
+    std::atomic<std::uint32_t> size;   // Slots claimed since the last drain, may exceed the capacity
+    char padding[64];                  // Keeps the counters of neighbouring queues on separate cache lines
+
+    ParticleEventQueue() : size(0) {}
+};
+
+// Struct for one event queue per thread of the pool. Threads of a
+// parallelFor() push to the queue of their thread index, so the simulation
+// loop never contends for a queue; the queues are drained in bulk once the
+// loop has finished.
+struct ParticleEventQueues {
+    std::unique_ptr<ParticleEventQueue[]> queues;
+    int numQueues;
+    std::uint32_t capacity; // Events per queue and drain
+
+    ParticleEventQueues() : numQueues(0), capacity(0) {}
+};
+
+void particleEventsInit(ParticleEventQueues &queues, int numQueues, std::uint32_t capacity)
+{
+    queues.queues.reset(new ParticleEventQueue[numQueues]);
+    queues.numQueues = numQueues;
+    queues.capacity = capacity;
+    for (int i = 0; i < numQueues; i++) {
+        queues.queues[i].events.resize(capacity);
+    }
+}
+
+// Push an event to the queue of the given thread. Returns false if the
+// queue is full and the event was dropped.
+inline bool particleEventPush(ParticleEventQueues &queues, int threadIndex, const ParticleEvent &event)
+{
+    ParticleEventQueue &queue = queues.queues[threadIndex];
+    std::uint32_t slot = queue.size.fetch_add(1, std::memory_order_relaxed);
+    if (slot >= queues.capacity) {
+        return false;
+    }
+    queue.events[slot] = event;
+    return true;
+}
+
+// Call handle(event) for every queued event, queue by queue, and empty the
+// queues. Must not run concurrently with pushes. Returns the number of
+// events dropped since the last drain.
+template <typename HandleFunction>
+int particleEventsDrain(ParticleEventQueues &queues, HandleFunction handle)
+{
+    int dropped = 0;
+    for (int q = 0; q < queues.numQueues; q++) {
+        ParticleEventQueue &queue = queues.queues[q];
+        std::uint32_t size = queue.size.load(std::memory_order_relaxed);
+        std::uint32_t count = std::min(size, queues.capacity);
+        for (std::uint32_t i = 0; i < count; i++) {
+            handle(queue.events[i]);
+        }
+        dropped += size - count;
+        queue.size.store(0, std::memory_order_relaxed);
+    }
+    return dropped;
+}
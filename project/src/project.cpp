@@ -1,6 +1,19 @@
 // Private stuff
 #include "utils.h"
 #include "utils2.h"
+#include "frustum.h"
+#include "quality.h"
+#include "timing_wheel.h"
+#include "gradient.h"
+#include "atlas.h"
+#include "parallel.h"
+#include "sph.h"
+#include "boids.h"
+#include "smoke_grid.h"
+#include "cloth.h"
+#include "particle_events.h"
+#include "emitter_shapes.h"
+#include "surface.h"
 
 // For debugging
 #include <stdio.h>
@@ -17,98 +30,290 @@
 #include <iostream>
 #include <cstdlib>
 #include <algorithm>
+#include <chrono>
 
 // -- MACROS
 #define GLM_FORCE_RADIANS
 
 double lastTime;
+double simulationTime = 0.0; // Sum of all simulation steps, used for particle expiry
 
 enum CurrentSimulation {
   DEFAULT,
   TORNADO,
   FIRE,
   FOUNTAIN,
-  EXPLOSION
+  EXPLOSION,
+  SWARM
+};
+const int numSimulations = SWARM + 1;
+
+// Sprites of the particle atlas. Each material is a flipbook played over
+// the lifetime of the particle.
+enum ParticleMaterial {
+  MATERIAL_LIGHT,
+  MATERIAL_SMOKE,
+  MATERIAL_FLAME
+};
+const int numMaterials = MATERIAL_FLAME + 1;
+
+// How the particle vertex shader fetches the per-particle data
+enum ParticleFetch {
+  FETCH_ATTRIBUTES,  // Instanced vertex attributes (glVertexAttribDivisor)
+  FETCH_INSTANCE_ID, // Buffer textures indexed by gl_InstanceID
+  FETCH_VERTEX_ID    // Buffer textures indexed by gl_VertexID / 4, one indexed draw
+};
+
+// How the level of detail stage compensates for dropped particles
+enum LodCompensation {
+  LOD_ENLARGE,
+  LOD_BRIGHTEN
 };
 
 // CPU representation of a particle
 struct Particle{
   glm::vec3 pos, speed;
-  unsigned char r,g,b,a; // Color
+  unsigned char a; // Opacity, scaled by the alpha curve of the simulation
+  unsigned char material; // ParticleMaterial
   float size, angle, weight;
-  float life; // Remaining life of the particle. if < 0 : dead and unused.
-  float cameradistance; // *Squared* distance to the camera. if dead : -1.0f
+  float life; // Remaining life of the particle in seconds
+  float lifetime; // Total life of the particle in seconds
+  float cameradistance; // *Squared* distance to the camera
+  std::uint32_t seed; // Stable random seed, assigned at spawn
+  unsigned char generation; // 0 for particles of the emitter, 1 for particles of a sub-emitter
+  TimingWheelLocation expiry; // Where the particle is scheduled in particleExpiryWheel
+};
 
-  bool operator<(const Particle& that) const {
-    // Sort in reverse order : far particles drawn first.
-    return this->cameradistance > that.cameradistance;
-  }
+// Colors used by the lifetime curves
+const glm::vec4 particleRed(230 / 255.0f, 110 / 255.0f, 0.0f, 1.0f);
+const glm::vec4 particleYellow(150 / 255.0f, 110 / 255.0f, 0.0f, 1.0f);
+const glm::vec4 particleGray(100 / 255.0f, 100 / 255.0f, 100 / 255.0f, 1.0f);
+const glm::vec4 particleBlue(53 / 255.0f, 202 / 255.0f, 239 / 255.0f, 1.0f);
+const glm::vec4 particleFaded(100 / 255.0f, 100 / 255.0f, 100 / 255.0f, 0.0f);
+const glm::vec4 particleDark(30 / 255.0f, 30 / 255.0f, 40 / 255.0f, 1.0f);
+
+// Color, alpha and size of the particles over their normalized age, per simulation
+const GradientKey defaultCurve[] = {
+  { 0.0f, particleGray, 1.0f },
+  { 1.0f, particleGray, 1.0f },
 };
 
-void colorParticleRed(Particle &p)
-{
-    p.r = 230;
-    p.g = 110;
-    p.b = 0;
-}
+const GradientKey fireCurve[] = {
+  { 0.0f,  particleRed,    1.0f },
+  { 0.2f,  particleRed,    1.0f },
+  { 0.3f,  particleYellow, 1.0f },
+  { 0.45f, particleYellow, 1.0f },
+  { 0.55f, particleGray,   1.0f },
+  { 1.0f,  particleFaded,  1.5f },
+};
 
-void colorParticleYellow(Particle &p)
-{
-    p.r = 150;
-    p.g = 110;
-    p.b = 0;
-}
+const GradientKey fountainCurve[] = {
+  { 0.0f, particleBlue, 1.0f },
+  { 1.0f, particleBlue, 1.0f },
+};
 
-void colorParticleGray(Particle &p)
-{
-    p.r = 100;
-    p.g = 100;
-    p.b = 100;
-}
+const GradientKey explosionCurve[] = {
+  { 0.0f,  particleRed,    1.0f },
+  { 0.08f, particleRed,    1.0f },
+  { 0.12f, particleYellow, 1.0f },
+  { 0.18f, particleYellow, 1.0f },
+  { 0.22f, particleGray,   1.0f },
+  { 1.0f,  particleFaded,  2.0f },
+};
 
-void colorParticleBlue(Particle &p)
-{
-    p.r = 53;
-    p.g = 202;
-    p.b = 239;
-}
+const GradientKey swarmCurve[] = {
+  { 0.0f,  particleFaded, 1.0f },
+  { 0.05f, particleDark,  1.0f },
+  { 0.9f,  particleDark,  1.0f },
+  { 1.0f,  particleFaded, 1.0f },
+};
+
+struct LifetimeCurve {
+  const GradientKey *keys;
+  int numKeys;
+};
+
+// Indexed by CurrentSimulation
+const LifetimeCurve lifetimeCurves[numSimulations] = {
+  { defaultCurve,   sizeof(defaultCurve) / sizeof(GradientKey) },   // DEFAULT
+  { defaultCurve,   sizeof(defaultCurve) / sizeof(GradientKey) },   // TORNADO
+  { fireCurve,      sizeof(fireCurve) / sizeof(GradientKey) },      // FIRE
+  { fountainCurve,  sizeof(fountainCurve) / sizeof(GradientKey) },  // FOUNTAIN
+  { explosionCurve, sizeof(explosionCurve) / sizeof(GradientKey) }, // EXPLOSION
+  { swarmCurve,     sizeof(swarmCurve) / sizeof(GradientKey) },     // SWARM
+};
+
+// Number of entries in the baked lookup tables
+const int lifetimeCurveResolution = 256;
+
+// Particles spawned when a particle of the emitter raises an event. Children
+// never raise events themselves.
+struct SubEmitter {
+  CurrentSimulation simulation;
+  ParticleMaterial parent;   // Material of the particles that trigger it
+  ParticleEventType trigger;
+  float threshold;           // Normalized age for EVENT_AGE
+  int count;                 // Children per event
+  ParticleMaterial material; // Material of the children
+  float life;                // Seconds the children live
+  float speed;               // Random speed of the children
+  float lift;                // Upward speed of the children
+  float inherit;             // Fraction of the parent velocity the children keep
+};
+
+const SubEmitter subEmitters[] = {
+  // Explosion sparks leave a puff of smoke where they burn out
+  { EXPLOSION, MATERIAL_FLAME, EVENT_DEATH,     0.0f, 2, MATERIAL_SMOKE, 2.0f, 0.5f, 0.5f, 0.2f },
+  // Flames turn to smoke towards the top of the fire
+  { FIRE,      MATERIAL_FLAME, EVENT_AGE,       0.7f, 1, MATERIAL_SMOKE, 1.5f, 0.3f, 0.0f, 1.0f },
+  // Fountain drops splash when they hit the ground
+  { FOUNTAIN,  MATERIAL_LIGHT, EVENT_COLLISION, 0.0f, 3, MATERIAL_LIGHT, 0.6f, 1.5f, 2.0f, 0.0f },
+};
+const int numSubEmitters = sizeof(subEmitters) / sizeof(subEmitters[0]);
 
 const int maxParticles = 100000;
 Particle particlesContainer[maxParticles];
 
-void sortParticles()
+// Clipping planes of the camera
+const float nearPlane = 0.1f;
+const float farPlane = 100.0f;
+
+// Radius of the bounding sphere of a billboard relative to its size (half the diagonal)
+const float billboardRadiusScale = 0.70710678f;
+
+std::uint32_t nextParticleSeed = 0;
+
+// Stable pseudo-random value in [0, 1) for a particle seed
+float particleHash(std::uint32_t seed)
 {
-  std::sort(&particlesContainer[0], &particlesContainer[maxParticles]);
+  // Integer hash by Thomas Wang
+  seed = (seed ^ 61) ^ (seed >> 16);
+  seed *= 9;
+  seed = seed ^ (seed >> 4);
+  seed *= 0x27d4eb2d;
+  seed = seed ^ (seed >> 15);
+  return (seed >> 8) * (1.0f / 16777216.0f);
 }
 
-int lastUsedParticle = 0;
-int findUnusedParticle(){
+// Live particles are stored in particlesContainer[0, liveParticles). When a
+// particle dies the last live particle is moved into its place.
+int liveParticles = 0;
 
-  for(int i=lastUsedParticle; i<maxParticles; i++){
-    if (particlesContainer[i].life < 0){
-      lastUsedParticle = i;
-      return i;
-    }
+// Particles bucketed by the time they die
+TimingWheel particleExpiryWheel;
+
+// Allocate a particle at the end of the live range and schedule its death.
+// Returns -1 if the container is full.
+int spawnParticle(float life)
+{
+  if(liveParticles >= maxParticles){
+    return -1;
   }
 
-  for(int i=0; i<lastUsedParticle; i++){
-    if (particlesContainer[i].life < 0){
-      lastUsedParticle = i;
-      return i;
-    }
+  int i = liveParticles++;
+  particlesContainer[i].life = life;
+  particlesContainer[i].lifetime = life;
+  particlesContainer[i].expiry = timingWheelInsert(particleExpiryWheel, i,
+      timingWheelTickAfter(particleExpiryWheel, simulationTime + life));
+
+  return i;
+}
+
+void killParticle(std::uint32_t i)
+{
+  std::uint32_t last = --liveParticles;
+  if(i != last){
+    particlesContainer[i] = particlesContainer[last];
+    timingWheelRelocate(particleExpiryWheel, particlesContainer[i].expiry, i);
   }
+}
 
-  return 0; // All particles are taken, override the first one
+// Remove all particles that have died up to the current simulation time.
+// onDeath(particle) is called before each particle is removed. Returns the
+// number of removed particles.
+template <typename DeathFunction>
+int expireParticles(DeathFunction onDeath)
+{
+  return timingWheelAdvance(particleExpiryWheel, simulationTime,
+      [&](std::uint32_t i) { onDeath(particlesContainer[i]); killParticle(i); },
+      [](std::uint32_t i, TimingWheelLocation location) { particlesContainer[i].expiry = location; });
 }
 
+// Staging data for all live particles, filled by simulateParticles()
 static GLfloat* g_particule_position_size_data = new GLfloat[maxParticles * 4];
-static GLubyte* g_particule_color_data         = new GLubyte[maxParticles * 4];
+static GLubyte* g_particule_lifetime_data      = new GLubyte[maxParticles * 4]; // Normalized age, opacity, material, temperature
+static GLfloat* g_particule_distance_data      = new GLfloat[maxParticles];
+static std::uint32_t* g_particule_seed_data    = new std::uint32_t[maxParticles];
+
+// Positions and velocities of the live particles handed to the fluid and
+// swarm solvers
+static glm::vec3* g_solver_positions  = new glm::vec3[maxParticles];
+static glm::vec3* g_solver_velocities = new glm::vec3[maxParticles];
+
+// Worker threads shared by the particle solvers
+ThreadPool threadPool;
+
+// Indices into the staging data of the particles inside the view frustum
+static std::uint32_t* g_visible_particles = new std::uint32_t[maxParticles];
+
+// Visible particles in back-to-front order, uploaded to the GPU
+static GLfloat* g_visible_position_size_data = new GLfloat[maxParticles * 4];
+static GLubyte* g_visible_lifetime_data      = new GLubyte[maxParticles * 4];
+
+// Sort the visible particles back to front and gather them for upload
+void sortVisibleParticles(int visibleCount)
+{
+  // Sort in reverse order : far particles drawn first.
+  std::sort(&g_visible_particles[0], &g_visible_particles[visibleCount],
+      [](std::uint32_t a, std::uint32_t b) {
+        return g_particule_distance_data[a] > g_particule_distance_data[b];
+      });
+
+  for(int i = 0; i < visibleCount; i++){
+    std::uint32_t j = g_visible_particles[i];
+    std::copy(&g_particule_position_size_data[4*j], &g_particule_position_size_data[4*j+4], &g_visible_position_size_data[4*i]);
+    std::copy(&g_particule_lifetime_data[4*j], &g_particule_lifetime_data[4*j+4], &g_visible_lifetime_data[4*i]);
+  }
+}
 
 // The attribute locations we will use in the vertex shader
 enum AttributeLocation {
   POSITION = 0
 };
 
+// Per-frame particle statistics
+struct ParticleStats {
+  int live;      // Particles simulated this frame
+  int expired;   // Particles that died this frame
+  int visible;   // Particles inside the view frustum
+  int culled;    // Particles outside the view frustum
+  int decimated; // Visible particles dropped by the level of detail stage
+  int drawn;     // Particles uploaded and drawn
+  int events;         // Sub-emitter events raised
+  int events_dropped; // Events that did not fit into the event queues
+  int children;       // Particles spawned by sub-emitters
+  int children_dropped; // Children that did not fit into the particle budget
+};
+
+const int numLodBands = 3;
+
+// Settings applied by the adaptive quality controller, from lowest to highest
+struct QualityLevel {
+  float emission_scale;     // Fraction of the emission rate
+  float budget_scale;       // Fraction of maxParticles that may be alive
+  float lod_pixel_threshold;
+  int particle_downsample;
+};
+
+const QualityLevel qualityLevels[] = {
+  { 0.35f, 0.25f, 8.0f, 4 },
+  { 0.5f,  0.4f,  6.0f, 2 },
+  { 0.7f,  0.6f,  4.0f, 2 },
+  { 0.85f, 0.8f,  3.0f, 1 },
+  { 1.0f,  1.0f,  2.0f, 1 },
+};
+const int numQualityLevels = sizeof(qualityLevels) / sizeof(qualityLevels[0]);
+
 // Struct for resources
 struct Context {
   int width;
@@ -124,10 +329,25 @@ struct Context {
 
   GLuint defaultVAO;
 
+  ParticleFetch particle_fetch; // Chosen at startup
   GLuint particleVAO;
+  GLuint particlePullVAO; // No attributes, only the quad index buffer
+  GLuint quad_index_buffer;
+  GLuint particles_position_texture, particles_lifetime_texture; // Buffer textures
   GLuint particleProgram;
-  GLuint billboard_vertex_buffer, particles_position_buffer, particles_color_buffer;
-  GLuint texture;
+  GLuint billboard_vertex_buffer, particles_position_buffer, particles_lifetime_buffer;
+  GLuint texture; // Sprite atlas of all particle materials
+  AtlasRegion materials[numMaterials]; // Atlas region of each ParticleMaterial
+  GLuint lifetimeCurveTexture;
+
+  // Reduced resolution particle pass. The scene is drawn into sceneFBO and
+  // the particles into particleFBO, which is then upsampled onto the screen.
+  int particle_downsample; // 1 = full resolution (no offscreen pass), 2 = half, 4 = quarter
+  int offscreen_width, offscreen_height, offscreen_downsample; // Size the targets were created for
+  GLuint sceneFBO, sceneColorTexture, sceneDepthTexture;
+  GLuint particleFBO, particleColorTexture, particleDepthTexture;
+  GLuint depthDownsampleProgram;
+  GLuint upsampleProgram;
 
   glm::vec3 camera_direction;
 
@@ -145,12 +365,113 @@ struct Context {
   bool simulate_tornado;
   bool simulate_fire;
   bool simulate_explosion;
+  bool simulate_swarm;
 
   double last_explosion;
   float explosion_delay;
 
   bool wind_enabled;
   glm::vec3 wind_vector;
+
+  // Fluid mode of the fountain. The solver runs fluid_substep_rate steps
+  // per simulated second, at most fluid_max_substeps per frame.
+  bool fluid_enabled;
+  float fluid_substep_rate;
+  int fluid_max_substeps;
+  double fluid_time; // Simulated time not yet covered by solver steps
+  FluidParams fluid;
+  FluidSolver fluidSolver;
+  float fluid_ms;    // Time spent in the solver last frame
+
+  // Flocking rules of the swarm
+  SwarmParams swarm;
+  SwarmSolver swarmSolver;
+  float swarm_ms;    // Time spent in the solver last frame
+
+  // Smoke grid that carries the fire and explosion particles. Particles
+  // take on the grid velocity at smoke_drag per second and are colored by
+  // the grid temperature.
+  bool smoke_enabled;
+  SmokeParams smoke;
+  SmokeGrid smokeGrid;
+  float smoke_drag;
+  double smoke_last_burst; // Time of the explosion that last heated the grid
+  float smoke_ms;          // Time spent in the solver last frame
+
+  // Cloth flags in the wind. The mass points are Particles with weight as
+  // the inverse mass, stepped cloth_substep_rate times per simulated second.
+  bool cloth_enabled;
+  float cloth_substep_rate;
+  int cloth_max_substeps;
+  double cloth_time;      // Simulated time not yet covered by solver steps
+  double cloth_last_time; // Time of the last cloth update
+  float cloth_wind_scale; // Air speed per unit of wind_vector
+  ClothParams cloth;
+  Cloth clothSolver;
+  std::vector<Particle> clothPoints;
+  GLuint clothVAO;
+  GLuint cloth_position_buffer, cloth_normal_buffer, cloth_color_buffer, cloth_index_buffer;
+  GLuint clothProgram;
+  float cloth_ms;         // Time spent in the solver last frame
+
+  // Isosurface of the particle density, extracted from the particle
+  // positions of the previous frame and lit like the model viewer meshes
+  bool surface_enabled;
+  bool surface_hide_particles; // Draw the surface instead of the billboards
+  SurfaceParams surface;
+  SurfaceExtractor surfaceExtractor;
+  GLuint surfaceVAO, surface_vertex_buffer;
+  GLuint surfaceProgram;
+  glm::vec3 surface_light_position; // In view space
+  glm::vec3 surface_light_color;
+  glm::vec3 surface_ambient_color, surface_diffuse_color, surface_specular_color;
+  float surface_specular_power;
+  int surface_triangles;
+  float surface_ms; // Time spent extracting the surface last frame
+
+  // Sub-emitters. Events are raised into one queue per thread and turned
+  // into particles after the simulation loop.
+  bool sub_emitters_enabled;
+  ParticleEventQueues events;
+  int event_queue_capacity; // Events per thread and frame
+  float ground_height;       // Height of the plane that EVENT_COLLISION tests against
+  float ground_restitution;
+  int events_dropped_total;
+
+  // Emitter shape. Mesh emitters are loaded from the files given with
+  // --emitter-mesh when first selected.
+  EmitterShape emitter_shape;
+  float emitter_size;         // Sphere and mesh radius, half the box edge
+  float emitter_cone_angle;   // Half angle of the cone in degrees
+  float emitter_normal_speed; // Speed along the surface normal
+  std::vector<std::string> emitter_mesh_files;
+  int emitter_mesh_index;
+  MeshEmitterCache meshEmitters;
+
+  // Emission
+  float emission_rate;  // Particles spawned per second
+  float emission_scale; // Set by the quality controller
+  int particle_budget;  // Maximum number of live particles
+
+  // Adaptive quality
+  bool adaptive_quality;
+  float target_frame_ms;
+  float frame_ms;
+  QualityController quality;
+
+  // Rendering settings
+  bool frustum_culling;
+
+  // Level of detail: beyond lod_band_distance[i] only lod_band_keep[i] of
+  // the particles are drawn, and particles smaller than lod_pixel_threshold
+  // pixels on screen are thinned out further
+  bool lod_enabled;
+  float lod_band_distance[numLodBands];
+  float lod_band_keep[numLodBands];
+  float lod_pixel_threshold;
+  LodCompensation lod_compensation;
+
+  ParticleStats stats;
 };
 
 GLuint createTriangleVAO()
@@ -197,9 +518,9 @@ GLuint createParticleVAO(Context &ctx)
   // Initialize with empty (NULL) buffer : it will be updated later, each frame.
   glBufferData(GL_ARRAY_BUFFER, maxParticles * 4 * sizeof(GLfloat), NULL, GL_DYNAMIC_DRAW);
 
-  // The VBO containing the colors of the particles
-  glGenBuffers(1, &ctx.particles_color_buffer);
-  glBindBuffer(GL_ARRAY_BUFFER, ctx.particles_color_buffer);
+  // The VBO containing the normalized ages and opacities of the particles
+  glGenBuffers(1, &ctx.particles_lifetime_buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, ctx.particles_lifetime_buffer);
   // Initialize with empty (NULL) buffer : it will be updated later, each frame.
   glBufferData(GL_ARRAY_BUFFER, maxParticles * 4 * sizeof(GLubyte), NULL, GL_DYNAMIC_DRAW);
 
@@ -217,15 +538,225 @@ GLuint createParticleVAO(Context &ctx)
   glBindBuffer(GL_ARRAY_BUFFER, ctx.particles_position_buffer);
   glVertexAttribPointer( 1, 4, GL_FLOAT, GL_FALSE, 0, (void*)0);
 
-  // colors
+  // ages and opacities
   glEnableVertexAttribArray(2);
-  glBindBuffer(GL_ARRAY_BUFFER, ctx.particles_color_buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, ctx.particles_lifetime_buffer);
   glVertexAttribPointer( 2, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, (void*)0);
 
+  glVertexAttribDivisor(0, 0); // particles vertices : always reuse the same 4 vertices -> 0
+  glVertexAttribDivisor(1, 1); // positions : one per quad (its center) -> 1
+  glVertexAttribDivisor(2, 1); // age and opacity : one per quad -> 1
+
+  // Buffer textures over the same VBOs, for vertex pulling
+  glGenTextures(1, &ctx.particles_position_texture);
+  glBindTexture(GL_TEXTURE_BUFFER, ctx.particles_position_texture);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, ctx.particles_position_buffer);
+
+  glGenTextures(1, &ctx.particles_lifetime_texture);
+  glBindTexture(GL_TEXTURE_BUFFER, ctx.particles_lifetime_texture);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA8, ctx.particles_lifetime_buffer);
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
+
+  // Two triangles per particle, referencing the four corners 4 * i + [0, 3]
+  std::vector<GLuint> quadIndices(maxParticles * 6);
+  for(int i = 0; i < maxParticles; i++){
+    const GLuint corners[] = { 0, 1, 2, 2, 1, 3 };
+    for(int j = 0; j < 6; j++){
+      quadIndices[6*i+j] = 4*i + corners[j];
+    }
+  }
+  glGenBuffers(1, &ctx.quad_index_buffer);
+
+  // The vertex pulling VAO has no attributes at all
+  glGenVertexArrays(1, &ctx.particlePullVAO);
+  glBindVertexArray(ctx.particlePullVAO);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ctx.quad_index_buffer);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, quadIndices.size() * sizeof(GLuint), &quadIndices[0], GL_STATIC_DRAW);
+
   // Re-bind default VAO to protect this from changes
   glBindVertexArray(ctx.defaultVAO);
 }
 
+// Set up two flags on poles either side of the emitter and the VAO they are
+// drawn with. Positions and normals are updated every frame.
+void createClothVAO(Context &ctx)
+{
+  const int columns = 32, rows = 20;
+  const float spacing = 0.2f;
+  clothAddFlag(ctx.clothSolver, ctx.clothPoints, columns, rows, glm::vec3(-12.0f, 8.0f, -4.0f),
+      glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f), spacing, glm::vec3(0.8f, 0.1f, 0.1f));
+  clothAddFlag(ctx.clothSolver, ctx.clothPoints, columns, rows, glm::vec3(5.0f, 8.0f, -4.0f),
+      glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f), spacing, glm::vec3(0.1f, 0.3f, 0.8f));
+  clothColorConstraints(ctx.clothSolver);
+
+  Cloth &cloth = ctx.clothSolver;
+  computeNormals(cloth.positions, cloth.indices, &cloth.normals);
+
+  glGenBuffers(1, &ctx.cloth_position_buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, ctx.cloth_position_buffer);
+  glBufferData(GL_ARRAY_BUFFER, cloth.positions.size() * sizeof(glm::vec3), &cloth.positions[0], GL_DYNAMIC_DRAW);
+
+  glGenBuffers(1, &ctx.cloth_normal_buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, ctx.cloth_normal_buffer);
+  glBufferData(GL_ARRAY_BUFFER, cloth.normals.size() * sizeof(glm::vec3), &cloth.normals[0], GL_DYNAMIC_DRAW);
+
+  glGenBuffers(1, &ctx.cloth_color_buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, ctx.cloth_color_buffer);
+  glBufferData(GL_ARRAY_BUFFER, cloth.colors.size() * sizeof(glm::vec3), &cloth.colors[0], GL_STATIC_DRAW);
+
+  glGenVertexArrays(1, &ctx.clothVAO);
+  glBindVertexArray(ctx.clothVAO);
+
+  glEnableVertexAttribArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, ctx.cloth_position_buffer);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+
+  glEnableVertexAttribArray(1);
+  glBindBuffer(GL_ARRAY_BUFFER, ctx.cloth_normal_buffer);
+  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+
+  glEnableVertexAttribArray(2);
+  glBindBuffer(GL_ARRAY_BUFFER, ctx.cloth_color_buffer);
+  glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+
+  glGenBuffers(1, &ctx.cloth_index_buffer);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ctx.cloth_index_buffer);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, cloth.indices.size() * sizeof(std::uint32_t), &cloth.indices[0], GL_STATIC_DRAW);
+
+  glBindVertexArray(ctx.defaultVAO);
+}
+
+// VAO of the particle surface. The vertex buffer is refilled every frame.
+void createSurfaceVAO(Context &ctx)
+{
+  glGenBuffers(1, &ctx.surface_vertex_buffer);
+
+  glGenVertexArrays(1, &ctx.surfaceVAO);
+  glBindVertexArray(ctx.surfaceVAO);
+  glBindBuffer(GL_ARRAY_BUFFER, ctx.surface_vertex_buffer);
+
+  glEnableVertexAttribArray(0);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(SurfaceVertex), (void*)offsetof(SurfaceVertex, position));
+
+  glEnableVertexAttribArray(1);
+  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(SurfaceVertex), (void*)offsetof(SurfaceVertex, normal));
+
+  glBindVertexArray(ctx.defaultVAO);
+}
+
+// Build the sprite atlas holding all particle materials: the light sprite
+// and procedurally generated 4x4 flipbooks of smoke and flame
+void createParticleAtlas(Context &ctx)
+{
+  std::vector<unsigned char> light;
+  unsigned lightWidth, lightHeight;
+  loadImage(resourceDir() + "whitelight.png", light, lightWidth, lightHeight);
+
+  // Regions are added in ParticleMaterial order
+  SpriteAtlas atlas;
+  atlasInit(atlas, 1024, 1024);
+  atlasAddImage(atlas, 0, 0, 512, light, lightWidth, lightHeight);
+  atlasAddFlipbook(atlas, 512, 0, 128, 4, 4, smokeFrame);
+  atlasAddFlipbook(atlas, 0, 512, 128, 4, 4, flameFrame);
+
+  for(int i = 0; i < numMaterials; i++){
+    ctx.materials[i] = atlas.regions[i];
+  }
+  ctx.texture = create2DTexture(&atlas.pixels[0], atlas.width, atlas.height);
+}
+
+// Bake the lifetime curves of all simulations into one texture. Each
+// simulation has two rows: RGBA color and alpha, and the size scale in red.
+GLuint createLifetimeCurveTexture()
+{
+  std::vector<GLfloat> data(lifetimeCurveResolution * 2 * numSimulations * 4, 0.0f);
+  for(int i = 0; i < numSimulations; i++){
+    GLfloat *colors = &data[lifetimeCurveResolution * 4 * (2 * i)];
+    GLfloat *sizes = &data[lifetimeCurveResolution * 4 * (2 * i + 1)];
+    gradientBake(lifetimeCurves[i].keys, lifetimeCurves[i].numKeys, lifetimeCurveResolution, colors, sizes, 4);
+  }
+
+  GLuint texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, lifetimeCurveResolution, 2 * numSimulations, 0, GL_RGBA,
+      GL_FLOAT, &data[0]);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  return texture;
+}
+
+GLuint createRenderTexture(GLint internalFormat, GLenum format, GLenum type, int width, int height)
+{
+  GLuint texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, NULL);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  return texture;
+}
+
+GLuint createFramebuffer(GLuint colorTexture, GLuint depthTexture)
+{
+  GLuint fbo;
+  glGenFramebuffers(1, &fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture, 0);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+
+  if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    std::cerr << "Error: offscreen framebuffer is incomplete" << std::endl;
+  }
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  return fbo;
+}
+
+// (Re)create the offscreen targets if the window size or the particle
+// resolution has changed since they were last created
+void updateOffscreenTargets(Context &ctx)
+{
+  if(ctx.offscreen_width == ctx.width && ctx.offscreen_height == ctx.height &&
+      ctx.offscreen_downsample == ctx.particle_downsample) {
+    return;
+  }
+
+  if(ctx.offscreen_downsample != 0) {
+    glDeleteFramebuffers(1, &ctx.sceneFBO);
+    glDeleteFramebuffers(1, &ctx.particleFBO);
+    GLuint textures[] = {
+      ctx.sceneColorTexture, ctx.sceneDepthTexture,
+      ctx.particleColorTexture, ctx.particleDepthTexture
+    };
+    glDeleteTextures(4, textures);
+  }
+
+  int width = std::max(ctx.width / ctx.particle_downsample, 1);
+  int height = std::max(ctx.height / ctx.particle_downsample, 1);
+
+  ctx.sceneColorTexture = createRenderTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, ctx.width, ctx.height);
+  ctx.sceneDepthTexture = createRenderTexture(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_FLOAT, ctx.width, ctx.height);
+  ctx.sceneFBO = createFramebuffer(ctx.sceneColorTexture, ctx.sceneDepthTexture);
+
+  ctx.particleColorTexture = createRenderTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, width, height);
+  ctx.particleDepthTexture = createRenderTexture(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_FLOAT, width, height);
+  ctx.particleFBO = createFramebuffer(ctx.particleColorTexture, ctx.particleDepthTexture);
+
+  ctx.offscreen_width = ctx.width;
+  ctx.offscreen_height = ctx.height;
+  ctx.offscreen_downsample = ctx.particle_downsample;
+}
+
 void initializeTrackball(Context &ctx)
 {
     double radius = double(std::min(ctx.width, ctx.height)) / 2.0;
@@ -247,6 +778,7 @@ void init(Context &ctx)
   ctx.simulate_tornado = false;
   ctx.simulate_fire = false;
   ctx.simulate_explosion = false;
+  ctx.simulate_swarm = false;
 
   ctx.last_explosion = glfwGetTime();
   ctx.explosion_delay = 2.0f;
@@ -254,185 +786,680 @@ void init(Context &ctx)
   ctx.wind_enabled = false;
   ctx.wind_vector = glm::vec3(0.02f, 0.0f, 0.0f);
 
+  ctx.fluid_enabled = false;
+  ctx.fluid_substep_rate = 120.0f;
+  ctx.fluid_max_substeps = 4;
+  ctx.fluid_time = 0.0;
+  ctx.fluid = FluidParams();
+  ctx.fluid_ms = 0.0f;
+
+  ctx.swarm = SwarmParams();
+  ctx.swarm_ms = 0.0f;
+
+  ctx.smoke_enabled = true;
+  ctx.smoke = SmokeParams();
+  smokeGridInit(ctx.smokeGrid, ctx.smoke.resolution, ctx.smoke.size);
+  ctx.smoke_drag = 4.0f;
+  ctx.smoke_last_burst = ctx.last_explosion;
+  ctx.smoke_ms = 0.0f;
+
+  ctx.cloth_enabled = false;
+  ctx.cloth_substep_rate = 120.0f;
+  ctx.cloth_max_substeps = 4;
+  ctx.cloth_time = 0.0;
+  ctx.cloth_last_time = glfwGetTime();
+  ctx.cloth_wind_scale = 250.0f;
+  ctx.cloth = ClothParams();
+  ctx.cloth_ms = 0.0f;
+
+  ctx.surface_enabled = false;
+  ctx.surface_hide_particles = true;
+  ctx.surface = SurfaceParams();
+  ctx.surface_light_position = glm::vec3(0.0f, 10.0f, 0.0f);
+  ctx.surface_light_color = glm::vec3(1.0f);
+  ctx.surface_ambient_color = glm::vec3(0.0f, 0.05f, 0.1f);
+  ctx.surface_diffuse_color = glm::vec3(0.1f, 0.35f, 0.6f);
+  ctx.surface_specular_color = glm::vec3(0.04f);
+  ctx.surface_specular_power = 100.0f;
+  ctx.surface_triangles = 0;
+  ctx.surface_ms = 0.0f;
+
+  ctx.sub_emitters_enabled = true;
+  ctx.event_queue_capacity = 4096;
+  particleEventsInit(ctx.events, threadPool.numThreads, ctx.event_queue_capacity);
+  ctx.ground_height = -4.0f;
+  ctx.ground_restitution = 0.3f;
+  ctx.events_dropped_total = 0;
+
+  ctx.emitter_shape = EMITTER_CUBE;
+  ctx.emitter_size = 1.0f;
+  ctx.emitter_cone_angle = 20.0f;
+  ctx.emitter_normal_speed = 1.0f;
+  ctx.emitter_mesh_index = 0;
+
+  ctx.emission_rate = 10000.0f;
+  ctx.emission_scale = 1.0f;
+  ctx.particle_budget = maxParticles;
+
+  ctx.adaptive_quality = true;
+  ctx.target_frame_ms = 16.6f;
+  ctx.frame_ms = 0.0f;
+  ctx.quality.numLevels = numQualityLevels;
+  ctx.quality.level = numQualityLevels - 1;
+  ctx.quality.lastChange = glfwGetTime();
+
+  ctx.frustum_culling = true;
+  ctx.stats = ParticleStats();
+
+  ctx.lod_enabled = true;
+  ctx.lod_band_distance[0] = 40.0f;
+  ctx.lod_band_distance[1] = 60.0f;
+  ctx.lod_band_distance[2] = 80.0f;
+  ctx.lod_band_keep[0] = 0.5f;
+  ctx.lod_band_keep[1] = 0.25f;
+  ctx.lod_band_keep[2] = 0.125f;
+  ctx.lod_pixel_threshold = 2.0f;
+  ctx.lod_compensation = LOD_ENLARGE;
+
   // Set FOV to 90-degrees
   ctx.fov = 3.14159/2;
 
   // Point camera towards the particle source
   ctx.camera_direction = glm::vec3(0.0f, 0.0f, 20.0f);
 
+  const char *particleDefines[] = {
+    "",                                            // FETCH_ATTRIBUTES
+    "#define VERTEX_PULLING\n#define PULL_INSTANCE_ID\n", // FETCH_INSTANCE_ID
+    "#define VERTEX_PULLING\n#define PULL_VERTEX_ID\n",   // FETCH_VERTEX_ID
+  };
   ctx.particleProgram = loadShaderProgram(shaderDir() + "particle.vert",
-      shaderDir() + "particle.frag");
+      shaderDir() + "particle.frag", particleDefines[ctx.particle_fetch]);
+  ctx.depthDownsampleProgram = loadShaderProgram(shaderDir() + "fullscreen.vert",
+      shaderDir() + "depth_downsample.frag");
+  ctx.upsampleProgram = loadShaderProgram(shaderDir() + "fullscreen.vert",
+      shaderDir() + "upsample.frag");
+  ctx.clothProgram = loadShaderProgram(shaderDir() + "cloth.vert",
+      shaderDir() + "cloth.frag");
+  ctx.surfaceProgram = loadShaderProgram(shaderDir() + "surface.vert",
+      shaderDir() + "surface.frag");
+
+  // Offscreen targets are created on first use
+  ctx.particle_downsample = 1;
+  ctx.offscreen_width = 0;
+  ctx.offscreen_height = 0;
+  ctx.offscreen_downsample = 0;
 
   lastTime = glfwGetTime();
 
-  ctx.texture = load2DTexture((resourceDir() + "whitelight.png").c_str());
+  createParticleAtlas(ctx);
+  ctx.lifetimeCurveTexture = createLifetimeCurveTexture();
 
-  for(int i=0; i<maxParticles; i++){
-    particlesContainer[i].life = -1.0f;
-    particlesContainer[i].cameradistance = -1.0f;
-  }
+  // Slots of 1/128 s give a horizon of 8 s, longer than any particle lives
+  timingWheelInit(particleExpiryWheel, 1024, 1.0 / 128.0, simulationTime);
 
   createParticleVAO(ctx);
+  createClothVAO(ctx);
+  createSurfaceVAO(ctx);
   initializeTrackball(ctx);
 }
 
+bool fluidActive(const Context &ctx)
+{
+  return ctx.fluid_enabled && ctx.current_simulation == FOUNTAIN;
+}
+
+// Move the fountain particles with the fluid solver in fixed substeps. If
+// the solver falls behind by more than fluid_max_substeps the remaining time
+// is dropped, so the water slows down instead of stalling the frame.
+void simulateFluid(Context &ctx, double delta)
+{
+  if(!fluidActive(ctx)) {
+    ctx.fluid_time = 0.0;
+    ctx.fluid_ms = 0.0f;
+    return;
+  }
+
+  double step = 1.0 / ctx.fluid_substep_rate;
+  ctx.fluid_time += delta;
+  int substeps = (int)(ctx.fluid_time / step);
+  ctx.fluid_time -= substeps * step;
+  if(substeps > ctx.fluid_max_substeps) {
+    substeps = ctx.fluid_max_substeps;
+    ctx.fluid_time = 0.0;
+  }
+
+  double startTime = glfwGetTime();
+
+  for(int i = 0; i < liveParticles; i++){
+    g_solver_positions[i] = particlesContainer[i].pos;
+    g_solver_velocities[i] = particlesContainer[i].speed;
+  }
+
+  // Same gravity as the ballistic fountain
+  ctx.fluid.gravity = glm::vec3(0.0f, ctx.gravity * 0.5f, 0.0f);
+  for(int i = 0; i < substeps; i++){
+    fluidStep(ctx.fluidSolver, ctx.fluid, g_solver_positions, g_solver_velocities,
+        liveParticles, (float)step, threadPool);
+  }
+
+  for(int i = 0; i < liveParticles; i++){
+    particlesContainer[i].pos = g_solver_positions[i];
+    particlesContainer[i].speed = g_solver_velocities[i];
+  }
+
+  ctx.fluid_ms = (glfwGetTime() - startTime) * 1000.0;
+}
+
+// Move the swarm agents by the flocking rules, one step per frame
+void simulateSwarm(Context &ctx, double delta)
+{
+  if(ctx.current_simulation != SWARM) {
+    ctx.swarm_ms = 0.0f;
+    return;
+  }
+
+  double startTime = glfwGetTime();
+
+  for(int i = 0; i < liveParticles; i++){
+    g_solver_positions[i] = particlesContainer[i].pos;
+    g_solver_velocities[i] = particlesContainer[i].speed;
+  }
+
+  // Long frames would let the agents overshoot each other
+  float step = (float) std::min(delta, 1.0 / 30.0);
+  swarmStep(ctx.swarmSolver, ctx.swarm, g_solver_positions, g_solver_velocities,
+      liveParticles, step, threadPool);
+
+  for(int i = 0; i < liveParticles; i++){
+    particlesContainer[i].pos = g_solver_positions[i];
+    particlesContainer[i].speed = g_solver_velocities[i];
+  }
+
+  ctx.swarm_ms = (glfwGetTime() - startTime) * 1000.0;
+}
+
+bool smokeActive(const Context &ctx)
+{
+  return ctx.smoke_enabled &&
+    (ctx.current_simulation == FIRE || ctx.current_simulation == EXPLOSION);
+}
+
+// Step the smoke grid around the emitter. Fire heats it continuously, each
+// explosion once with an outward push.
+void simulateSmoke(Context &ctx, double delta)
+{
+  if(!smokeActive(ctx)) {
+    ctx.smoke_ms = 0.0f;
+    return;
+  }
+
+  double startTime = glfwGetTime();
+
+  SmokeGrid &grid = ctx.smokeGrid;
+  if(grid.n != ctx.smoke.resolution) {
+    smokeGridInit(grid, ctx.smoke.resolution, ctx.smoke.size);
+  }
+
+  // Particles spawn in a unit cube at spawn_position. The grid is centered
+  // on it horizontally and extends mostly upwards.
+  glm::vec3 source = ctx.spawn_position + glm::vec3(0.5f);
+  grid.origin = source - glm::vec3(0.5f, 0.25f, 0.5f) * ctx.smoke.size;
+
+  if(ctx.current_simulation == FIRE) {
+    smokeGridAddSource(grid, source, 1.0f, 1.0f, 0.0f);
+  }
+  else if(ctx.last_explosion != ctx.smoke_last_burst) {
+    smokeGridAddSource(grid, source, 2.0f, 1.0f, 6.0f);
+    ctx.smoke_last_burst = ctx.last_explosion;
+  }
+
+  // Long frames would let the advection overshoot
+  smokeGridStep(grid, ctx.smoke, (float) std::min(delta, 1.0 / 30.0), threadPool);
+
+  ctx.smoke_ms = (glfwGetTime() - startTime) * 1000.0;
+}
+
+// Step the flags in fixed substeps like the fluid, and rebuild their normals
+// with computeNormals(). The flags always feel a light breeze, which the
+// wind setting adds to with a slow gust.
+void simulateCloth(Context &ctx, double delta)
+{
+  double step = 1.0 / ctx.cloth_substep_rate;
+  ctx.cloth_time += delta;
+  int substeps = (int)(ctx.cloth_time / step);
+  ctx.cloth_time -= substeps * step;
+  if(substeps > ctx.cloth_max_substeps) {
+    substeps = ctx.cloth_max_substeps;
+    ctx.cloth_time = 0.0;
+  }
+
+  double startTime = glfwGetTime();
+
+  glm::vec3 wind(0.5f, 0.0f, 0.2f);
+  if(ctx.wind_enabled) {
+    float gust = 1.0f + 0.3f * (float) std::sin(startTime * 1.7) * (float) std::sin(startTime * 0.43);
+    wind += ctx.wind_vector * ctx.cloth_wind_scale * gust;
+  }
+
+  Cloth &cloth = ctx.clothSolver;
+  for(int i = 0; i < substeps; i++){
+    clothStep(cloth, ctx.cloth, ctx.clothPoints, wind, (float)step, threadPool);
+  }
+
+  for(size_t i = 0; i < ctx.clothPoints.size(); i++){
+    cloth.positions[i] = ctx.clothPoints[i].pos;
+  }
+  // computeNormals() only adds to the normals it is given
+  cloth.normals.clear();
+  computeNormals(cloth.positions, cloth.indices, &cloth.normals);
+
+  ctx.cloth_ms = (glfwGetTime() - startTime) * 1000.0;
+}
+
+// Switch the simulation settings when a different preset has been chosen
+void updateCurrentSimulation(Context &ctx)
+{
+  if(ctx.simulate_tornado) {
+    if(ctx.current_simulation != TORNADO) {
+      ctx.spawn_direction = glm::vec3(0.0f, 0.0f, 0.0f);
+      ctx.gravity = 140.0f;
+      ctx.spread = 1.6f;
+
+      ctx.current_simulation = TORNADO;
+    }
+  }
+  else if(ctx.simulate_fire) {
+    if(ctx.current_simulation != FIRE) {
+      ctx.spawn_direction = glm::vec3(0.0f, 0.5f, 0.0f);
+      ctx.gravity = 1.5f;
+      ctx.spread = 1.6f;
+
+      ctx.current_simulation = FIRE;
+    }
+  }
+  else if(ctx.simulate_fountain) {
+    if(ctx.current_simulation != FOUNTAIN) {
+      ctx.gravity = -9.81f;
+      ctx.spawn_direction = glm::vec3(0.0f, 10.0f, 0.0f);
+      ctx.spread = 1.5f;
+
+      ctx.current_simulation = FOUNTAIN;
+    }
+  }
+  else if(ctx.simulate_explosion) {
+    if(ctx.current_simulation != EXPLOSION) {
+      ctx.spread = 30.0f;
+      ctx.gravity = 0.0f;
+
+      ctx.current_simulation = EXPLOSION;
+    }
+  }
+  else if(ctx.simulate_swarm) {
+    if(ctx.current_simulation != SWARM) {
+      ctx.spawn_direction = glm::vec3(0.0f, 0.0f, 0.0f);
+      ctx.spread = 5.0f;
+      ctx.gravity = 0.0f;
+
+      ctx.current_simulation = SWARM;
+    }
+  }
+  else {
+    if(ctx.current_simulation != DEFAULT) {
+      ctx.gravity = -9.81f;
+      ctx.spawn_direction = glm::vec3(0.0f, 10.0f, 0.0f);
+      ctx.spread = 1.5f;
+      ctx.spawn_position = glm::vec3(0.0f, 0.0f, 0.0f);
+
+      ctx.current_simulation = DEFAULT;
+    }
+  }
+}
+
+// The sub-emitter of the current simulation that a particle of the given
+// material triggers on an event, or nullptr
+const SubEmitter *findSubEmitter(const Context &ctx, int material, ParticleEventType trigger)
+{
+  if(!ctx.sub_emitters_enabled) {
+    return nullptr;
+  }
+  for(int i = 0; i < numSubEmitters; i++){
+    const SubEmitter &rule = subEmitters[i];
+    if(rule.simulation == ctx.current_simulation && rule.parent == material && rule.trigger == trigger) {
+      return &rule;
+    }
+  }
+  return nullptr;
+}
+
+void raiseParticleEvent(Context &ctx, const Particle &p, ParticleEventType type, int threadIndex)
+{
+  ParticleEvent event;
+  event.position = p.pos;
+  event.velocity = p.speed;
+  event.size = p.size;
+  event.type = type;
+  event.material = p.material;
+  particleEventPush(ctx.events, threadIndex, event);
+}
+
+// Turn the queued events into particles of their sub-emitters, as far as
+// the particle budget allows. Children are simulated from the next frame on.
+void spawnSubEmitterParticles(Context &ctx)
+{
+  int events = 0, children = 0, childrenDropped = 0;
+  int eventsDropped = particleEventsDrain(ctx.events, [&](const ParticleEvent &event) {
+    events++;
+    const SubEmitter *rule = findSubEmitter(ctx, event.material, (ParticleEventType) event.type);
+    if(!rule) {
+      return;
+    }
+
+    for(int k = 0; k < rule->count; k++){
+      int particleIndex = liveParticles < ctx.particle_budget ? spawnParticle(rule->life) : -1;
+      if(particleIndex < 0) {
+        childrenDropped += rule->count - k;
+        return;
+      }
+
+      glm::vec3 randomdir = glm::vec3(
+          (rand()%2000 - 1000.0f)/1000.0f,
+          (rand()%2000 - 1000.0f)/1000.0f,
+          (rand()%2000 - 1000.0f)/1000.0f
+          );
+
+      Particle &child = particlesContainer[particleIndex];
+      child.seed = nextParticleSeed++;
+      child.generation = 1;
+      child.pos = event.position;
+      child.speed = event.velocity * rule->inherit + randomdir * rule->speed + glm::vec3(0.0f, rule->lift, 0.0f);
+      child.a = (rand() % 256) / 3;
+      child.material = rule->material;
+      child.size = event.size * 0.7f;
+      children++;
+    }
+  });
+
+  ctx.stats.events = events + eventsDropped;
+  ctx.stats.events_dropped = eventsDropped;
+  ctx.stats.children = children;
+  ctx.stats.children_dropped = childrenDropped;
+  ctx.events_dropped_total += eventsDropped;
+
+  // The queues are empty now, so they can be resized
+  if(ctx.event_queue_capacity != (int) ctx.events.capacity) {
+    particleEventsInit(ctx.events, threadPool.numThreads, ctx.event_queue_capacity);
+  }
+}
+
+// Number of particles each task of the simulation loop handles
+const int particleGrainSize = 1024;
+
 int simulateParticles(Context &ctx, double delta, glm::vec3 cameraPosition)
 {
   static int horizontal_ticker = 0;
+  const int tornadoRadius = 50;
 
-  horizontal_ticker += 1;
-  horizontal_ticker = horizontal_ticker % 360;
+  updateCurrentSimulation(ctx);
 
-  int particlesCount = 0;
+  // Fluid and swarm particles have already been moved by their solvers
+  bool moved = fluidActive(ctx) || ctx.current_simulation == SWARM;
 
-  for(int i = 0; i < maxParticles; i++){
+  // Fire and explosion particles inside the smoke grid follow its flow
+  bool smoke = smokeActive(ctx);
+  float smokeDrag = std::min(ctx.smoke_drag * (float) delta, 1.0f);
 
-    Particle& p = particlesContainer[i];
+  // Sub-emitters triggered by each material
+  const SubEmitter *ageRules[numMaterials];
+  const SubEmitter *collisionRules[numMaterials];
+  for(int m = 0; m < numMaterials; m++){
+    ageRules[m] = findSubEmitter(ctx, m, EVENT_AGE);
+    collisionRules[m] = moved ? nullptr : findSubEmitter(ctx, m, EVENT_COLLISION);
+  }
+
+  horizontal_ticker += 1;
+  horizontal_ticker = horizontal_ticker % 360;
 
-    if(p.life > 0.0f){
+  // Live particles are kept at the front of the container and dead ones are
+  // removed by expireParticles(), so there is no need to test their life.
+  // Each particle only writes itself and its own staging slot, and events go
+  // to the queue of the thread, so the loop runs in parallel.
+  int particlesCount = liveParticles;
+  parallelFor(threadPool, particlesCount, particleGrainSize, [&](int begin, int end, int threadIndex) {
+    for(int i = begin; i < end; i++){
+
+      Particle& p = particlesContainer[i];
 
       // Decrease life
+      float previousAge = 1.0f - p.life / p.lifetime;
       p.life -= delta;
-      if (p.life > 0.0f){
+      float age = std::min(std::max(1.0f - p.life / p.lifetime, 0.0f), 1.0f);
 
-        if(ctx.simulate_tornado) {
-          static int radius = 50;
-          if(ctx.current_simulation != TORNADO) {
-            ctx.spawn_direction = glm::vec3(0.0f, 0.0f, 0.0f);
-            ctx.gravity = 140.0f;
-            ctx.spread = 1.6f;
+      bool inSmoke = smoke && smokeGridContains(ctx.smokeGrid, p.pos);
 
-            ctx.current_simulation = TORNADO;
-          }
-          p.speed = glm::vec3(radius * cos(degreeToRadians(horizontal_ticker)), ctx.gravity, radius * sin(degreeToRadians(horizontal_ticker))) * (float) delta;
+      switch(ctx.current_simulation) {
+      case TORNADO:
+        p.speed = glm::vec3(tornadoRadius * cos(degreeToRadians(horizontal_ticker)), ctx.gravity, tornadoRadius * sin(degreeToRadians(horizontal_ticker))) * (float) delta;
+        break;
+      case FIRE:
+        if(inSmoke) {
+          p.speed += (smokeGridSample(ctx.smokeGrid, ctx.smokeGrid.velocity, p.pos) - p.speed) * smokeDrag;
+        }
+        else {
+          p.speed += glm::vec3(0.0f, ctx.gravity, 0.0f) * (float) delta;
+        }
+        break;
+      case FOUNTAIN:
+        if(!moved) {
+          p.speed += glm::vec3(0.0f, ctx.gravity, 0.0f) * (float) delta * 0.5f;
         }
-        else if(ctx.simulate_fire) {
-          if(ctx.current_simulation != FIRE) {
-            ctx.spawn_direction = glm::vec3(0.0f, 0.5f, 0.0f);
-            ctx.gravity = 1.5f;
-            ctx.spread = 1.6f;
+        break;
+      case EXPLOSION:
+        if(inSmoke) {
+          p.speed += (smokeGridSample(ctx.smokeGrid, ctx.smokeGrid.velocity, p.pos) - p.speed) * smokeDrag;
+        }
+        else {
+          p.speed += glm::vec3(0.0f, ctx.gravity, 0.0f) * (float) delta * 0.5f;
+        }
+        break;
+      case SWARM:
+        break;
+      default:
+        p.speed += glm::vec3(0.0f, ctx.gravity, 0.0f) * (float) delta * 0.5f;
+        break;
+      }
 
-            ctx.current_simulation = FIRE;
-          }
+      if(ctx.wind_enabled) {
+        p.speed += ctx.wind_vector;
+      }
 
-          p.speed += glm::vec3(0.0f, ctx.gravity, 0.0f) * (float) delta;
+      if(!moved) {
+        p.pos += p.speed * (float)delta;
+      }
 
-          if(p.life < 1.0f) {
-            colorParticleGray(p);
-          }
-          else if(p.life < 1.5f) {
-            colorParticleYellow(p);
-          }
-          else if(p.life < 2.0f) {
-            colorParticleRed(p);
-          }
+      // -- Sub-emitter events
+      if(p.generation == 0) {
+        const SubEmitter *ageRule = ageRules[p.material];
+        if(ageRule && previousAge < ageRule->threshold && age >= ageRule->threshold) {
+          raiseParticleEvent(ctx, p, EVENT_AGE, threadIndex);
         }
-        else if(ctx.simulate_fountain) {
-          if(ctx.current_simulation != FOUNTAIN) {
-            ctx.gravity = -9.81f;
-            ctx.spawn_direction = glm::vec3(0.0f, 10.0f, 0.0f);
-            ctx.spread = 1.5f;
 
-            ctx.current_simulation = FOUNTAIN;
+        // Only particles with a collision sub-emitter collide, and only
+        // hits faster than 1 unit per second raise an event, so a particle
+        // coming to rest on the ground does not keep raising them
+        if(collisionRules[p.material] && p.pos.y < ctx.ground_height && p.speed.y < 0.0f) {
+          if(p.speed.y < -1.0f) {
+            raiseParticleEvent(ctx, p, EVENT_COLLISION, threadIndex);
           }
-
-          colorParticleBlue(p);
-          p.speed += glm::vec3(0.0f, ctx.gravity, 0.0f) * (float) delta * 0.5f;
+          p.pos.y = ctx.ground_height;
+          p.speed.y *= -ctx.ground_restitution;
         }
-        else if(ctx.simulate_explosion) {
-          if(ctx.current_simulation != EXPLOSION) {
-            ctx.spread = 30.0f;
-            ctx.gravity = 0.0f;
+      }
 
-            ctx.current_simulation = EXPLOSION;
-          }
+      p.cameradistance = glm::length2( p.pos - cameraPosition );
+      g_particule_distance_data[i] = p.cameradistance;
+      g_particule_seed_data[i] = p.seed;
 
-          // Color particles similar to fire simulation
-          if(p.life < 4.0f) {
-            colorParticleGray(p);
-          }
-          else if(p.life < 4.5f) {
-            colorParticleYellow(p);
-          }
-          else if(p.life < 5.0f) {
-            colorParticleRed(p);
-          }
+      // Fill the GPU buffer
+      g_particule_position_size_data[4*i+0] = p.pos.x;
+      g_particule_position_size_data[4*i+1] = p.pos.y;
+      g_particule_position_size_data[4*i+2] = p.pos.z;
 
-          p.speed += glm::vec3(0.0f, ctx.gravity, 0.0f) * (float) delta * 0.5f;
-        }
-        else {
-          if(ctx.current_simulation != DEFAULT) {
-            ctx.gravity = -9.81f;
-            ctx.spawn_direction = glm::vec3(0.0f, 10.0f, 0.0f);
-            ctx.spread = 1.5f;
-            ctx.spawn_position = glm::vec3(0.0f, 0.0f, 0.0f);
+      g_particule_position_size_data[4*i+3] = p.size;
 
-            ctx.current_simulation = DEFAULT;
-          }
+      // Color and size over the lifetime are looked up in the vertex shader
+      g_particule_lifetime_data[4*i+0] = (GLubyte)(age * 255.0f);
+      g_particule_lifetime_data[4*i+1] = p.a;
+      g_particule_lifetime_data[4*i+2] = p.material;
+      float temperature = inSmoke ? smokeGridSample(ctx.smokeGrid, ctx.smokeGrid.temperature, p.pos) : 0.0f;
+      g_particule_lifetime_data[4*i+3] = (GLubyte)(std::min(std::max(temperature, 0.0f), 1.0f) * 255.0f);
+    }
+  });
 
-          colorParticleGray(p);
-          p.speed += glm::vec3(0.0f, ctx.gravity, 0.0f) * (float) delta * 0.5f;
-        }
+  spawnSubEmitterParticles(ctx);
 
-        if(ctx.wind_enabled) {
-          //if(rand() % 1) {
-          //  p.speed += glm::vec3(cos(glfwGetTime()) * 0.01f, 0.0f, cos(glfwGetTime()) * 0.01f);
-          //}
-          //else {
-          //  p.speed += glm::vec3(sin(glfwGetTime()) * 0.01f, 0.0f, sin(glfwGetTime()) * 0.01f);
-          //}
-          p.speed += ctx.wind_vector;
-        }
+  return particlesCount;
+}
 
-        p.pos += p.speed * (float)delta;
-        p.cameradistance = glm::length2( p.pos - cameraPosition );
+// Test the bounding sphere of each live particle against the view frustum
+// and collect the visible ones in g_visible_particles. Returns the number of
+// visible particles.
+int cullParticles(Context &ctx, const glm::mat4 &viewProjection, int particlesCount)
+{
+  int visibleCount;
+
+  if(ctx.frustum_culling) {
+    Frustum frustum = frustumFromMatrix(viewProjection);
+    // The size curve may enlarge the particles in the vertex shader
+    const LifetimeCurve &curve = lifetimeCurves[ctx.current_simulation];
+    float radiusScale = billboardRadiusScale * gradientMaxSize(curve.keys, curve.numKeys);
+
+    visibleCount = frustumCullSpheres(frustum, g_particule_position_size_data, radiusScale,
+        particlesCount, g_visible_particles);
+  }
+  else {
+    for(int i = 0; i < particlesCount; i++){
+      g_visible_particles[i] = i;
+    }
+    visibleCount = particlesCount;
+  }
 
-        // Fill the GPU buffer
-        g_particule_position_size_data[4*particlesCount+0] = p.pos.x;
-        g_particule_position_size_data[4*particlesCount+1] = p.pos.y;
-        g_particule_position_size_data[4*particlesCount+2] = p.pos.z;
+  ctx.stats.live = particlesCount;
+  ctx.stats.visible = visibleCount;
+  ctx.stats.culled = particlesCount - visibleCount;
 
-        g_particule_position_size_data[4*particlesCount+3] = p.size;
+  return visibleCount;
+}
 
-        g_particule_color_data[4*particlesCount+0] = p.r;
-        g_particule_color_data[4*particlesCount+1] = p.g;
-        g_particule_color_data[4*particlesCount+2] = p.b;
-        g_particule_color_data[4*particlesCount+3] = p.a;
+// Stochastically drop visible particles that are far away or cover only a
+// few pixels, using the stable per-particle hash so that the same particles
+// survive from frame to frame. Survivors are enlarged or brightened to keep
+// the perceived density. Compacts g_visible_particles in place and returns
+// the number of particles left.
+int lodParticles(Context &ctx, int visibleCount)
+{
+  if(!ctx.lod_enabled) {
+    ctx.stats.decimated = 0;
+    ctx.stats.drawn = visibleCount;
+    return visibleCount;
+  }
 
-      }else{
-        // Particles that just died will be put at the end of the buffer in sortParticles();
-        p.cameradistance = -1.0f;
+  // Height in pixels of a particle of size 1 at distance 1
+  float pixelScale = ctx.height / (2.0f * tan(ctx.fov / 2.0f));
+
+  int keptCount = 0;
+  for(int i = 0; i < visibleCount; i++){
+    std::uint32_t j = g_visible_particles[i];
+    float distance = std::max(std::sqrt(g_particule_distance_data[j]), 0.001f);
+    GLfloat &size = g_particule_position_size_data[4*j+3];
+
+    // Fraction of the particles kept at this distance
+    float keep = 1.0f;
+    for(int band = 0; band < numLodBands; band++){
+      if(distance > ctx.lod_band_distance[band]) {
+        keep = ctx.lod_band_keep[band];
       }
+    }
 
-      particlesCount++;
+    // Keep (pixels / threshold)^2 of the small particles, so that enlarging
+    // the survivors to the threshold covers the same screen area
+    float pixels = size * pixelScale / distance;
+    if(pixels < ctx.lod_pixel_threshold) {
+      float ratio = pixels / ctx.lod_pixel_threshold;
+      keep *= ratio * ratio;
     }
+
+    if(keep < 1.0f) {
+      if(particleHash(g_particule_seed_data[j]) >= keep) {
+        continue;
+      }
+
+      if(ctx.lod_compensation == LOD_ENLARGE) {
+        size /= std::sqrt(keep);
+      }
+      else {
+        GLubyte &alpha = g_particule_lifetime_data[4*j+1];
+        alpha = (GLubyte) std::min(255.0f, alpha / keep);
+      }
+    }
+
+    g_visible_particles[keptCount++] = j;
   }
 
-  return particlesCount;
+  ctx.stats.decimated = visibleCount - keptCount;
+  ctx.stats.drawn = keptCount;
+
+  return keptCount;
+}
+
+// Seconds a new particle of the current simulation lives
+float particleLifetime(const Context &ctx)
+{
+  if(ctx.simulate_fire) {
+    return 2.0f;
+  }
+  // Agents need time to gather into flocks
+  if(ctx.current_simulation == SWARM) {
+    return 20.0f;
+  }
+  return 5.0f;
 }
 
 void spawnNewParticles(Context &ctx, double delta)
 {
-  int newparticles = (int)(delta*10000.0);
-  if (newparticles > (int)(0.016f*10000.0))
-    newparticles = (int)(0.016f*10000.0);
+  float rate = ctx.emission_rate * ctx.emission_scale;
+  int newparticles = (int)(delta*rate);
+  if (newparticles > (int)(0.016f*rate))
+    newparticles = (int)(0.016f*rate);
+
+  // Stay within the particle budget
+  if (newparticles > ctx.particle_budget - liveParticles)
+    newparticles = std::max(ctx.particle_budget - liveParticles, 0);
+
+  // A mesh that is missing or fails to load falls back to the cube
+  EmitterShape shape = ctx.emitter_shape;
+  const MeshEmitter *mesh = nullptr;
+  if(shape == EMITTER_MESH) {
+    int index = ctx.emitter_mesh_index;
+    if(index >= 0 && index < (int) ctx.emitter_mesh_files.size()) {
+      mesh = meshEmitterGet(ctx.meshEmitters, ctx.emitter_mesh_files[index]);
+    }
+    if(!mesh) {
+      shape = EMITTER_CUBE;
+    }
+  }
 
   if(ctx.current_simulation != EXPLOSION || (glfwGetTime() - ctx.last_explosion) > ctx.explosion_delay) {
     for(int i=0; i<newparticles; i++){
 
-      int particleIndex = findUnusedParticle();
-
-      if(ctx.simulate_fire) {
-        particlesContainer[particleIndex].life = 2.0f;
-      }
-      else {
-        particlesContainer[particleIndex].life = 5.0f;
+      int particleIndex = spawnParticle(particleLifetime(ctx));
+      if(particleIndex < 0) {
+        break;
       }
 
-      particlesContainer[particleIndex].pos = ctx.spawn_position;
+      particlesContainer[particleIndex].seed = nextParticleSeed++;
+      particlesContainer[particleIndex].generation = 0;
 
-      // Add some random offset to each position
-      particlesContainer[particleIndex].pos += glm::vec3((rand()/(double)(RAND_MAX + 1)), (rand()/(double)(RAND_MAX + 1)), (rand()/(double)(RAND_MAX + 1)));;
+      particlesContainer[particleIndex].pos = ctx.spawn_position;
 
       glm::vec3 randomdir = glm::vec3(
           (rand()%2000 - 1000.0f)/1000.0f,
@@ -440,12 +1467,41 @@ void spawnNewParticles(Context &ctx, double delta)
           (rand()%2000 - 1000.0f)/1000.0f
           );
 
-      particlesContainer[particleIndex].speed = ctx.spawn_direction + randomdir * ctx.spread;
+      if(shape == EMITTER_CUBE) {
+        // Add some random offset to each position
+        particlesContainer[particleIndex].pos += glm::vec3((rand()/(double)(RAND_MAX + 1)), (rand()/(double)(RAND_MAX + 1)), (rand()/(double)(RAND_MAX + 1)));;
 
-      colorParticleGray(particlesContainer[particleIndex]);
+        particlesContainer[particleIndex].speed = ctx.spawn_direction + randomdir * ctx.spread;
+      }
+      else {
+        float u[4];
+        for(int k = 0; k < 4; k++){
+          u[k] = rand() / (RAND_MAX + 1.0f);
+        }
+        EmitterSample sample = mesh ? meshEmitterSample(*mesh, ctx.emitter_size, u)
+          : emitterSample(shape, ctx.emitter_size, ctx.spawn_direction, ctx.emitter_cone_angle * 3.14159265f / 180.0f, u);
+        particlesContainer[particleIndex].pos += sample.position;
+
+        if(shape == EMITTER_CONE) {
+          particlesContainer[particleIndex].speed = sample.direction * glm::length(ctx.spawn_direction) + randomdir * ctx.spread;
+        }
+        else {
+          particlesContainer[particleIndex].speed = ctx.spawn_direction + randomdir * ctx.spread + sample.direction * ctx.emitter_normal_speed;
+        }
+      }
 
       particlesContainer[particleIndex].a = (rand() % 256) / 3;
 
+      if(ctx.simulate_fire) {
+        particlesContainer[particleIndex].material = MATERIAL_FLAME;
+      }
+      else if(ctx.simulate_explosion) {
+        particlesContainer[particleIndex].material = (rand() % 2) ? MATERIAL_FLAME : MATERIAL_SMOKE;
+      }
+      else {
+        particlesContainer[particleIndex].material = MATERIAL_LIGHT;
+      }
+
       particlesContainer[particleIndex].size = (rand()%1000)/2000.0f + 0.1f;
     }
 
@@ -455,9 +1511,104 @@ void spawnNewParticles(Context &ctx, double delta)
   }
 }
 
+glm::mat4 cameraView(const Context &ctx)
+{
+  return glm::lookAt(ctx.camera_direction, glm::vec3(0.0, 0.0, 0.0), glm::vec3(0.0, 1.0, 0.0));
+}
+
+glm::mat4 cameraProjection(const Context &ctx)
+{
+  return glm::perspective(ctx.fov, ctx.aspect, nearPlane, farPlane);
+}
+
+void drawCloth(Context &ctx)
+{
+  double currentTime = glfwGetTime();
+  double delta = currentTime - ctx.cloth_last_time;
+  ctx.cloth_last_time = currentTime;
+
+  if(!ctx.cloth_enabled) {
+    ctx.cloth_time = 0.0;
+    ctx.cloth_ms = 0.0f;
+    return;
+  }
+
+  simulateCloth(ctx, delta);
+
+  Cloth &cloth = ctx.clothSolver;
+  glBindBuffer(GL_ARRAY_BUFFER, ctx.cloth_position_buffer);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, cloth.positions.size() * sizeof(glm::vec3), &cloth.positions[0]);
+  glBindBuffer(GL_ARRAY_BUFFER, ctx.cloth_normal_buffer);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, cloth.normals.size() * sizeof(glm::vec3), &cloth.normals[0]);
+
+  glm::mat4 view = cameraView(ctx);
+  glm::mat4 viewProjection = cameraProjection(ctx) * view;
+  glm::vec3 cameraPosition(glm::inverse(view)[3]);
+
+  glUseProgram(ctx.clothProgram);
+  glUniformMatrix4fv(glGetUniformLocation(ctx.clothProgram, "u_VP"), 1, GL_FALSE, &viewProjection[0][0]);
+  glUniform3fv(glGetUniformLocation(ctx.clothProgram, "u_camera_position"), 1, &cameraPosition[0]);
+  glUniform3f(glGetUniformLocation(ctx.clothProgram, "u_light_direction"), 0.3f, 1.0f, 0.6f);
+
+  glBindVertexArray(ctx.clothVAO);
+  glDrawElements(GL_TRIANGLES, cloth.indices.size(), GL_UNSIGNED_INT, 0);
+
+  glBindVertexArray(ctx.defaultVAO);
+  glUseProgram(0);
+}
+
+// Extract the surface of the live particles and draw it into the scene
+void drawSurface(Context &ctx)
+{
+  if(!ctx.surface_enabled) {
+    ctx.surface_triangles = 0;
+    ctx.surface_ms = 0.0f;
+    return;
+  }
+
+  double startTime = glfwGetTime();
+
+  for(int i = 0; i < liveParticles; i++){
+    g_solver_positions[i] = particlesContainer[i].pos;
+  }
+  SurfaceExtractor &extractor = ctx.surfaceExtractor;
+  surfaceExtract(extractor, ctx.surface, g_solver_positions, liveParticles, threadPool);
+  ctx.surface_triangles = extractor.vertices.size() / 3;
+
+  ctx.surface_ms = (glfwGetTime() - startTime) * 1000.0;
+
+  if(extractor.vertices.empty()) {
+    return;
+  }
+
+  // Orphan the buffer so the driver does not wait for last frame's draw
+  glBindBuffer(GL_ARRAY_BUFFER, ctx.surface_vertex_buffer);
+  glBufferData(GL_ARRAY_BUFFER, extractor.vertices.size() * sizeof(SurfaceVertex), NULL, GL_STREAM_DRAW);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, extractor.vertices.size() * sizeof(SurfaceVertex), &extractor.vertices[0]);
+
+  glm::mat4 mv = cameraView(ctx);
+  glm::mat4 mvp = cameraProjection(ctx) * mv;
+
+  glUseProgram(ctx.surfaceProgram);
+  glUniformMatrix4fv(glGetUniformLocation(ctx.surfaceProgram, "u_mvp"), 1, GL_FALSE, &mvp[0][0]);
+  glUniformMatrix4fv(glGetUniformLocation(ctx.surfaceProgram, "u_mv"), 1, GL_FALSE, &mv[0][0]);
+  glUniform3fv(glGetUniformLocation(ctx.surfaceProgram, "u_light_position"), 1, &ctx.surface_light_position[0]);
+  glUniform3fv(glGetUniformLocation(ctx.surfaceProgram, "u_light_color"),    1, &ctx.surface_light_color[0]);
+  glUniform3fv(glGetUniformLocation(ctx.surfaceProgram, "u_ambient_color"),  1, &ctx.surface_ambient_color[0]);
+  glUniform3fv(glGetUniformLocation(ctx.surfaceProgram, "u_diffuse_color"),  1, &ctx.surface_diffuse_color[0]);
+  glUniform3fv(glGetUniformLocation(ctx.surfaceProgram, "u_specular_color"), 1, &ctx.surface_specular_color[0]);
+  glUniform1f(glGetUniformLocation(ctx.surfaceProgram, "u_specular_power"),      ctx.surface_specular_power);
+
+  glBindVertexArray(ctx.surfaceVAO);
+  glDrawArrays(GL_TRIANGLES, 0, extractor.vertices.size());
+
+  glBindVertexArray(ctx.defaultVAO);
+  glUseProgram(0);
+}
+
 void drawParticles(Context &ctx)
 {
-  glBindVertexArray(ctx.particleVAO);
+  glBindVertexArray(ctx.particle_fetch == FETCH_ATTRIBUTES ? ctx.particleVAO : ctx.particlePullVAO);
   glUseProgram(ctx.particleProgram);
 
   double currentTime = glfwGetTime();
@@ -465,36 +1616,59 @@ void drawParticles(Context &ctx)
   lastTime = currentTime;
 
   // -- Construct matrices
-  glm::mat4 view = glm::lookAt(ctx.camera_direction, glm::vec3(0.0, 0.0, 0.0), glm::vec3(0.0, 1.0, 0.0));
-  glm::mat4 projection = glm::perspective(ctx.fov, ctx.aspect, 0.1f, 100.0f);
-  glm::mat4 viewProjection = projection * view;
+  glm::mat4 view = cameraView(ctx);
+  glm::mat4 viewProjection = cameraProjection(ctx) * view;
 
   glm::vec3 cameraPosition(glm::inverse(view)[3]);
 
+  // -- Remove particles that have died
+  simulationTime += delta;
+  ctx.stats.expired = expireParticles([&](const Particle &p) {
+    if(p.generation == 0 && findSubEmitter(ctx, p.material, EVENT_DEATH)) {
+      raiseParticleEvent(ctx, p, EVENT_DEATH, 0);
+    }
+  });
+
   // -- Create some new particles
   spawnNewParticles(ctx, delta);
 
   // -- Simulate all particles
+  simulateFluid(ctx, delta);
+  simulateSwarm(ctx, delta);
+  simulateSmoke(ctx, delta);
   int particlesCount = simulateParticles(ctx, delta, cameraPosition);
 
+  // -- Remove particles outside the view frustum
+  int visibleCount = cullParticles(ctx, viewProjection, particlesCount);
+
+  // -- Thin out distant and sub-pixel particles
+  visibleCount = lodParticles(ctx, visibleCount);
+
+  // The particles are still simulated when the surface stands in for them
+  if(ctx.surface_enabled && ctx.surface_hide_particles) {
+    visibleCount = 0;
+    ctx.stats.drawn = 0;
+  }
+
+  // -- Blending
+  // Sort visible particles to ensure correct blending
+  sortVisibleParticles(visibleCount);
+
   // -- Update buffers with latest data from simulation
   // Position
   glBindBuffer(GL_ARRAY_BUFFER, ctx.particles_position_buffer);
   glBufferData(GL_ARRAY_BUFFER, maxParticles * 4 * sizeof(GLfloat), NULL, GL_DYNAMIC_DRAW);
-  glBufferSubData(GL_ARRAY_BUFFER, 0, particlesCount * sizeof(GLfloat) * 4, g_particule_position_size_data);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, visibleCount * sizeof(GLfloat) * 4, g_visible_position_size_data);
 
-  // Color
-  glBindBuffer(GL_ARRAY_BUFFER, ctx.particles_color_buffer);
+  // Age and opacity
+  glBindBuffer(GL_ARRAY_BUFFER, ctx.particles_lifetime_buffer);
   glBufferData(GL_ARRAY_BUFFER, maxParticles * 4 * sizeof(GLubyte), NULL, GL_DYNAMIC_DRAW);
-  glBufferSubData(GL_ARRAY_BUFFER, 0, particlesCount * sizeof(GLubyte) * 4, g_particule_color_data);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, visibleCount * sizeof(GLubyte) * 4, g_visible_lifetime_data);
 
-  // -- Blending
-  // Sort particles to ensure correct blending
-  sortParticles();
-
-  // Set blending options
+  // Set blending options. Alpha is accumulated separately so that an
+  // offscreen target ends up with premultiplied color and coverage.
   glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
 
   // -- Pass uniforms
   // For vertex shader
@@ -509,24 +1683,175 @@ void drawParticles(Context &ctx)
   // Tell fragment shader to use texture unit 0
   glUniform1i(glGetUniformLocation(ctx.particleProgram, "u_input_texture"), 0);
 
-  // -- Rendering time
-  glVertexAttribDivisor(0, 0); // particles vertices : always reuse the same 4 vertices -> 0
-  glVertexAttribDivisor(1, 1); // positions : one per quad (its center) -> 1
-  glVertexAttribDivisor(2, 1); // color : one per quad -> 1
+  // Atlas regions of the materials, so all of them are drawn in one call
+  GLfloat materialRegions[numMaterials * 4];
+  GLfloat materialFrames[numMaterials * 3];
+  for(int i = 0; i < numMaterials; i++){
+    const AtlasRegion &region = ctx.materials[i];
+    materialRegions[4*i+0] = region.u;
+    materialRegions[4*i+1] = region.v;
+    materialRegions[4*i+2] = region.width;
+    materialRegions[4*i+3] = region.height;
+    materialFrames[3*i+0] = region.columns;
+    materialFrames[3*i+1] = region.rows;
+    materialFrames[3*i+2] = region.numFrames;
+  }
+  glUniform4fv(glGetUniformLocation(ctx.particleProgram, "u_material_regions"), numMaterials, materialRegions);
+  glUniform3fv(glGetUniformLocation(ctx.particleProgram, "u_material_frames"), numMaterials, materialFrames);
+
+  // Lifetime curves of the current simulation in Texture Unit 1
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, ctx.lifetimeCurveTexture);
+  glUniform1i(glGetUniformLocation(ctx.particleProgram, "u_lifetime_curves"), 1);
+  glUniform1i(glGetUniformLocation(ctx.particleProgram, "u_simulation"), ctx.current_simulation);
+  glActiveTexture(GL_TEXTURE0);
 
-  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, particlesCount);
+  // -- Rendering time
+  if(ctx.particle_fetch == FETCH_ATTRIBUTES) {
+    // The attribute divisors are part of the VAO, see createParticleVAO()
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, visibleCount);
+  }
+  else {
+    // Particle data in Texture Units 2 and 3
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_BUFFER, ctx.particles_position_texture);
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_BUFFER, ctx.particles_lifetime_texture);
+    glActiveTexture(GL_TEXTURE0);
+    glUniform1i(glGetUniformLocation(ctx.particleProgram, "u_particles"), 2);
+    glUniform1i(glGetUniformLocation(ctx.particleProgram, "u_lifetimes"), 3);
+
+    if(ctx.particle_fetch == FETCH_INSTANCE_ID) {
+      glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, visibleCount);
+    }
+    else {
+      glDrawElements(GL_TRIANGLES, visibleCount * 6, GL_UNSIGNED_INT, 0);
+    }
+  }
 
   // Reset to defaults
   glBindVertexArray(ctx.defaultVAO);
   glUseProgram(0);
 }
 
+// Draw the particles into the reduced resolution target and composite them
+// onto the screen. The scene has already been drawn into sceneFBO.
+void drawParticlesOffscreen(Context &ctx)
+{
+  int factor = ctx.offscreen_downsample;
+  int width = std::max(ctx.width / factor, 1);
+  int height = std::max(ctx.height / factor, 1);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, ctx.particleFBO);
+  glViewport(0, 0, width, height);
+  glClearColor(0.0, 0.0, 0.0, 0.0);
+  glClear(GL_COLOR_BUFFER_BIT);
+
+  // -- Downsample the scene depth so particles are hidden behind the scene
+  glUseProgram(ctx.depthDownsampleProgram);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, ctx.sceneDepthTexture);
+  glUniform1i(glGetUniformLocation(ctx.depthDownsampleProgram, "u_scene_depth"), 0);
+  glUniform1i(glGetUniformLocation(ctx.depthDownsampleProgram, "u_factor"), factor);
+
+  glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+  glDepthFunc(GL_ALWAYS);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+  glDepthFunc(GL_LESS);
+  glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+  // -- Particles. They do not write depth, so the target keeps the scene
+  // depth for the upsampling below.
+  glDepthMask(GL_FALSE);
+  drawParticles(ctx);
+  glDepthMask(GL_TRUE);
+
+  // -- Composite onto the screen
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glViewport(0, 0, ctx.width, ctx.height);
+
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx.sceneFBO);
+  glBlitFramebuffer(0, 0, ctx.width, ctx.height, 0, 0, ctx.width, ctx.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+  glUseProgram(ctx.upsampleProgram);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, ctx.particleColorTexture);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, ctx.particleDepthTexture);
+  glActiveTexture(GL_TEXTURE2);
+  glBindTexture(GL_TEXTURE_2D, ctx.sceneDepthTexture);
+  glUniform1i(glGetUniformLocation(ctx.upsampleProgram, "u_particles"), 0);
+  glUniform1i(glGetUniformLocation(ctx.upsampleProgram, "u_particles_depth"), 1);
+  glUniform1i(glGetUniformLocation(ctx.upsampleProgram, "u_scene_depth"), 2);
+  glUniform1f(glGetUniformLocation(ctx.upsampleProgram, "u_near"), nearPlane);
+  glUniform1f(glGetUniformLocation(ctx.upsampleProgram, "u_far"), farPlane);
+
+  // Particle colors are premultiplied by their coverage
+  glDisable(GL_DEPTH_TEST);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+  glEnable(GL_DEPTH_TEST);
+
+  glActiveTexture(GL_TEXTURE0);
+  glUseProgram(0);
+}
+
+void applyQualityLevel(Context &ctx, int level)
+{
+  const QualityLevel &q = qualityLevels[level];
+  ctx.emission_scale = q.emission_scale;
+  ctx.particle_budget = (int)(q.budget_scale * maxParticles);
+  ctx.lod_pixel_threshold = q.lod_pixel_threshold;
+  ctx.particle_downsample = q.particle_downsample;
+}
+
+// Feed the last frame time to the quality controller and apply and log the
+// new settings if it changes the quality level
+void updateQuality(Context &ctx, double frameTime, double now)
+{
+  ctx.frame_ms = frameTime * 1000.0;
+
+  if(!ctx.adaptive_quality) {
+    return;
+  }
+
+  ctx.quality.targetFrameTime = ctx.target_frame_ms / 1000.0f;
+
+  int oldLevel = ctx.quality.level;
+  if(qualityControllerUpdate(ctx.quality, frameTime, now)) {
+    applyQualityLevel(ctx, ctx.quality.level);
+
+    std::cout << "Quality level " << oldLevel << " -> " << ctx.quality.level
+      << ": average frame time " << ctx.quality.averageFrameTime * 1000.0f
+      << " ms (target " << ctx.target_frame_ms << " ms), emission rate "
+      << ctx.emission_rate * ctx.emission_scale << "/s, particle budget "
+      << ctx.particle_budget << ", LOD pixel threshold " << ctx.lod_pixel_threshold
+      << ", particle resolution 1/" << ctx.particle_downsample << std::endl;
+  }
+}
+
 void display(Context &ctx)
 {
+  bool offscreen = ctx.particle_downsample > 1;
+  if(offscreen) {
+    updateOffscreenTargets(ctx);
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx.sceneFBO);
+  }
+
   glClearColor(1.0, 1.0, 1.0, 1.0);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-  drawParticles(ctx);
+  drawCloth(ctx);
+  drawSurface(ctx);
+
+  if(offscreen) {
+    drawParticlesOffscreen(ctx);
+  }
+  else {
+    drawParticles(ctx);
+  }
 }
 
 void reloadShaders(Context *ctx)
@@ -604,10 +1929,86 @@ void resizeCallback(GLFWwindow* window, int width, int height)
   glViewport(0, 0, width, height);
 }
 
+// Time the swarm solver on numAgents agents for increasing thread counts
+// and print the results. The agents start in a sphere that keeps the density
+// of a full swarm in the application. Needs no window.
+void benchmarkSwarm(int numAgents)
+{
+  const int numSteps = 20;
+
+  SwarmParams params;
+  params.boundsRadius *= std::cbrt(numAgents / (float) maxParticles);
+
+  std::vector<glm::vec3> startPositions(numAgents), startVelocities(numAgents);
+  for(int i = 0; i < numAgents; i++){
+    glm::vec3 p;
+    do {
+      p = glm::vec3(rand(), rand(), rand()) / (float) RAND_MAX * 2.0f - 1.0f;
+    } while(glm::length2(p) > 1.0f);
+    startPositions[i] = p * params.boundsRadius;
+    startVelocities[i] = glm::vec3(rand(), rand(), rand()) / (float) RAND_MAX * 2.0f - 1.0f;
+  }
+
+  int maxThreads = std::max((int) std::thread::hardware_concurrency(), 1);
+  double singleThreadTime = 0.0;
+  for(int threads = 1; ; threads = std::min(threads * 2, maxThreads)){
+    ThreadPool pool;
+    threadPoolStart(pool, threads);
+    SwarmSolver solver;
+    std::vector<glm::vec3> positions(startPositions), velocities(startVelocities);
+
+    // The first step allocates the solver arrays
+    swarmStep(solver, params, &positions[0], &velocities[0], numAgents, 1.0f / 60.0f, pool);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(int i = 0; i < numSteps; i++){
+      swarmStep(solver, params, &positions[0], &velocities[0], numAgents, 1.0f / 60.0f, pool);
+    }
+    double stepTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / numSteps;
+    if(threads == 1) {
+      singleThreadTime = stepTime;
+    }
+
+    std::cout << "Swarm of " << numAgents << " agents, " << threads << " threads: "
+      << stepTime * 1000.0 << " ms per step, speedup " << singleThreadTime / stepTime << std::endl;
+
+    if(threads == maxThreads) {
+      break;
+    }
+  }
+}
+
 int main(int argc, char** argv)
 {
   Context ctx;
 
+  // Select how the particle shader fetches its data
+  ctx.particle_fetch = FETCH_ATTRIBUTES;
+  for(int i = 1; i < argc; i++){
+    std::string arg(argv[i]);
+    if(arg == "--fetch-attributes") {
+      ctx.particle_fetch = FETCH_ATTRIBUTES;
+    }
+    else if(arg == "--fetch-instance-id") {
+      ctx.particle_fetch = FETCH_INSTANCE_ID;
+    }
+    else if(arg == "--fetch-vertex-id") {
+      ctx.particle_fetch = FETCH_VERTEX_ID;
+    }
+    else if(arg == "--emitter-mesh" && i + 1 < argc) {
+      ctx.emitter_mesh_files.push_back(argv[++i]);
+    }
+    else if(arg == "--benchmark-swarm" && i + 1 < argc) {
+      benchmarkSwarm(std::atoi(argv[++i]));
+      std::exit(EXIT_SUCCESS);
+    }
+    else {
+      std::cerr << "Unknown argument " << arg << ", expected --fetch-attributes, "
+        << "--fetch-instance-id, --fetch-vertex-id, --emitter-mesh <file.obj> "
+        << "or --benchmark-swarm <agents>" << std::endl;
+    }
+  }
+
   // Create a GLFW window
   glfwInit();
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
@@ -638,6 +2039,8 @@ int main(int argc, char** argv)
   glEnable(GL_DEPTH_TEST);
   glDepthFunc(GL_LESS);
 
+  threadPoolStart(threadPool, 0);
+
   // Initialize rendering
   glGenVertexArrays(1, &ctx.defaultVAO);
   glBindVertexArray(ctx.defaultVAO);
@@ -656,6 +2059,12 @@ int main(int argc, char** argv)
   TwAddVarRW(tweakbar, "Spawn Direction", TW_TYPE_DIR3F, &ctx.spawn_direction, "");
   TwAddVarRW(tweakbar, "Spread", TW_TYPE_FLOAT, &ctx.spread, "step=0.1");
   TwAddVarRW(tweakbar, "Spawn Position", TW_TYPE_DIR3F, &ctx.spawn_position, "");
+  TwType emitterShapeType = TwDefineEnumFromString("EmitterShape", "Cube,Sphere,Box,Cone,Mesh");
+  TwAddVarRW(tweakbar, "Emitter shape", emitterShapeType, &ctx.emitter_shape, "");
+  TwAddVarRW(tweakbar, "Emitter size", TW_TYPE_FLOAT, &ctx.emitter_size, "step=0.1 min=0");
+  TwAddVarRW(tweakbar, "Emitter cone angle", TW_TYPE_FLOAT, &ctx.emitter_cone_angle, "step=1 min=0 max=180");
+  TwAddVarRW(tweakbar, "Emitter normal speed", TW_TYPE_FLOAT, &ctx.emitter_normal_speed, "step=0.1");
+  TwAddVarRW(tweakbar, "Emitter mesh", TW_TYPE_INT32, &ctx.emitter_mesh_index, "min=0");
 
   // Pre-set simulations
   TwAddSeparator(tweakbar, NULL, "");
@@ -663,15 +2072,118 @@ int main(int argc, char** argv)
   TwAddVarRW(tweakbar, "Fire",  TW_TYPE_BOOLCPP, &ctx.simulate_fire, "");
   TwAddVarRW(tweakbar, "Fountain",  TW_TYPE_BOOLCPP, &ctx.simulate_fountain, "");
   TwAddVarRW(tweakbar, "Explosion",  TW_TYPE_BOOLCPP, &ctx.simulate_explosion, "");
+  TwAddVarRW(tweakbar, "Swarm",  TW_TYPE_BOOLCPP, &ctx.simulate_swarm, "");
 
   TwAddSeparator(tweakbar, NULL, "");
   TwAddVarRW(tweakbar, "Explosion delay", TW_TYPE_FLOAT, &ctx.explosion_delay, "step=0.1 min=0.0");
   TwAddVarRW(tweakbar, "Enable wind",  TW_TYPE_BOOLCPP, &ctx.wind_enabled, "");
   TwAddVarRW(tweakbar, "Wind direction", TW_TYPE_DIR3F, &ctx.wind_vector, "");
 
+  // Fluid fountain
+  TwAddSeparator(tweakbar, NULL, "");
+  TwAddVarRW(tweakbar, "Fluid fountain", TW_TYPE_BOOLCPP, &ctx.fluid_enabled, "");
+  TwAddVarRW(tweakbar, "Fluid substep rate", TW_TYPE_FLOAT, &ctx.fluid_substep_rate, "step=10 min=30 max=1000");
+  TwAddVarRW(tweakbar, "Fluid max substeps", TW_TYPE_INT32, &ctx.fluid_max_substeps, "min=1 max=16");
+  TwAddVarRW(tweakbar, "Fluid stiffness", TW_TYPE_FLOAT, &ctx.fluid.stiffness, "step=5 min=0");
+  TwAddVarRW(tweakbar, "Fluid viscosity", TW_TYPE_FLOAT, &ctx.fluid.viscosity, "step=0.1 min=0");
+  TwAddVarRO(tweakbar, "Fluid time (ms)", TW_TYPE_FLOAT, &ctx.fluid_ms, "");
+
+  // Smoke grid
+  TwAddSeparator(tweakbar, NULL, "");
+  TwAddVarRW(tweakbar, "Smoke grid", TW_TYPE_BOOLCPP, &ctx.smoke_enabled, "");
+  TwAddVarRW(tweakbar, "Smoke resolution", TW_TYPE_INT32, &ctx.smoke.resolution, "min=8 max=128");
+  TwAddVarRW(tweakbar, "Smoke iterations", TW_TYPE_INT32, &ctx.smoke.pressureIterations, "min=0 max=200");
+  TwAddVarRW(tweakbar, "Smoke buoyancy", TW_TYPE_FLOAT, &ctx.smoke.buoyancy, "step=0.1");
+  TwAddVarRW(tweakbar, "Smoke cooling", TW_TYPE_FLOAT, &ctx.smoke.cooling, "step=0.05 min=0");
+  TwAddVarRW(tweakbar, "Smoke drag", TW_TYPE_FLOAT, &ctx.smoke_drag, "step=0.1 min=0");
+  TwAddVarRO(tweakbar, "Smoke time (ms)", TW_TYPE_FLOAT, &ctx.smoke_ms, "");
+
+  // Cloth
+  TwAddSeparator(tweakbar, NULL, "");
+  TwAddVarRW(tweakbar, "Cloth flags", TW_TYPE_BOOLCPP, &ctx.cloth_enabled, "");
+  TwAddVarRW(tweakbar, "Cloth iterations", TW_TYPE_INT32, &ctx.cloth.iterations, "min=1 max=64");
+  TwAddVarRW(tweakbar, "Cloth stretch stiffness", TW_TYPE_FLOAT, &ctx.cloth.stretchStiffness, "step=0.05 min=0 max=1");
+  TwAddVarRW(tweakbar, "Cloth bend stiffness", TW_TYPE_FLOAT, &ctx.cloth.bendStiffness, "step=0.05 min=0 max=1");
+  TwAddVarRW(tweakbar, "Cloth drag", TW_TYPE_FLOAT, &ctx.cloth.drag, "step=0.1 min=0");
+  TwAddVarRW(tweakbar, "Cloth wind scale", TW_TYPE_FLOAT, &ctx.cloth_wind_scale, "step=10 min=0");
+  TwAddVarRO(tweakbar, "Cloth time (ms)", TW_TYPE_FLOAT, &ctx.cloth_ms, "");
+
+  // Swarm
+  TwAddSeparator(tweakbar, NULL, "");
+  TwAddVarRW(tweakbar, "Swarm separation", TW_TYPE_FLOAT, &ctx.swarm.separationWeight, "step=0.1 min=0");
+  TwAddVarRW(tweakbar, "Swarm alignment", TW_TYPE_FLOAT, &ctx.swarm.alignmentWeight, "step=0.1 min=0");
+  TwAddVarRW(tweakbar, "Swarm cohesion", TW_TYPE_FLOAT, &ctx.swarm.cohesionWeight, "step=0.1 min=0");
+  TwAddVarRW(tweakbar, "Swarm max speed", TW_TYPE_FLOAT, &ctx.swarm.maxSpeed, "step=0.5 min=0");
+  TwAddVarRW(tweakbar, "Swarm agents per cell", TW_TYPE_INT32, &ctx.swarm.maxPerCell, "min=1 max=256");
+  TwAddVarRO(tweakbar, "Swarm time (ms)", TW_TYPE_FLOAT, &ctx.swarm_ms, "");
+
+  // Particle surface
+  TwAddSeparator(tweakbar, NULL, "");
+  TwAddVarRW(tweakbar, "Particle surface", TW_TYPE_BOOLCPP, &ctx.surface_enabled, "");
+  TwAddVarRW(tweakbar, "Surface hides particles", TW_TYPE_BOOLCPP, &ctx.surface_hide_particles, "");
+  TwAddVarRW(tweakbar, "Surface cell size", TW_TYPE_FLOAT, &ctx.surface.cellSize, "step=0.01 min=0.05");
+  TwAddVarRW(tweakbar, "Surface radius", TW_TYPE_FLOAT, &ctx.surface.radius, "step=0.01 min=0.01");
+  TwAddVarRW(tweakbar, "Surface iso value", TW_TYPE_FLOAT, &ctx.surface.isoValue, "step=0.05 min=0.01");
+  TwAddVarRW(tweakbar, "Surface color", TW_TYPE_COLOR3F, &ctx.surface_diffuse_color, "");
+  TwAddVarRW(tweakbar, "Surface specular power", TW_TYPE_FLOAT, &ctx.surface_specular_power, "step=1 min=1");
+  TwAddVarRO(tweakbar, "Surface triangles", TW_TYPE_INT32, &ctx.surface_triangles, "");
+  TwAddVarRO(tweakbar, "Surface time (ms)", TW_TYPE_FLOAT, &ctx.surface_ms, "");
+
+  // Sub-emitters
+  TwAddSeparator(tweakbar, NULL, "");
+  TwAddVarRW(tweakbar, "Sub-emitters", TW_TYPE_BOOLCPP, &ctx.sub_emitters_enabled, "");
+  TwAddVarRW(tweakbar, "Event queue capacity", TW_TYPE_INT32, &ctx.event_queue_capacity, "step=256 min=0 max=1000000");
+  TwAddVarRW(tweakbar, "Ground height", TW_TYPE_FLOAT, &ctx.ground_height, "step=0.1");
+  TwAddVarRO(tweakbar, "Events", TW_TYPE_INT32, &ctx.stats.events, "");
+  TwAddVarRO(tweakbar, "Dropped events", TW_TYPE_INT32, &ctx.stats.events_dropped, "");
+  TwAddVarRO(tweakbar, "Dropped events (total)", TW_TYPE_INT32, &ctx.events_dropped_total, "");
+  TwAddVarRO(tweakbar, "Sub-emitter particles", TW_TYPE_INT32, &ctx.stats.children, "");
+  TwAddVarRO(tweakbar, "Dropped sub-emitter particles", TW_TYPE_INT32, &ctx.stats.children_dropped, "");
+
+  // Rendering settings and statistics
+  TwAddSeparator(tweakbar, NULL, "");
+  TwAddVarRW(tweakbar, "Frustum culling",  TW_TYPE_BOOLCPP, &ctx.frustum_culling, "");
+  TwEnumVal particleResolutionValues[] = { {1, "Full"}, {2, "Half"}, {4, "Quarter"} };
+  TwType particleResolutionType = TwDefineEnum("ParticleResolution", particleResolutionValues, 3);
+  TwAddVarRW(tweakbar, "Particle resolution", particleResolutionType, &ctx.particle_downsample, "");
+  TwAddVarRO(tweakbar, "Live particles", TW_TYPE_INT32, &ctx.stats.live, "");
+  TwAddVarRO(tweakbar, "Expired particles", TW_TYPE_INT32, &ctx.stats.expired, "");
+  TwAddVarRO(tweakbar, "Visible particles", TW_TYPE_INT32, &ctx.stats.visible, "");
+  TwAddVarRO(tweakbar, "Culled particles", TW_TYPE_INT32, &ctx.stats.culled, "");
+
+  // Level of detail
+  TwAddSeparator(tweakbar, NULL, "");
+  TwType lodCompensationType = TwDefineEnumFromString("LodCompensation", "Enlarge,Brighten");
+  TwAddVarRW(tweakbar, "LOD", TW_TYPE_BOOLCPP, &ctx.lod_enabled, "");
+  TwAddVarRW(tweakbar, "LOD band 1 distance", TW_TYPE_FLOAT, &ctx.lod_band_distance[0], "step=1.0 min=0.0");
+  TwAddVarRW(tweakbar, "LOD band 1 keep", TW_TYPE_FLOAT, &ctx.lod_band_keep[0], "step=0.05 min=0.0 max=1.0");
+  TwAddVarRW(tweakbar, "LOD band 2 distance", TW_TYPE_FLOAT, &ctx.lod_band_distance[1], "step=1.0 min=0.0");
+  TwAddVarRW(tweakbar, "LOD band 2 keep", TW_TYPE_FLOAT, &ctx.lod_band_keep[1], "step=0.05 min=0.0 max=1.0");
+  TwAddVarRW(tweakbar, "LOD band 3 distance", TW_TYPE_FLOAT, &ctx.lod_band_distance[2], "step=1.0 min=0.0");
+  TwAddVarRW(tweakbar, "LOD band 3 keep", TW_TYPE_FLOAT, &ctx.lod_band_keep[2], "step=0.05 min=0.0 max=1.0");
+  TwAddVarRW(tweakbar, "LOD pixel threshold", TW_TYPE_FLOAT, &ctx.lod_pixel_threshold, "step=0.1 min=0.0");
+  TwAddVarRW(tweakbar, "LOD compensation", lodCompensationType, &ctx.lod_compensation, "");
+  TwAddVarRO(tweakbar, "Decimated particles", TW_TYPE_INT32, &ctx.stats.decimated, "");
+  TwAddVarRO(tweakbar, "Drawn particles", TW_TYPE_INT32, &ctx.stats.drawn, "");
+
+  // Emission and adaptive quality
+  TwAddSeparator(tweakbar, NULL, "");
+  TwAddVarRW(tweakbar, "Emission rate", TW_TYPE_FLOAT, &ctx.emission_rate, "step=100 min=0");
+  TwAddVarRW(tweakbar, "Particle budget", TW_TYPE_INT32, &ctx.particle_budget, "step=1000 min=0 max=100000");
+  TwAddVarRW(tweakbar, "Adaptive quality", TW_TYPE_BOOLCPP, &ctx.adaptive_quality, "");
+  TwAddVarRW(tweakbar, "Target frame time (ms)", TW_TYPE_FLOAT, &ctx.target_frame_ms, "step=0.1 min=1.0");
+  TwAddVarRO(tweakbar, "Frame time (ms)", TW_TYPE_FLOAT, &ctx.frame_ms, "");
+  TwAddVarRO(tweakbar, "Quality level", TW_TYPE_INT32, &ctx.quality.level, "");
+
   // Start rendering loop
+  double lastFrameTime = glfwGetTime();
   while (!glfwWindowShouldClose(ctx.window)) {
     glfwPollEvents();
+
+    double currentFrameTime = glfwGetTime();
+    updateQuality(ctx, currentFrameTime - lastFrameTime, currentFrameTime);
+    lastFrameTime = currentFrameTime;
+
     display(ctx);
     TwDraw();
     glfwSwapBuffers(ctx.window);
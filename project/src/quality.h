@@ -0,0 +1,80 @@
+#pragma once
+
+#include <algorithm>
+
+// Number of frames averaged before the quality level is changed
+const int frameTimeWindow = 60;
+
+// Struct for a controller that picks a quality level so that the average
+// frame time stays close to a target. Quality is dropped quickly when over
+// budget but only raised again after a longer period well under budget, so
+// the level does not oscillate around the target.
+struct QualityController {
+    float targetFrameTime;     // Seconds
+    float degradeThreshold;    // Drop a level above targetFrameTime * degradeThreshold
+    float upgradeThreshold;    // Raise a level below targetFrameTime * upgradeThreshold
+    double degradeDelay;       // Seconds since the last change before dropping a level
+    double upgradeDelay;       // Seconds since the last change before raising a level
+
+    float frameTimes[frameTimeWindow]; // Ring buffer of recent frame times
+    int numFrameTimes;
+    int nextFrameTime;
+    float averageFrameTime;    // Average over the last full window
+
+    int level;                 // Current quality level, 0 is the lowest
+    int numLevels;
+    double lastChange;         // Time of the last level change
+
+    QualityController() : targetFrameTime(1.0f / 60.0f),
+                          degradeThreshold(1.1f),
+                          upgradeThreshold(0.75f),
+                          degradeDelay(0.5),
+                          upgradeDelay(3.0),
+                          numFrameTimes(0),
+                          nextFrameTime(0),
+                          averageFrameTime(0.0f),
+                          level(0),
+                          numLevels(1),
+                          lastChange(0.0)
+    {}
+};
+
+// Record the time of the last frame and update the quality level. Returns
+// true if the level changed.
+bool qualityControllerUpdate(QualityController &qc, float frameTime, double now)
+{
+    qc.frameTimes[qc.nextFrameTime] = frameTime;
+    qc.nextFrameTime = (qc.nextFrameTime + 1) % frameTimeWindow;
+    if (qc.numFrameTimes < frameTimeWindow) {
+        qc.numFrameTimes++;
+        return false;
+    }
+
+    float sum = 0.0f;
+    for (int i = 0; i < frameTimeWindow; i++) {
+        sum += qc.frameTimes[i];
+    }
+    qc.averageFrameTime = sum / frameTimeWindow;
+
+    int level = qc.level;
+    if (qc.averageFrameTime > qc.targetFrameTime * qc.degradeThreshold &&
+        now - qc.lastChange > qc.degradeDelay) {
+        level = std::max(level - 1, 0);
+    }
+    else if (qc.averageFrameTime < qc.targetFrameTime * qc.upgradeThreshold &&
+             now - qc.lastChange > qc.upgradeDelay) {
+        level = std::min(level + 1, qc.numLevels - 1);
+    }
+
+    if (level == qc.level) {
+        return false;
+    }
+
+    // Start measuring from scratch at the new level
+    qc.level = level;
+    qc.lastChange = now;
+    qc.numFrameTimes = 0;
+    qc.nextFrameTime = 0;
+
+    return true;
+}
@@ -0,0 +1,25 @@
+#version 330 core
+
+in vec3 v_position;
+in vec3 v_normal;
+in vec3 v_color;
+
+out vec4 color;
+
+uniform vec3 u_camera_position;
+uniform vec3 u_light_direction;
+
+void main(){
+    // Cloth is seen from both sides, so light the side facing the camera
+    vec3 N = normalize(v_normal);
+    if (!gl_FrontFacing) {
+        N = -N;
+    }
+    vec3 L = normalize(u_light_direction);
+    vec3 V = normalize(u_camera_position - v_position);
+    vec3 H = normalize(L + V);
+
+    float diffuse = max(dot(N, L), 0.0);
+    float specular = pow(max(dot(N, H), 0.0), 32.0) * 0.2;
+    color = vec4(v_color * (0.3 + 0.7 * diffuse) + vec3(specular), 1.0);
+}
@@ -0,0 +1,24 @@
+#version 330 core
+
+// Full resolution depth of the scene
+uniform sampler2D u_scene_depth;
+
+// Number of full resolution pixels per reduced resolution pixel along each axis
+uniform int u_factor;
+
+void main(){
+    ivec2 size = textureSize(u_scene_depth, 0);
+    ivec2 base = ivec2(gl_FragCoord.xy) * u_factor;
+
+    // Keep the farthest depth so particles are only hidden where the whole
+    // footprint is covered
+    float depth = 0.0;
+    for (int y = 0; y < u_factor; y++) {
+        for (int x = 0; x < u_factor; x++) {
+            ivec2 texel = min(base + ivec2(x, y), size - 1);
+            depth = max(depth, texelFetch(u_scene_depth, texel, 0).r);
+        }
+    }
+
+    gl_FragDepth = depth;
+}
@@ -0,0 +1,13 @@
+#version 330 core
+
+// Output data ; will be interpolated for each fragment.
+out vec2 UV;
+
+void main()
+{
+    // A single triangle covering the whole screen, generated from the vertex index
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+
+    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+    UV = corner;
+}
@@ -1,9 +1,15 @@
 #version 330 core
 
+#ifdef VERTEX_PULLING
+// Per-particle data, fetched by particle index
+uniform samplerBuffer u_particles; // Position of the center of the particule and size of the square
+uniform samplerBuffer u_lifetimes; // Normalized age, opacity, material and temperature of the particle
+#else
 // Input vertex data, different for all executions of this shader.
 layout(location = 0) in vec3 a_squareVertices;
 layout(location = 1) in vec4 a_particle; // Position of the center of the particule and size of the square
-layout(location = 2) in vec4 a_color; // Position of the center of the particule and size of the square
+layout(location = 2) in vec4 a_lifetime; // Normalized age, opacity, material and temperature of the particle
+#endif
 
 // Output data ; will be interpolated for each fragment.
 out vec2 UV;
@@ -14,13 +20,50 @@ uniform vec3 u_camera_right;
 uniform vec3 u_camera_up;
 uniform mat4 u_VP; // Model-View-Projection matrix, but without the Model (the position is in BillboardPos; the orientation depends on the camera)
 
+// Color, alpha and size over the normalized age. Each simulation has two
+// rows: color and alpha, followed by the size scale in the red channel.
+uniform sampler2D u_lifetime_curves;
+uniform int u_simulation;
+
+// Sprite atlas regions of the materials: (u, v, width, height) and
+// (columns, rows, number of frames) of the flipbook in each region
+const int maxMaterials = 8;
+uniform vec4 u_material_regions[maxMaterials];
+uniform vec3 u_material_frames[maxMaterials];
+
+// Glow of hot gas, from dark red over orange and yellow to white
+vec3 heatColor(float temperature)
+{
+    return clamp(vec3(3.0, 3.0, 3.0) * temperature - vec3(0.0, 1.0, 2.0), 0.0, 1.0);
+}
+
 void main()
 {
+#ifdef VERTEX_PULLING
+#ifdef PULL_INSTANCE_ID
+    int particle = gl_InstanceID;
+    int corner = gl_VertexID;
+#else
+    int particle = gl_VertexID >> 2;
+    int corner = gl_VertexID & 3;
+#endif
+    vec3 a_squareVertices = vec3(float(corner & 1) - 0.5, float(corner >> 1) - 0.5, 0.0);
+    vec4 a_particle = texelFetch(u_particles, particle);
+    vec4 a_lifetime = texelFetch(u_lifetimes, particle);
+#endif
+
     // The first three values represent the particles center position
     vec3 p_center = a_particle.xyz;
 
+    // Look up the lifetime curves, sampling at texel centers so that age 0
+    // and 1 hit the first and last entries
+    vec2 curveSize = vec2(textureSize(u_lifetime_curves, 0));
+    float u = (a_lifetime.x * (curveSize.x - 1.0) + 0.5) / curveSize.x;
+    vec4 curveColor = texture(u_lifetime_curves, vec2(u, (2.0 * u_simulation + 0.5) / curveSize.y));
+    float curveScale = texture(u_lifetime_curves, vec2(u, (2.0 * u_simulation + 1.5) / curveSize.y)).r;
+
     // The fourth value represents the size of the particle
-    float p_size = a_particle.w;
+    float p_size = a_particle.w * curveScale;
 
     // Position of the vertex in the world space
     vec3 v_pos = p_center + u_camera_right * a_squareVertices.x * p_size + u_camera_up * a_squareVertices.y * p_size;
@@ -28,6 +71,15 @@ void main()
     gl_Position = u_VP * vec4(v_pos, 1.0f);
 
     // Pass values to fragment shader
-    UV = a_squareVertices.xy + vec2(0.5, 0.5);
-    particlecolor = a_color;
+    // Pick the flipbook frame from the age of the particle
+    int material = int(a_lifetime.z * 255.0 + 0.5);
+    vec4 region = u_material_regions[material];
+    vec3 frames = u_material_frames[material];
+    float frame = min(floor(a_lifetime.x * frames.z), frames.z - 1.0);
+    vec2 cell = vec2(mod(frame, frames.x), floor(frame / frames.x));
+    vec2 cellSize = region.zw / frames.xy;
+    UV = region.xy + (cell + a_squareVertices.xy + vec2(0.5, 0.5)) * cellSize;
+    // Hot particles glow, cold ones keep the color of the curve
+    vec3 color = mix(curveColor.rgb, heatColor(a_lifetime.w), min(a_lifetime.w * 2.0, 1.0));
+    particlecolor = vec4(color, curveColor.a * a_lifetime.y);
 }
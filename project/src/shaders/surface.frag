@@ -0,0 +1,22 @@
+#version 330 core
+
+in vec3 v_normal, n_normal, l_normal;
+
+out vec4 color;
+
+uniform vec3 u_ambient_color, u_diffuse_color, u_specular_color, u_light_color;
+uniform float u_specular_power;
+
+// Normalized Blinn-Phong as in the model viewer's mesh.frag
+void main(){
+    vec3 N = normalize(n_normal);
+    vec3 L = normalize(l_normal);
+    vec3 V = normalize(v_normal);
+    vec3 H = normalize(L + V);
+
+    vec3 I = u_ambient_color;
+    I += u_diffuse_color * u_light_color * max(dot(N, L), 0.0);
+    I += ((8.0 + u_specular_power) / 8.0) * u_specular_color * u_light_color * pow(max(dot(N, H), 0.0), u_specular_power);
+
+    color = vec4(I, 1.0);
+}
@@ -0,0 +1,22 @@
+#version 330 core
+
+layout(location = 0) in vec4 a_position;
+layout(location = 1) in vec3 a_normal;
+
+out vec3 v_normal, n_normal, l_normal;
+
+uniform mat4 u_mvp;
+uniform mat4 u_mv;
+uniform vec3 u_light_position;
+
+void main(){
+    gl_Position = u_mvp * a_position;
+
+    // Transform the vertex position to view space (eye coordinates)
+    vec3 position_eye = vec3(u_mv * a_position);
+
+    // View-space normal, light direction and direction to the eye
+    n_normal = normalize(mat3(u_mv) * a_normal);
+    l_normal = normalize(u_light_position - position_eye);
+    v_normal = normalize(-position_eye);
+}
@@ -0,0 +1,50 @@
+#version 330 core
+
+in vec2 UV;
+
+out vec4 color;
+
+// Reduced resolution particles (premultiplied alpha) and the depth they were tested against
+uniform sampler2D u_particles;
+uniform sampler2D u_particles_depth;
+
+// Full resolution depth of the scene
+uniform sampler2D u_scene_depth;
+
+// Near and far planes of the projection, used to linearize depth
+uniform float u_near;
+uniform float u_far;
+
+float linearDepth(float depth)
+{
+    float z = depth * 2.0 - 1.0;
+    return 2.0 * u_near * u_far / (u_far + u_near - z * (u_far - u_near));
+}
+
+void main(){
+    ivec2 size = textureSize(u_particles, 0);
+    float depth = linearDepth(texture(u_scene_depth, UV).r);
+
+    // Bilinear weights of the four nearest reduced resolution texels
+    vec2 position = UV * vec2(size) - 0.5;
+    vec2 base = floor(position);
+    vec2 f = position - base;
+
+    // Bilateral upsampling: scale each bilinear weight down by how much the
+    // depth of the texel differs from the depth at this pixel
+    vec4 sum = vec4(0.0);
+    float weightSum = 0.0;
+    for (int i = 0; i < 4; i++) {
+        ivec2 offset = ivec2(i & 1, i >> 1);
+        ivec2 texel = clamp(ivec2(base) + offset, ivec2(0), size - 1);
+
+        vec2 bilinear = mix(1.0 - f, f, vec2(offset));
+        float lowDepth = linearDepth(texelFetch(u_particles_depth, texel, 0).r);
+        float weight = bilinear.x * bilinear.y / (0.001 + abs(depth - lowDepth));
+
+        sum += texelFetch(u_particles, texel, 0) * weight;
+        weightSum += weight;
+    }
+
+    color = sum / max(weightSum, 1e-6);
+}
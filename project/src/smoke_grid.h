@@ -0,0 +1,219 @@
+#pragma once
+
+#include "parallel.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Parameters of the smoke grid
+struct SmokeParams {
+    int resolution;         // Cells along each axis
+    float size;             // Edge length of the grid in world units
+    int pressureIterations; // Jacobi iterations of the pressure solve
+    float buoyancy;         // Upward acceleration per unit of temperature
+    float cooling;          // Fraction of the temperature lost per second
+    float damping;          // Fraction of the velocity lost per second
+
+    SmokeParams() : resolution(32),
+                    size(16.0f),
+                    pressureIterations(20),
+                    buoyancy(4.0f),
+                    cooling(0.5f),
+                    damping(0.2f)
+    {}
+};
+
+// Struct for a coarse stable-fluids grid after Stam, "Real-Time Fluid
+// Dynamics for Games" (2003). Velocity and temperature are stored at the
+// cell centers. Each step advects both semi-Lagrangian, adds buoyancy from
+// the temperature and makes the velocity divergence free with a Jacobi
+// pressure solve, so the cost depends only on the resolution.
+struct SmokeGrid {
+    int n;
+    float cellSize;
+    glm::vec3 origin; // World position of the corner of the grid
+    std::vector<glm::vec3> velocity, velocityScratch;
+    std::vector<float> temperature, temperatureScratch;
+    std::vector<float> pressure, pressureScratch, divergence;
+};
+
+void smokeGridInit(SmokeGrid &grid, int n, float size)
+{
+    grid.n = n;
+    grid.cellSize = size / n;
+    grid.origin = glm::vec3(0.0f);
+    grid.velocity.assign(n * n * n, glm::vec3(0.0f));
+    grid.velocityScratch.assign(n * n * n, glm::vec3(0.0f));
+    grid.temperature.assign(n * n * n, 0.0f);
+    grid.temperatureScratch.assign(n * n * n, 0.0f);
+    grid.pressure.assign(n * n * n, 0.0f);
+    grid.pressureScratch.assign(n * n * n, 0.0f);
+    grid.divergence.assign(n * n * n, 0.0f);
+}
+
+inline int smokeGridIndex(const SmokeGrid &grid, int x, int y, int z)
+{
+    return (z * grid.n + y) * grid.n + x;
+}
+
+bool smokeGridContains(const SmokeGrid &grid, const glm::vec3 &p)
+{
+    glm::vec3 g = (p - grid.origin) / (grid.cellSize * grid.n);
+    return g.x >= 0.0f && g.y >= 0.0f && g.z >= 0.0f && g.x < 1.0f && g.y < 1.0f && g.z < 1.0f;
+}
+
+// Trilinearly interpolate a field at world position p. Positions outside
+// the grid take the value at the border.
+template <typename T>
+T smokeGridSample(const SmokeGrid &grid, const std::vector<T> &field, const glm::vec3 &p)
+{
+    int n = grid.n;
+    glm::vec3 g = glm::clamp((p - grid.origin) / grid.cellSize - 0.5f, glm::vec3(0.0f), glm::vec3(n - 1));
+    int x = std::min(int(g.x), n - 2);
+    int y = std::min(int(g.y), n - 2);
+    int z = std::min(int(g.z), n - 2);
+    glm::vec3 f = g - glm::vec3(x, y, z);
+
+    const T *c = &field[smokeGridIndex(grid, x, y, z)];
+    int dy = n, dz = n * n;
+    T c00 = glm::mix(c[0], c[1], f.x);
+    T c10 = glm::mix(c[dy], c[dy + 1], f.x);
+    T c01 = glm::mix(c[dz], c[dz + 1], f.x);
+    T c11 = glm::mix(c[dz + dy], c[dz + dy + 1], f.x);
+    return glm::mix(glm::mix(c00, c10, f.y), glm::mix(c01, c11, f.y), f.z);
+}
+
+// Heat the cells within `radius` of `center` to at least `temperature` and
+// push them away from the center at radialSpeed
+void smokeGridAddSource(SmokeGrid &grid, const glm::vec3 &center, float radius,
+                        float temperature, float radialSpeed)
+{
+    int n = grid.n;
+    glm::ivec3 lo = glm::max(glm::ivec3(glm::floor((center - grid.origin - radius) / grid.cellSize)), glm::ivec3(0));
+    glm::ivec3 hi = glm::min(glm::ivec3(glm::floor((center - grid.origin + radius) / grid.cellSize)), glm::ivec3(n - 1));
+
+    for (int z = lo.z; z <= hi.z; z++) {
+        for (int y = lo.y; y <= hi.y; y++) {
+            for (int x = lo.x; x <= hi.x; x++) {
+                glm::vec3 offset = grid.origin + (glm::vec3(x, y, z) + 0.5f) * grid.cellSize - center;
+                float distance = glm::length(offset);
+                if (distance > radius) {
+                    continue;
+                }
+
+                int i = smokeGridIndex(grid, x, y, z);
+                grid.temperature[i] = std::max(grid.temperature[i], temperature);
+                if (distance > 0.0f) {
+                    grid.velocity[i] += offset * (radialSpeed / distance);
+                }
+            }
+        }
+    }
+}
+
+// Advance the grid by dt seconds. Every pass runs over z slices in parallel.
+void smokeGridStep(SmokeGrid &grid, const SmokeParams &params, float dt, ThreadPool &pool)
+{
+    const int n = grid.n;
+    const float h = grid.cellSize;
+    const float damping = std::exp(-params.damping * dt);
+    const float cooling = std::exp(-params.cooling * dt);
+
+    // -- Advect velocity and temperature by tracing each cell center back
+    // along the velocity, and add buoyancy
+    parallelFor(pool, n, 1, [&](int begin, int end, int) {
+        for (int z = begin; z < end; z++) {
+            for (int y = 0; y < n; y++) {
+                for (int x = 0; x < n; x++) {
+                    int i = smokeGridIndex(grid, x, y, z);
+                    glm::vec3 p = grid.origin + (glm::vec3(x, y, z) + 0.5f) * h;
+                    glm::vec3 from = p - grid.velocity[i] * dt;
+
+                    float temperature = smokeGridSample(grid, grid.temperature, from) * cooling;
+                    glm::vec3 velocity = smokeGridSample(grid, grid.velocity, from) * damping;
+                    velocity.y += params.buoyancy * temperature * dt;
+
+                    // No flow through the walls
+                    if (x == 0 || x == n - 1) {
+                        velocity.x = 0.0f;
+                    }
+                    if (y == 0 || y == n - 1) {
+                        velocity.y = 0.0f;
+                    }
+                    if (z == 0 || z == n - 1) {
+                        velocity.z = 0.0f;
+                    }
+
+                    grid.temperatureScratch[i] = temperature;
+                    grid.velocityScratch[i] = velocity;
+                }
+            }
+        }
+    });
+    grid.velocity.swap(grid.velocityScratch);
+    grid.temperature.swap(grid.temperatureScratch);
+
+    // Offsets of the six neighbours of a cell. Neighbours outside the grid
+    // are replaced by the cell itself.
+    struct Stencil {
+        int xm, xp, ym, yp, zm, zp;
+    };
+    auto stencil = [n](int x, int y, int z) {
+        Stencil s = { x > 0 ? -1 : 0, x < n - 1 ? 1 : 0,
+                      y > 0 ? -n : 0, y < n - 1 ? n : 0,
+                      z > 0 ? -n * n : 0, z < n - 1 ? n * n : 0 };
+        return s;
+    };
+
+    // -- Divergence
+    parallelFor(pool, n, 1, [&](int begin, int end, int) {
+        for (int z = begin; z < end; z++) {
+            for (int y = 0; y < n; y++) {
+                for (int x = 0; x < n; x++) {
+                    int i = smokeGridIndex(grid, x, y, z);
+                    Stencil s = stencil(x, y, z);
+                    const glm::vec3 *v = &grid.velocity[i];
+                    grid.divergence[i] = -0.5f * h * (v[s.xp].x - v[s.xm].x + v[s.yp].y - v[s.ym].y +
+                                                      v[s.zp].z - v[s.zm].z);
+                }
+            }
+        }
+    });
+
+    // -- Pressure. The solve starts from the last step's pressure, which is
+    // close when the flow changes slowly.
+    for (int iteration = 0; iteration < params.pressureIterations; iteration++) {
+        parallelFor(pool, n, 1, [&](int begin, int end, int) {
+            for (int z = begin; z < end; z++) {
+                for (int y = 0; y < n; y++) {
+                    for (int x = 0; x < n; x++) {
+                        int i = smokeGridIndex(grid, x, y, z);
+                        Stencil s = stencil(x, y, z);
+                        const float *p = &grid.pressure[i];
+                        grid.pressureScratch[i] = (grid.divergence[i] + p[s.xm] + p[s.xp] + p[s.ym] +
+                                                   p[s.yp] + p[s.zm] + p[s.zp]) / 6.0f;
+                    }
+                }
+            }
+        });
+        grid.pressure.swap(grid.pressureScratch);
+    }
+
+    // -- Subtract the pressure gradient
+    parallelFor(pool, n, 1, [&](int begin, int end, int) {
+        for (int z = begin; z < end; z++) {
+            for (int y = 0; y < n; y++) {
+                for (int x = 0; x < n; x++) {
+                    int i = smokeGridIndex(grid, x, y, z);
+                    Stencil s = stencil(x, y, z);
+                    const float *p = &grid.pressure[i];
+                    grid.velocity[i] -= glm::vec3(p[s.xp] - p[s.xm], p[s.yp] - p[s.ym], p[s.zp] - p[s.zm]) * (0.5f / h);
+                }
+            }
+        }
+    });
+}
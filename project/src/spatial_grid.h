@@ -0,0 +1,116 @@
+#pragma once
+
+#include "parallel.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Struct for a hashed uniform grid over a set of points. Points are sorted
+// by cell with a counting sort, so the points of a cell are contiguous and
+// a neighbour search reads a few short runs of memory. Cells are hashed into
+// a table, so the grid is unbounded. Different cells can share a key, which
+// only adds points that are rejected by the distance test.
+struct SpatialGrid {
+    float cellSize;
+    std::uint32_t tableMask;
+    std::vector<std::uint32_t> cellStart;     // Points of key k are sortedIndices[cellStart[k]..cellStart[k + 1])
+    std::vector<std::uint32_t> pointKeys;     // Key of each input point
+    std::vector<std::uint32_t> sortedIndices; // Input index of each sorted point
+};
+
+inline glm::ivec3 spatialGridCell(const SpatialGrid &grid, const glm::vec3 &p)
+{
+    return glm::ivec3(int(std::floor(p.x / grid.cellSize)),
+                      int(std::floor(p.y / grid.cellSize)),
+                      int(std::floor(p.z / grid.cellSize)));
+}
+
+inline std::uint32_t spatialGridKey(const SpatialGrid &grid, const glm::ivec3 &cell)
+{
+    return (std::uint32_t(cell.x) * 73856093u ^ std::uint32_t(cell.y) * 19349663u ^
+            std::uint32_t(cell.z) * 83492791u) & grid.tableMask;
+}
+
+// Sort `count` points into a grid with the given cell size
+void spatialGridBuild(SpatialGrid &grid, const glm::vec3 *positions, int count, float cellSize,
+                      ThreadPool &pool)
+{
+    // Twice as many keys as points keeps collisions rare
+    std::uint32_t tableSize = 1024;
+    while (tableSize < 2u * count) {
+        tableSize *= 2;
+    }
+    grid.cellSize = cellSize;
+    grid.tableMask = tableSize - 1;
+    grid.cellStart.assign(tableSize + 1, 0);
+    grid.pointKeys.resize(count);
+    grid.sortedIndices.resize(count);
+
+    parallelFor(pool, count, 4096, [&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            grid.pointKeys[i] = spatialGridKey(grid, spatialGridCell(grid, positions[i]));
+        }
+    });
+
+    // Counting sort: count the points per key, turn the counts into offsets
+    // and scatter. The scatter leaves cellStart[k] at the end of key k, so
+    // the offsets are shifted back by one key afterwards.
+    for (int i = 0; i < count; i++) {
+        grid.cellStart[grid.pointKeys[i] + 1]++;
+    }
+    for (std::uint32_t k = 0; k < tableSize; k++) {
+        grid.cellStart[k + 1] += grid.cellStart[k];
+    }
+    for (int i = 0; i < count; i++) {
+        grid.sortedIndices[grid.cellStart[grid.pointKeys[i]]++] = i;
+    }
+    for (std::uint32_t k = tableSize; k > 0; k--) {
+        grid.cellStart[k] = grid.cellStart[k - 1];
+    }
+    grid.cellStart[0] = 0;
+}
+
+// Collect the distinct keys of the cells around a point that come closer to
+// it than `radius`, which must not exceed the cell size. Of the 3x3x3 cells
+// around the point about 21 pass on average. Returns the number of keys.
+int spatialGridNeighborKeys(const SpatialGrid &grid, const glm::vec3 &p, float radius,
+                            std::uint32_t keys[27])
+{
+    glm::ivec3 cell = spatialGridCell(grid, p);
+    glm::vec3 cellMin = glm::vec3(cell) * grid.cellSize;
+    float radiusSquared = radius * radius;
+
+    // Squared distance from the point to the cells below, at and above it
+    // along each axis
+    glm::vec3 below = p - cellMin;
+    glm::vec3 above = cellMin + grid.cellSize - p;
+    glm::vec3 distance[3] = { below * below, glm::vec3(0.0f), above * above };
+
+    int numKeys = 0;
+    for (int dz = -1; dz <= 1; dz++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                if (distance[dx + 1].x + distance[dy + 1].y + distance[dz + 1].z >= radiusSquared) {
+                    continue;
+                }
+
+                std::uint32_t key = spatialGridKey(grid, cell + glm::ivec3(dx, dy, dz));
+
+                // Visit each key once even if two cells share it
+                bool seen = false;
+                for (int i = 0; i < numKeys; i++) {
+                    seen = seen || keys[i] == key;
+                }
+                if (!seen) {
+                    keys[numKeys++] = key;
+                }
+            }
+        }
+    }
+
+    return numKeys;
+}
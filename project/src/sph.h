@@ -0,0 +1,206 @@
+#pragma once
+
+#include "parallel.h"
+#include "spatial_grid.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Parameters of the fluid solver. The defaults describe water-like particles
+// spaced 0.1 units apart at rest, which is about the density the default
+// fountain emitter spawns them at.
+struct FluidParams {
+    float smoothingRadius; // Kernel support, also the neighbour search radius
+    float restDensity;
+    float particleMass;
+    float stiffness;       // Pressure per unit of density above the rest density
+    float viscosity;
+    glm::vec3 gravity;
+    glm::vec3 boundsMin;   // The particles are kept inside this box
+    glm::vec3 boundsMax;
+    float restitution;     // Fraction of the normal velocity kept when hitting the box
+
+    FluidParams() : smoothingRadius(0.2f),
+                    restDensity(1000.0f),
+                    particleMass(1.0f),
+                    stiffness(100.0f),
+                    viscosity(2.0f),
+                    gravity(0.0f, -9.81f, 0.0f),
+                    boundsMin(-5.0f, -6.0f, -5.0f),
+                    boundsMax(5.0f, 100.0f, 5.0f),
+                    restitution(0.3f)
+    {}
+};
+
+// Neighbours remembered per particle between the density and force passes.
+// Particles with more neighbours, e.g. right at an emitter, search the grid
+// again in the force pass.
+const int maxFluidNeighbors = 64;
+
+// Struct for a smoothed-particle hydrodynamics solver after Mueller et al.,
+// "Particle-Based Fluid Simulation for Interactive Applications" (2003).
+// Each step the particles are sorted into a grid with cells the size of the
+// smoothing radius, and every particle gathers density and forces from its
+// neighbours in parallel. As each particle only writes its own values the
+// passes need no locking.
+struct FluidSolver {
+    SpatialGrid grid;
+
+    // Particle data in grid order
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> velocities;
+    std::vector<float> densities;
+    std::vector<float> pressures;
+
+    // Neighbours found by the density pass, maxFluidNeighbors per particle.
+    // numNeighbors is -1 if a particle has more.
+    std::vector<std::uint32_t> neighbors;
+    std::vector<int> numNeighbors;
+};
+
+const int fluidGrainSize = 1024;
+
+// Advance `count` particles by one step of dt seconds. Positions and
+// velocities are read and written in place.
+void fluidStep(FluidSolver &solver, const FluidParams &params, glm::vec3 *positions,
+               glm::vec3 *velocities, int count, float dt, ThreadPool &pool)
+{
+    if (count == 0) {
+        return;
+    }
+
+    const float h = params.smoothingRadius;
+    const float h2 = h * h;
+    const float pi = 3.14159265f;
+    const float poly6 = 315.0f / (64.0f * pi * std::pow(h, 9.0f));
+    const float spikyGradient = 45.0f / (pi * std::pow(h, 6.0f));
+    const float viscosityLaplacian = 45.0f / (pi * std::pow(h, 6.0f));
+    const float mass = params.particleMass;
+
+    // -- Sort the particles by cell
+    spatialGridBuild(solver.grid, positions, count, h, pool);
+
+    solver.positions.resize(count);
+    solver.velocities.resize(count);
+    solver.densities.resize(count);
+    solver.pressures.resize(count);
+    solver.neighbors.resize(count * maxFluidNeighbors);
+    solver.numNeighbors.resize(count);
+
+    parallelFor(pool, count, fluidGrainSize, [&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            std::uint32_t j = solver.grid.sortedIndices[i];
+            solver.positions[i] = positions[j];
+            solver.velocities[i] = velocities[j];
+        }
+    });
+
+    // -- Density and pressure. Negative pressure is clamped, otherwise
+    // particles at the free surface clump together.
+    parallelFor(pool, count, fluidGrainSize, [&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            const glm::vec3 &p = solver.positions[i];
+            std::uint32_t *neighbors = &solver.neighbors[i * maxFluidNeighbors];
+            int numNeighbors = 0;
+            float density = 0.0f;
+
+            std::uint32_t keys[27];
+            int numKeys = spatialGridNeighborKeys(solver.grid, p, h, keys);
+            for (int k = 0; k < numKeys; k++) {
+                std::uint32_t cellEnd = solver.grid.cellStart[keys[k] + 1];
+                for (std::uint32_t j = solver.grid.cellStart[keys[k]]; j < cellEnd; j++) {
+                    glm::vec3 offset = p - solver.positions[j];
+                    float r2 = glm::dot(offset, offset);
+                    if (r2 >= h2) {
+                        continue;
+                    }
+                    float d = h2 - r2;
+                    density += d * d * d;
+                    if (j != std::uint32_t(i) && numNeighbors >= 0) {
+                        if (numNeighbors < maxFluidNeighbors) {
+                            neighbors[numNeighbors++] = j;
+                        }
+                        else {
+                            numNeighbors = -1;
+                        }
+                    }
+                }
+            }
+
+            density *= mass * poly6;
+            solver.numNeighbors[i] = numNeighbors;
+            solver.densities[i] = density;
+            solver.pressures[i] = std::max(params.stiffness * (density - params.restDensity), 0.0f);
+        }
+    });
+
+    // -- Pressure and viscosity forces, then integrate and collide with the
+    // bounds. The results go straight back to the caller's order.
+    parallelFor(pool, count, fluidGrainSize, [&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            const glm::vec3 &p = solver.positions[i];
+            const glm::vec3 &v = solver.velocities[i];
+            float pressure = solver.pressures[i];
+
+            glm::vec3 pressureForce(0.0f);
+            glm::vec3 viscosityForce(0.0f);
+            auto addForces = [&](std::uint32_t j) {
+                glm::vec3 offset = p - solver.positions[j];
+                float r2 = glm::dot(offset, offset);
+                if (r2 >= h2 || r2 < 1e-12f) {
+                    return; // Out of reach, or coincident with no direction to push in
+                }
+                float r = std::sqrt(r2);
+                float w = h - r;
+                float densityJ = solver.densities[j];
+                pressureForce += offset * ((pressure + solver.pressures[j]) /
+                                           (2.0f * densityJ) * w * w / r);
+                viscosityForce += (solver.velocities[j] - v) * (w / densityJ);
+            };
+
+            if (solver.numNeighbors[i] >= 0) {
+                const std::uint32_t *neighbors = &solver.neighbors[i * maxFluidNeighbors];
+                for (int n = 0; n < solver.numNeighbors[i]; n++) {
+                    addForces(neighbors[n]);
+                }
+            }
+            else {
+                std::uint32_t keys[27];
+                int numKeys = spatialGridNeighborKeys(solver.grid, p, h, keys);
+                for (int k = 0; k < numKeys; k++) {
+                    std::uint32_t cellEnd = solver.grid.cellStart[keys[k] + 1];
+                    for (std::uint32_t j = solver.grid.cellStart[keys[k]]; j < cellEnd; j++) {
+                        addForces(j);
+                    }
+                }
+            }
+
+            glm::vec3 acceleration = (pressureForce * spikyGradient +
+                                      viscosityForce * (params.viscosity * viscosityLaplacian)) *
+                                     (mass / solver.densities[i]) + params.gravity;
+
+            // Semi-implicit Euler
+            glm::vec3 velocity = v + acceleration * dt;
+            glm::vec3 position = p + velocity * dt;
+
+            for (int axis = 0; axis < 3; axis++) {
+                if (position[axis] < params.boundsMin[axis]) {
+                    position[axis] = params.boundsMin[axis];
+                    velocity[axis] = std::max(velocity[axis], -params.restitution * velocity[axis]);
+                }
+                else if (position[axis] > params.boundsMax[axis]) {
+                    position[axis] = params.boundsMax[axis];
+                    velocity[axis] = std::min(velocity[axis], -params.restitution * velocity[axis]);
+                }
+            }
+
+            std::uint32_t j = solver.grid.sortedIndices[i];
+            positions[j] = position;
+            velocities[j] = velocity;
+        }
+    });
+}
@@ -0,0 +1,408 @@
+#pragma once
+
+#include "parallel.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Parameters of the surface reconstruction
+struct SurfaceParams {
+    float cellSize; // Spacing of the density samples
+    float radius;   // Support of the kernel splatted by each particle
+    float isoValue; // Density at the surface. A lone particle has density 1 at its center.
+    int maxBlocks;  // Blocks along each axis, particles beyond are left out
+
+    SurfaceParams() : cellSize(0.15f),
+                      radius(0.3f),
+                      isoValue(0.5f),
+                      maxBlocks(64)
+    {}
+};
+
+struct SurfaceVertex {
+    glm::vec3 position;
+    glm::vec3 normal;
+};
+
+// Cells along each axis of a block, and density samples along each axis of
+// a block: the cell corners plus one on either side for the gradients
+const int surfaceBlockCells = 16;
+const int surfaceBlockSamples = surfaceBlockCells + 3;
+
+// Struct for extracting an isosurface of the particle density with marching
+// cubes after Lorensen and Cline (1987). Space is divided into blocks of
+// surfaceBlockCells^3 cells and the particles are sorted by block. Only
+// blocks with particles in or next to them are visited. Each block splats
+// the nearby particles into its own samples and triangulates its own cells,
+// so the blocks are processed in parallel without sharing any writes.
+struct SurfaceExtractor {
+    glm::ivec3 gridOrigin; // Coordinate of the first block
+    glm::ivec3 gridSize;   // Blocks along each axis
+
+    // Particles sorted by block
+    std::vector<std::uint32_t> particleBlocks;
+    std::vector<std::uint32_t> blockStart;
+    std::vector<std::uint32_t> sortedParticles;
+
+    std::vector<std::uint8_t> blockActive;
+    std::vector<std::uint32_t> activeBlocks;
+    std::vector<std::vector<SurfaceVertex> > blockVertices; // Triangles of each active block
+    std::vector<std::vector<float> > threadSamples;         // Density samples of the block of each thread
+    std::vector<glm::vec3> threadMin, threadMax;            // Particle bounds found by each thread
+
+    std::vector<SurfaceVertex> vertices; // Triangle list of the whole surface
+};
+
+const int surfaceGrainSize = 4096;
+
+namespace {
+// Corners and edges of a cell, numbered as in Bourke, "Polygonising a
+// Scalar Field" (1994)
+const int mcCorners[8][3] = {
+    {0, 0, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, 0},
+    {0, 0, 1}, {1, 0, 1}, {1, 1, 1}, {0, 1, 1}
+};
+const int mcEdges[12][2] = {
+    {0, 1}, {1, 2}, {2, 3}, {3, 0}, {4, 5}, {5, 6},
+    {6, 7}, {7, 4}, {0, 4}, {1, 5}, {2, 6}, {3, 7}
+};
+
+// Corners of each face, counterclockwise seen from outside the cell
+const int mcFaces[6][4] = {
+    {0, 3, 2, 1}, {4, 5, 6, 7}, {0, 1, 5, 4},
+    {3, 7, 6, 2}, {0, 4, 7, 3}, {1, 2, 6, 5}
+};
+
+// Edges cut by the surface for each of the 256 inside/outside patterns,
+// three per triangle and terminated by -1
+struct MarchingCubesTable {
+    std::int8_t triangles[256][16];
+};
+
+// Build the triangle table instead of spelling it out. On each face the
+// edges where the walk around the face leaves the inside are joined to the
+// next edge where it enters again. Neighbouring cells walk a shared face in
+// opposite directions and so make the same choice on ambiguous faces, which
+// keeps the surface closed. The segments of all faces chain into loops,
+// which are triangulated as fans facing away from the inside.
+MarchingCubesTable marchingCubesBuildTable()
+{
+    int edgeIndex[8][8];
+    for (int e = 0; e < 12; e++) {
+        edgeIndex[mcEdges[e][0]][mcEdges[e][1]] = e;
+        edgeIndex[mcEdges[e][1]][mcEdges[e][0]] = e;
+    }
+
+    MarchingCubesTable table;
+    for (int pattern = 0; pattern < 256; pattern++) {
+        int next[12];
+        std::fill(next, next + 12, -1);
+
+        for (int f = 0; f < 6; f++) {
+            const int *face = mcFaces[f];
+            for (int i = 0; i < 4; i++) {
+                int a = face[i], b = face[(i + 1) % 4];
+                if (!((pattern >> a) & 1) || ((pattern >> b) & 1)) {
+                    continue; // Not leaving the inside
+                }
+                for (int j = 1; j < 4; j++) {
+                    int c = face[(i + j) % 4], d = face[(i + j + 1) % 4];
+                    if (!((pattern >> c) & 1) && ((pattern >> d) & 1)) {
+                        next[edgeIndex[a][b]] = edgeIndex[c][d];
+                        break;
+                    }
+                }
+            }
+        }
+
+        int numIndices = 0;
+        for (int start = 0; start < 12; start++) {
+            if (next[start] < 0) {
+                continue;
+            }
+
+            int loop[12], length = 0;
+            for (int e = start; next[e] >= 0;) {
+                loop[length++] = e;
+                int following = next[e];
+                next[e] = -1;
+                e = following;
+            }
+
+            for (int i = 1; i + 1 < length; i++) {
+                table.triangles[pattern][numIndices++] = loop[0];
+                table.triangles[pattern][numIndices++] = loop[i + 1];
+                table.triangles[pattern][numIndices++] = loop[i];
+            }
+        }
+        std::fill(&table.triangles[pattern][numIndices], &table.triangles[pattern][16], -1);
+    }
+    return table;
+}
+
+const MarchingCubesTable &marchingCubesTable()
+{
+    static const MarchingCubesTable table = marchingCubesBuildTable();
+    return table;
+}
+
+// Splat the particles near a block into its samples and triangulate its
+// cells into `vertices`
+void surfaceExtractBlock(const SurfaceExtractor &extractor, const SurfaceParams &params,
+                         const glm::vec3 *positions, std::uint32_t block, float *samples,
+                         std::vector<SurfaceVertex> &vertices)
+{
+    const int n = surfaceBlockSamples;
+    const float h = params.cellSize;
+    const float radius = std::min(params.radius, h * surfaceBlockCells);
+    const float inverseRadiusSquared = 1.0f / (radius * radius);
+    const glm::ivec3 size = extractor.gridSize;
+    const glm::ivec3 cell(block % size.x, block / size.x % size.y, block / (size.x * size.y));
+
+    // Global index of sample 0, one sample before the first cell corner.
+    // Positions are computed from global indices, so that blocks sharing a
+    // sample compute exactly the same density for it.
+    const glm::ivec3 base = (extractor.gridOrigin + cell) * surfaceBlockCells - 1;
+
+    // Particles outside this box do not reach any sample of the block
+    const glm::vec3 reachMin = glm::vec3(base) * h - radius;
+    const glm::vec3 reachMax = glm::vec3(base + n - 1) * h + radius;
+
+    // -- Splat the particles of this and the neighbouring blocks
+    std::fill(samples, samples + n * n * n, 0.0f);
+    for (int dz = -1; dz <= 1; dz++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                glm::ivec3 neighbor = cell + glm::ivec3(dx, dy, dz);
+                if (glm::any(glm::lessThan(neighbor, glm::ivec3(0))) ||
+                    glm::any(glm::greaterThanEqual(neighbor, size))) {
+                    continue;
+                }
+
+                std::uint32_t b = (neighbor.z * size.y + neighbor.y) * size.x + neighbor.x;
+                for (std::uint32_t k = extractor.blockStart[b]; k < extractor.blockStart[b + 1]; k++) {
+                    const glm::vec3 p = positions[extractor.sortedParticles[k]];
+                    if (glm::any(glm::lessThan(p, reachMin)) || glm::any(glm::greaterThan(p, reachMax))) {
+                        continue;
+                    }
+                    glm::ivec3 lo = glm::max(glm::ivec3(glm::ceil((p - radius) / h)) - base, glm::ivec3(0));
+                    glm::ivec3 hi = glm::min(glm::ivec3(glm::floor((p + radius) / h)) - base, glm::ivec3(n - 1));
+                    if (lo.x > hi.x || lo.y > hi.y || lo.z > hi.z) {
+                        continue;
+                    }
+
+                    // Poly6-shaped kernel (1 - r^2 / radius^2)^3
+                    float distanceX[surfaceBlockSamples];
+                    for (int x = lo.x; x <= hi.x; x++) {
+                        float d = (base.x + x) * h - p.x;
+                        distanceX[x] = d * d;
+                    }
+                    for (int z = lo.z; z <= hi.z; z++) {
+                        float dz = (base.z + z) * h - p.z;
+                        for (int y = lo.y; y <= hi.y; y++) {
+                            float dy = (base.y + y) * h - p.y;
+                            float distanceYZ = dz * dz + dy * dy;
+                            float *row = &samples[(z * n + y) * n];
+                            // Clamped rather than tested, as about half the
+                            // samples of the box lie outside the kernel
+                            for (int x = lo.x; x <= hi.x; x++) {
+                                float t = std::max(1.0f - (distanceYZ + distanceX[x]) * inverseRadiusSquared, 0.0f);
+                                row[x] += t * t * t;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // -- Marching cubes over the cells of the block
+    const MarchingCubesTable &table = marchingCubesTable();
+    const float iso = params.isoValue;
+    auto sample = [&](int x, int y, int z) { return samples[(z * n + y) * n + x]; };
+    auto gradient = [&](int x, int y, int z) {
+        return glm::vec3(sample(x + 1, y, z) - sample(x - 1, y, z),
+                         sample(x, y + 1, z) - sample(x, y - 1, z),
+                         sample(x, y, z + 1) - sample(x, y, z - 1));
+    };
+
+    for (int z = 1; z <= surfaceBlockCells; z++) {
+        for (int y = 1; y <= surfaceBlockCells; y++) {
+            for (int x = 1; x <= surfaceBlockCells; x++) {
+                float values[8];
+                int pattern = 0;
+                for (int c = 0; c < 8; c++) {
+                    values[c] = sample(x + mcCorners[c][0], y + mcCorners[c][1], z + mcCorners[c][2]);
+                    pattern |= (values[c] > iso) << c;
+                }
+                if (pattern == 0 || pattern == 255) {
+                    continue;
+                }
+
+                // Vertices on the cut edges, computed when first needed
+                SurfaceVertex edgeVertices[12];
+                int computed = 0;
+                const std::int8_t *indices = table.triangles[pattern];
+                for (int i = 0; indices[i] >= 0; i++) {
+                    int e = indices[i];
+                    if (!(computed & (1 << e))) {
+                        // Interpolate from the lower corner in global
+                        // coordinates, so that the cells and blocks sharing
+                        // an edge compute exactly the same vertex
+                        int ca = mcEdges[e][0], cb = mcEdges[e][1];
+                        if (mcCorners[ca][0] + mcCorners[ca][1] + mcCorners[ca][2] >
+                            mcCorners[cb][0] + mcCorners[cb][1] + mcCorners[cb][2]) {
+                            std::swap(ca, cb);
+                        }
+                        const int *a = mcCorners[ca];
+                        const int *b = mcCorners[cb];
+                        float t = (iso - values[ca]) / (values[cb] - values[ca]);
+
+                        glm::vec3 pa = glm::vec3(base + glm::ivec3(x + a[0], y + a[1], z + a[2])) * h;
+                        glm::vec3 pb = glm::vec3(base + glm::ivec3(x + b[0], y + b[1], z + b[2])) * h;
+                        glm::vec3 g = glm::mix(gradient(x + a[0], y + a[1], z + a[2]),
+                                               gradient(x + b[0], y + b[1], z + b[2]), t);
+                        float length = glm::length(g);
+
+                        // The density falls off towards the outside
+                        edgeVertices[e].position = glm::mix(pa, pb, t);
+                        edgeVertices[e].normal = length > 0.0f ? -g / length : glm::vec3(0.0f, 1.0f, 0.0f);
+                        computed |= 1 << e;
+                    }
+                    vertices.push_back(edgeVertices[e]);
+                }
+            }
+        }
+    }
+}
+} // namespace
+
+// Extract the surface of `count` particles into extractor.vertices, three
+// vertices per triangle
+void surfaceExtract(SurfaceExtractor &extractor, const SurfaceParams &params, const glm::vec3 *positions,
+                    int count, ThreadPool &pool)
+{
+    extractor.vertices.clear();
+    if (count == 0) {
+        return;
+    }
+
+    const float blockSize = params.cellSize * surfaceBlockCells;
+    const int numThreads = pool.numThreads;
+
+    // -- Bounds of the particles in blocks, with a margin of one block for
+    // the splats that reach past them
+    extractor.threadMin.assign(numThreads, glm::vec3(INFINITY));
+    extractor.threadMax.assign(numThreads, glm::vec3(-INFINITY));
+    parallelFor(pool, count, surfaceGrainSize, [&](int begin, int end, int threadIndex) {
+        glm::vec3 lo = extractor.threadMin[threadIndex];
+        glm::vec3 hi = extractor.threadMax[threadIndex];
+        for (int i = begin; i < end; i++) {
+            lo = glm::min(lo, positions[i]);
+            hi = glm::max(hi, positions[i]);
+        }
+        extractor.threadMin[threadIndex] = lo;
+        extractor.threadMax[threadIndex] = hi;
+    });
+    glm::vec3 lo = extractor.threadMin[0], hi = extractor.threadMax[0];
+    for (int t = 1; t < numThreads; t++) {
+        lo = glm::min(lo, extractor.threadMin[t]);
+        hi = glm::max(hi, extractor.threadMax[t]);
+    }
+
+    extractor.gridOrigin = glm::ivec3(glm::floor(lo / blockSize)) - 1;
+    extractor.gridSize = glm::min(glm::ivec3(glm::floor(hi / blockSize)) + 2 - extractor.gridOrigin,
+                                  glm::ivec3(std::max(params.maxBlocks, 1)));
+    const glm::ivec3 size = extractor.gridSize;
+    const std::uint32_t numBlocks = size.x * size.y * size.z;
+
+    // -- Sort the particles by block with a counting sort. Particles in the
+    // margin or beyond maxBlocks are left out.
+    extractor.particleBlocks.resize(count);
+    parallelFor(pool, count, surfaceGrainSize, [&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            glm::ivec3 cell = glm::ivec3(glm::floor(positions[i] / blockSize)) - extractor.gridOrigin;
+            bool inside = glm::all(glm::greaterThanEqual(cell, glm::ivec3(1))) &&
+                          glm::all(glm::lessThan(cell, size - 1));
+            extractor.particleBlocks[i] = inside ? (cell.z * size.y + cell.y) * size.x + cell.x : UINT32_MAX;
+        }
+    });
+
+    extractor.blockStart.assign(numBlocks + 1, 0);
+    for (int i = 0; i < count; i++) {
+        if (extractor.particleBlocks[i] != UINT32_MAX) {
+            extractor.blockStart[extractor.particleBlocks[i] + 1]++;
+        }
+    }
+    for (std::uint32_t b = 0; b < numBlocks; b++) {
+        extractor.blockStart[b + 1] += extractor.blockStart[b];
+    }
+    extractor.sortedParticles.resize(extractor.blockStart[numBlocks]);
+    std::vector<std::uint32_t> cursor(extractor.blockStart.begin(), extractor.blockStart.end() - 1);
+    for (int i = 0; i < count; i++) {
+        std::uint32_t b = extractor.particleBlocks[i];
+        if (b != UINT32_MAX) {
+            extractor.sortedParticles[cursor[b]++] = i;
+        }
+    }
+
+    // -- Blocks with particles and their neighbours are visited
+    extractor.blockActive.assign(numBlocks, 0);
+    for (int z = 1; z < size.z - 1; z++) {
+        for (int y = 1; y < size.y - 1; y++) {
+            for (int x = 1; x < size.x - 1; x++) {
+                std::uint32_t b = (z * size.y + y) * size.x + x;
+                if (extractor.blockStart[b] == extractor.blockStart[b + 1]) {
+                    continue;
+                }
+                for (int dz = -1; dz <= 1; dz++) {
+                    for (int dy = -1; dy <= 1; dy++) {
+                        for (int dx = -1; dx <= 1; dx++) {
+                            extractor.blockActive[((z + dz) * size.y + y + dy) * size.x + x + dx] = 1;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    extractor.activeBlocks.clear();
+    for (std::uint32_t b = 0; b < numBlocks; b++) {
+        if (extractor.blockActive[b]) {
+            extractor.activeBlocks.push_back(b);
+        }
+    }
+
+    // -- Triangulate the active blocks in parallel
+    int numActive = extractor.activeBlocks.size();
+    extractor.blockVertices.resize(numActive);
+    extractor.threadSamples.resize(numThreads);
+    for (int t = 0; t < numThreads; t++) {
+        extractor.threadSamples[t].resize(surfaceBlockSamples * surfaceBlockSamples * surfaceBlockSamples);
+    }
+    parallelFor(pool, numActive, 1, [&](int begin, int end, int threadIndex) {
+        for (int i = begin; i < end; i++) {
+            extractor.blockVertices[i].clear();
+            surfaceExtractBlock(extractor, params, positions, extractor.activeBlocks[i],
+                                &extractor.threadSamples[threadIndex][0], extractor.blockVertices[i]);
+        }
+    });
+
+    // -- Concatenate the triangles of the blocks
+    std::vector<std::size_t> offsets(numActive + 1, 0);
+    for (int i = 0; i < numActive; i++) {
+        offsets[i + 1] = offsets[i] + extractor.blockVertices[i].size();
+    }
+    extractor.vertices.resize(offsets[numActive]);
+    parallelFor(pool, numActive, 16, [&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            std::copy(extractor.blockVertices[i].begin(), extractor.blockVertices[i].end(),
+                      extractor.vertices.begin() + offsets[i]);
+        }
+    });
+}
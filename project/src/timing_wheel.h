@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// An item scheduled in a timing wheel, and the tick it expires at
+struct TimingWheelEntry {
+    std::uint32_t item;
+    std::uint32_t tick;
+};
+
+// Where an item is stored in a timing wheel. The owner of the items keeps
+// this so that it can update the wheel when it moves an item.
+struct TimingWheelLocation {
+    std::uint32_t slot;
+    std::uint32_t position;
+};
+
+// Struct for a hashed timing wheel. Time is divided into ticks of
+// slotDuration seconds and items are bucketed by the tick they expire at,
+// so advancing the wheel only touches the items that expire. Items further
+// away than the number of slots wait in the last slot and are rescheduled
+// when it is reached.
+struct TimingWheel {
+    double slotDuration;
+    std::uint32_t currentTick; // Next tick to be processed
+    std::vector<std::vector<TimingWheelEntry> > slots;
+};
+
+void timingWheelInit(TimingWheel &wheel, int numSlots, double slotDuration, double now)
+{
+    wheel.slotDuration = slotDuration;
+    wheel.currentTick = std::uint32_t(now / slotDuration);
+    wheel.slots.clear();
+    wheel.slots.resize(numSlots);
+}
+
+// Returns the first tick that starts at or after `time`
+std::uint32_t timingWheelTickAfter(const TimingWheel &wheel, double time)
+{
+    return std::uint32_t(std::ceil(time / wheel.slotDuration));
+}
+
+// Schedule an item to expire at `tick` and return where it was stored
+TimingWheelLocation timingWheelInsert(TimingWheel &wheel, std::uint32_t item, std::uint32_t tick)
+{
+    std::uint32_t numSlots = wheel.slots.size();
+    std::uint32_t slotTick = std::min(std::max(tick, wheel.currentTick),
+                                      wheel.currentTick + numSlots - 1);
+
+    TimingWheelLocation location;
+    location.slot = slotTick % numSlots;
+    location.position = wheel.slots[location.slot].size();
+
+    TimingWheelEntry entry = { item, tick };
+    wheel.slots[location.slot].push_back(entry);
+
+    return location;
+}
+
+// Update the item stored at `location`, e.g. after the owner moved it
+void timingWheelRelocate(TimingWheel &wheel, TimingWheelLocation location, std::uint32_t item)
+{
+    wheel.slots[location.slot][location.position].item = item;
+}
+
+// Process all ticks that start at or before `time`. expire(item) is called
+// for every item that is due, and moved(item, location) for every item that
+// was rescheduled because it lies beyond the wheel. expire() may relocate
+// other items in the wheel. Returns the number of expired items.
+template <typename ExpireFunction, typename MovedFunction>
+int timingWheelAdvance(TimingWheel &wheel, double time, ExpireFunction expire, MovedFunction moved)
+{
+    std::uint32_t numSlots = wheel.slots.size();
+    std::uint32_t endTick = std::uint32_t(time / wheel.slotDuration);
+
+    int numExpired = 0;
+    for (; wheel.currentTick <= endTick; wheel.currentTick++) {
+        std::vector<TimingWheelEntry> &bucket = wheel.slots[wheel.currentTick % numSlots];
+
+        for (std::size_t i = 0; i < bucket.size(); i++) {
+            TimingWheelEntry entry = bucket[i];
+            if (entry.tick > wheel.currentTick) {
+                moved(entry.item, timingWheelInsert(wheel, entry.item, entry.tick));
+            }
+            else {
+                expire(entry.item);
+                numExpired++;
+            }
+        }
+
+        // Keep the capacity, the slot will be reused
+        bucket.clear();
+    }
+
+    return numExpired;
+}
@@ -9,16 +9,19 @@
 #include <string>
 #include <vector>
 
-GLuint load2DTexture(const std::string &filename)
+// Loads an RGBA image, exits on failure
+void loadImage(const std::string &filename, std::vector<unsigned char> &data,
+               unsigned &width, unsigned &height)
 {
-    std::vector<unsigned char> data;
-    unsigned width, height;
     unsigned error = lodepng::decode(data, width, height, filename);
     if (error != 0) {
         std::cout << "Error: " << lodepng_error_text(error) << std::endl;
         std::exit(EXIT_FAILURE);
     }
+}
 
+GLuint create2DTexture(const unsigned char *data, unsigned width, unsigned height)
+{
     GLuint texture;
     glGenTextures(1, &texture);
     glBindTexture(GL_TEXTURE_2D, texture);
@@ -27,12 +30,21 @@ GLuint load2DTexture(const std::string &filename)
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA,
-                 GL_UNSIGNED_BYTE, &(data[0]));
+                 GL_UNSIGNED_BYTE, data);
     glBindTexture(GL_TEXTURE_2D, 0);
 
     return texture;
 }
 
+GLuint load2DTexture(const std::string &filename)
+{
+    std::vector<unsigned char> data;
+    unsigned width, height;
+    loadImage(filename, data, width, height);
+
+    return create2DTexture(&data[0], width, height);
+}
+
 float degreeToRadians(int degree)
 {
   return (float) (degree * 3.14159265 / 180);
@@ -100,12 +112,28 @@ void showProgramInfoLog(GLuint program)
     std::cerr << infoLogStr << std::endl;
 }
 
+// Inserts preprocessor definitions after the #version line of a shader
+std::string addShaderDefines(const std::string &source, const std::string &defines)
+{
+    if (defines.empty()) {
+        return source;
+    }
+    std::size_t lineEnd = source.find('\n');
+    if (lineEnd == std::string::npos) {
+        return source + "\n" + defines;
+    }
+    return source.substr(0, lineEnd + 1) + defines + source.substr(lineEnd + 1);
+}
+
+// Loads a shader program. `defines` (e.g. "#define FOO\n") is inserted into
+// both shaders so that one source file can be compiled in several variants.
 GLuint loadShaderProgram(const std::string &vertexShaderFilename,
-                         const std::string &fragmentShaderFilename)
+                         const std::string &fragmentShaderFilename,
+                         const std::string &defines = std::string())
 {
     // Load and compile vertex shader
     GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    std::string vertexShaderSource = readShaderSource(vertexShaderFilename);
+    std::string vertexShaderSource = addShaderDefines(readShaderSource(vertexShaderFilename), defines);
     const char *vertexShaderSourcePtr = vertexShaderSource.c_str();
     glShaderSource(vertexShader, 1, &vertexShaderSourcePtr, nullptr);
 
@@ -121,7 +149,7 @@ GLuint loadShaderProgram(const std::string &vertexShaderFilename,
 
     // Load and compile fragment shader
     GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    std::string fragmentShaderSource = readShaderSource(fragmentShaderFilename);
+    std::string fragmentShaderSource = addShaderDefines(readShaderSource(fragmentShaderFilename), defines);
     const char *fragmentShaderSourcePtr = fragmentShaderSource.c_str();
     glShaderSource(fragmentShader, 1, &fragmentShaderSourcePtr, nullptr);
 
@@ -12,7 +12,22 @@
 #include <vector>
 #include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <algorithm>
+#include <thread>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <cstdio>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // Struct for representing a virtual 3D trackball that can be used for
 // object or camera rotation
@@ -38,9 +53,98 @@ struct Trackball {
 struct OBJMesh {
     std::vector<glm::vec3> vertices;
     std::vector<glm::vec3> normals;
+    std::vector<glm::vec2> texcoords; // Empty if the file has none
     std::vector<std::uint32_t> indices;
 };
 
+// Struct for the read-only contents of a whole file, memory-mapped where the
+// platform supports it and read into memory otherwise
+struct MappedFile {
+    const char *data;
+    std::size_t size;
+    std::vector<char> buffer; // Contents when the file is not mapped
+    bool mapped;
+
+    MappedFile() : data(nullptr), size(0), mapped(false) {}
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+#ifndef _WIN32
+        if (mapped) {
+            munmap(const_cast<char *>(data), size);
+        }
+#endif
+    }
+};
+
+// Unmap a file, or release its contents
+void mappedFileClose(MappedFile &file)
+{
+#ifndef _WIN32
+    if (file.mapped) {
+        munmap(const_cast<char *>(file.data), file.size);
+    }
+#endif
+    file.data = nullptr;
+    file.size = 0;
+    file.buffer.clear();
+    file.mapped = false;
+}
+
+// Map a file into memory, closing whatever file was mapped before
+bool mappedFileOpen(MappedFile &file, const std::string &filename)
+{
+    mappedFileClose(file);
+#ifdef _WIN32
+    std::FILE *f = std::fopen(filename.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    std::fseek(f, 0, SEEK_END);
+    long size = std::ftell(f);
+    std::fseek(f, 0, SEEK_SET);
+    file.buffer.resize(std::max(size, 0L));
+    std::size_t numRead = file.buffer.empty() ? 0 : std::fread(&file.buffer[0], 1, file.buffer.size(), f);
+    std::fclose(f);
+    file.data = file.buffer.empty() ? nullptr : &file.buffer[0];
+    file.size = numRead;
+    return numRead == file.buffer.size();
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0) {
+        close(fd);
+        return false;
+    }
+    if (status.st_size > 0) {
+        void *data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        // The whole file is about to be read, so let the kernel read ahead
+        madvise(data, status.st_size, MADV_WILLNEED);
+        file.data = static_cast<const char *>(data);
+        file.size = status.st_size;
+        file.mapped = true;
+    }
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+    return true;
+#endif
+}
+
+// How the normals of the faces around a vertex are weighted
+enum NormalWeighting {
+    NORMALS_AREA_WEIGHTED, // By face area, which favours large faces
+    NORMALS_ANGLE_WEIGHTED // By the angle of the face at the vertex, which does not depend on the tessellation
+};
+
 // Helper functions
 namespace {
 glm::vec3 mapMousePointToUnitSphere(glm::vec2 point, double radius, glm::vec2 center)
@@ -57,30 +161,386 @@ glm::vec3 mapMousePointToUnitSphere(glm::vec2 point, double radius, glm::vec2 ce
     return glm::normalize(glm::vec3(x, y, z));
 }
 
+// Number of threads to split one-off work such as mesh loading over
+int hardwareThreads()
+{
+    return std::max(int(std::thread::hardware_concurrency()), 1);
+}
+
+// Call function(i) for i in [0, count) on count threads, one of which is
+// the calling thread
+template <typename Function>
+void parallelRun(int count, Function function)
+{
+    std::vector<std::thread> threads;
+    for (int i = 1; i < count; i++) {
+        threads.push_back(std::thread(function, i));
+    }
+    if (count > 0) {
+        function(0);
+    }
+    for (std::size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+}
+
+// Meshes are split into chunks of at least this many triangles, which get
+// their normals computed in parallel
+const std::size_t normalsMinChunkSize = 1 << 15;
+
+// Normalize `count` vectors in place. Zero vectors, such as the normals of
+// vertices no triangle uses, stay zero. When SSE is available, four vectors
+// are normalized at a time.
+void normalizeVectors(glm::vec3 *vectors, std::size_t count)
+{
+    std::size_t i = 0;
+#ifdef __SSE__
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 zero = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4) {
+        float *p = &vectors[i].x;
+        // x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3
+        __m128 a = _mm_loadu_ps(p + 0);
+        __m128 b = _mm_loadu_ps(p + 4);
+        __m128 c = _mm_loadu_ps(p + 8);
+
+        // -- Transpose to x0 x1 x2 x3 etc. for the squared lengths
+        __m128 xy2xy3 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 1, 3, 2));
+        __m128 yz0yz1 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 0, 2, 1));
+        __m128 x = _mm_shuffle_ps(a, xy2xy3, _MM_SHUFFLE(2, 0, 3, 0));
+        __m128 y = _mm_shuffle_ps(yz0yz1, xy2xy3, _MM_SHUFFLE(3, 1, 2, 0));
+        __m128 z = _mm_shuffle_ps(yz0yz1, c, _MM_SHUFFLE(3, 0, 3, 1));
+        __m128 lengthSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+
+        // -- Scale the vectors in place by their inverse lengths, spread
+        // out to s0 s0 s0 s1 | s1 s1 s2 s2 | s2 s3 s3 s3
+        __m128 scale = _mm_div_ps(one, _mm_sqrt_ps(lengthSquared));
+        scale = _mm_and_ps(scale, _mm_cmpgt_ps(lengthSquared, zero));
+        _mm_storeu_ps(p + 0, _mm_mul_ps(a, _mm_shuffle_ps(scale, scale, _MM_SHUFFLE(1, 0, 0, 0))));
+        _mm_storeu_ps(p + 4, _mm_mul_ps(b, _mm_shuffle_ps(scale, scale, _MM_SHUFFLE(2, 2, 1, 1))));
+        _mm_storeu_ps(p + 8, _mm_mul_ps(c, _mm_shuffle_ps(scale, scale, _MM_SHUFFLE(3, 3, 3, 2))));
+    }
+#endif // __SSE__
+    for (; i < count; i++) {
+        float lengthSquared = glm::dot(vectors[i], vectors[i]);
+        vectors[i] *= lengthSquared > 0.0f ? 1.0f / std::sqrt(lengthSquared) : 0.0f;
+    }
+}
+
+// Add the weighted normals of triangles [begin, end) to the normals of
+// their vertices, where normals[v - base] belongs to vertex v
+void scatterNormals(const std::vector<glm::vec3> &vertices, const std::vector<std::uint32_t> &indices,
+                    std::size_t begin, std::size_t end, NormalWeighting weighting,
+                    glm::vec3 *normals, std::uint32_t base)
+{
+    for (std::size_t t = begin; t < end; t++) {
+        std::uint32_t i0 = indices[3 * t + 0];
+        std::uint32_t i1 = indices[3 * t + 1];
+        std::uint32_t i2 = indices[3 * t + 2];
+        glm::vec3 e01 = vertices[i1] - vertices[i0];
+        glm::vec3 e12 = vertices[i2] - vertices[i1];
+        glm::vec3 e20 = vertices[i0] - vertices[i2];
+        glm::vec3 normal = glm::cross(e01, -e20);
+        if (weighting == NORMALS_AREA_WEIGHTED) {
+            normals[i0 - base] += normal;
+            normals[i1 - base] += normal;
+            normals[i2 - base] += normal;
+            continue;
+        }
+
+        // The cross product of the edges at any corner has the same length,
+        // so the corner angles only differ in the cosine term
+        float length = glm::length(normal);
+        if (length > 0.0f) {
+            normal /= length;
+            normals[i0 - base] += normal * std::atan2(length, -glm::dot(e01, e20));
+            normals[i1 - base] += normal * std::atan2(length, -glm::dot(e12, e01));
+            normals[i2 - base] += normal * std::atan2(length, -glm::dot(e20, e12));
+        }
+    }
+}
+
+// Compute per-vertex normals by averaging the normals of the adjacent
+// faces, weighted by their areas or by the angles of their corners at the
+// vertex. Large meshes are split into chunks of triangles that accumulate
+// into buffers of their own, covering just the vertices they use, and the
+// buffers are then summed and normalized in parallel.
 void computeNormals(const std::vector<glm::vec3> &vertices,
                     const std::vector<std::uint32_t> &indices,
-                    std::vector<glm::vec3> *normals)
+                    std::vector<glm::vec3> *normals,
+                    NormalWeighting weighting = NORMALS_AREA_WEIGHTED)
+{
+    std::size_t numVertices = vertices.size();
+    std::size_t numTriangles = indices.size() / 3;
+    int numChunks = int(std::min<std::size_t>(hardwareThreads(), numTriangles / normalsMinChunkSize));
+    numChunks = std::max(numChunks, 1);
+
+    normals->assign(numVertices, glm::vec3(0.0f));
+    glm::vec3 *result = normals->data();
+    if (numChunks == 1) {
+        scatterNormals(vertices, indices, 0, numTriangles, weighting, result, 0);
+        normalizeVectors(result, numVertices);
+        return;
+    }
+
+    // -- Accumulate each chunk of triangles over the range of vertices it
+    // uses, which is narrow for meshes with any locality
+    std::vector<std::vector<glm::vec3> > partials(numChunks);
+    std::vector<std::uint32_t> rangeStart(numChunks, 0);
+    parallelRun(numChunks, [&](int chunk) {
+        std::size_t begin = numTriangles * chunk / numChunks;
+        std::size_t end = numTriangles * (chunk + 1) / numChunks;
+        std::uint32_t lo = indices[3 * begin], hi = lo;
+        for (std::size_t i = 3 * begin; i < 3 * end; i++) {
+            lo = std::min(lo, indices[i]);
+            hi = std::max(hi, indices[i]);
+        }
+        rangeStart[chunk] = lo;
+        partials[chunk].assign(hi - lo + 1, glm::vec3(0.0f));
+        scatterNormals(vertices, indices, begin, end, weighting, partials[chunk].data(), lo);
+    });
+
+    // -- Sum the partial normals of each vertex in chunk order, so the
+    // result does not depend on the timing of the threads, and normalize
+    parallelRun(numChunks, [&](int chunk) {
+        std::size_t begin = numVertices * chunk / numChunks;
+        std::size_t end = numVertices * (chunk + 1) / numChunks;
+        for (int c = 0; c < numChunks; c++) {
+            std::size_t lo = std::max<std::size_t>(begin, rangeStart[c]);
+            std::size_t hi = std::min(end, rangeStart[c] + partials[c].size());
+            const glm::vec3 *partial = partials[c].data() - rangeStart[c];
+            for (std::size_t v = lo; v < hi; v++) {
+                result[v] += partial[v];
+            }
+        }
+        normalizeVectors(result + begin, end - begin);
+    });
+}
+
+// Files are split into chunks of at least this many bytes, which are parsed
+// in parallel
+const std::size_t objMinChunkSize = 1 << 20;
+
+inline bool objIsSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline bool objIsDigit(char c)
+{
+    return unsigned(c - '0') < 10;
+}
+
+// End of the line starting at p, without the newline
+inline const char *objLineEnd(const char *p, const char *end)
+{
+    const char *newline = static_cast<const char *>(std::memchr(p, '\n', end - p));
+    return newline ? newline : end;
+}
+
+// Kind of record on the line [p, end), with leading blanks skipped. Returns
+// 'v' for positions, 't' for texture coordinates, 'n' for normals, 'f' for
+// faces and 0 for anything else.
+inline char objRecordType(const char *&p, const char *end)
+{
+    while (p < end && objIsSpace(*p)) {
+        p++;
+    }
+    if (end - p >= 2 && (p[0] == 'v' || p[0] == 'f') && objIsSpace(p[1])) {
+        char type = p[0];
+        p += 2;
+        return type;
+    }
+    if (end - p >= 3 && p[0] == 'v' && (p[1] == 't' || p[1] == 'n') && objIsSpace(p[2])) {
+        char type = p[1];
+        p += 3;
+        return type;
+    }
+    return 0;
+}
+
+// Parse a decimal floating-point number starting at p, skipping leading
+// blanks. Up to 19 significant digits are accumulated in an integer and
+// scaled by a power of ten once, which is exact for the short numbers OBJ
+// exporters write. Returns the position after the number.
+const char *objParseFloat(const char *p, const char *end, float &value)
+{
+    static const double powersOfTen[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    while (p < end && objIsSpace(*p)) {
+        p++;
+    }
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    // -- Mantissa, with digits past the 19th only moving the exponent
+    std::uint64_t mantissa = 0;
+    int numDigits = 0;
+    int exponent = 0;
+    for (; p < end && objIsDigit(*p); p++) {
+        if (numDigits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            numDigits += mantissa != 0;
+        }
+        else {
+            exponent++;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && objIsDigit(*p); p++) {
+            if (numDigits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                numDigits += mantissa != 0;
+                exponent--;
+            }
+        }
+    }
+
+    // -- Exponent
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool negativeExponent = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negativeExponent = *p == '-';
+            p++;
+        }
+        int e = 0;
+        for (; p < end && objIsDigit(*p); p++) {
+            e = std::min(e * 10 + (*p - '0'), 10000);
+        }
+        exponent += negativeExponent ? -e : e;
+    }
+
+    double result = double(mantissa);
+    if (exponent < 0) {
+        result = exponent >= -22 ? result / powersOfTen[-exponent] : result * std::pow(10.0, exponent);
+    }
+    else if (exponent > 0) {
+        result = exponent <= 22 ? result * powersOfTen[exponent] : result * std::pow(10.0, exponent);
+    }
+    value = float(negative ? -result : result);
+    return p;
+}
+
+// Number of blank-separated words in [p, end)
+inline int objCountWords(const char *p, const char *end)
+{
+    int count = 0;
+    bool inWord = false;
+    for (; p < end; p++) {
+        bool space = objIsSpace(*p);
+        count += inWord == space && !space;
+        inWord = !space;
+    }
+    return count;
+}
+
+const std::uint32_t objNoIndex = 0xffffffff;
+
+// Indices of the position, texture coordinate and normal of a face corner,
+// objNoIndex where the corner has none
+struct ObjCorner {
+    std::uint32_t position, texcoord, normal;
+
+    bool operator==(const ObjCorner &other) const
+    {
+        return position == other.position && texcoord == other.texcoord && normal == other.normal;
+    }
+};
+
+// Number of records of each kind in a chunk of a file, or before it
+struct ObjCounts {
+    std::size_t positions, texcoords, normals, triangles;
+
+    ObjCounts() : positions(0), texcoords(0), normals(0), triangles(0) {}
+};
+
+// Parse one index of a face corner starting at p and turn it from 1-based,
+// or negative and relative to the `count` records read so far, into 0-based.
+// An empty or out-of-range index gives objNoIndex.
+const char *objParseIndex(const char *p, const char *end, std::size_t count, std::uint32_t &index)
+{
+    bool negative = p < end && *p == '-';
+    p += negative;
+    std::size_t value = 0;
+    for (; p < end && objIsDigit(*p); p++) {
+        value = std::min<std::size_t>(value * 10 + (*p - '0'), 0xffffffff);
+    }
+    if (negative) {
+        index = value >= 1 && value <= count ? std::uint32_t(count - value) : objNoIndex;
+    }
+    else {
+        index = value >= 1 && value <= count ? std::uint32_t(value - 1) : objNoIndex;
+    }
+    return p;
+}
+
+// Parse a face corner of the form p, p/t, p//n or p/t/n, skipping leading
+// blanks. Returns false if the position index is missing or invalid, or a
+// given texture coordinate or normal index is.
+bool objParseCorner(const char *&p, const char *end, const ObjCounts &read, ObjCorner &corner)
 {
-    normals->resize(vertices.size(), glm::vec3(0.0f, 0.0f, 0.0f));
+    while (p < end && objIsSpace(*p)) {
+        p++;
+    }
+    corner.texcoord = objNoIndex;
+    corner.normal = objNoIndex;
+    p = objParseIndex(p, end, read.positions, corner.position);
+    bool valid = corner.position != objNoIndex;
+    if (p < end && *p == '/') {
+        p++;
+        if (p < end && *p != '/') {
+            p = objParseIndex(p, end, read.texcoords, corner.texcoord);
+            valid = valid && corner.texcoord != objNoIndex;
+        }
+        if (p < end && *p == '/') {
+            p = objParseIndex(p + 1, end, read.normals, corner.normal);
+            valid = valid && corner.normal != objNoIndex;
+        }
+    }
+    valid = valid && (p == end || objIsSpace(*p));
+    while (p < end && !objIsSpace(*p)) {
+        p++;
+    }
+    return valid;
+}
 
-    // Compute per-vertex normals by averaging the unnormalized face normals
-    std::uint32_t vertexIndex0, vertexIndex1, vertexIndex2;
-    glm::vec3 normal;
-    int numIndices = indices.size();
-    for (int i = 0; i < numIndices; i += 3) {
-        vertexIndex0 = indices[i];
-        vertexIndex1 = indices[i + 1];
-        vertexIndex2 = indices[i + 2];
-        normal = glm::cross(vertices[vertexIndex1] - vertices[vertexIndex0],
-                            vertices[vertexIndex2] - vertices[vertexIndex0]);
-        (*normals)[vertexIndex0] += normal;
-        (*normals)[vertexIndex1] += normal;
-        (*normals)[vertexIndex2] += normal;
+// Merge equal corners into indexed vertices with an open-addressing hash
+// table, sized up front to at least twice the number of corners so that
+// probe sequences stay short. Vertices are numbered in order of first use.
+void objMergeCorners(const std::vector<ObjCorner> &corners, std::vector<ObjCorner> &vertices,
+                     std::vector<std::uint32_t> &indices)
+{
+    int shift = 64;
+    std::size_t capacity = 1;
+    while (capacity < 2 * corners.size()) {
+        capacity *= 2;
+        shift--;
     }
+    std::vector<std::uint32_t> table(capacity, objNoIndex);
+    vertices.clear();
+    indices.resize(corners.size());
 
-    int numNormals = normals->size();
-    for (int i = 0; i < numNormals; i++) {
-        (*normals)[i] = glm::normalize((*normals)[i]);
+    for (std::size_t i = 0; i < corners.size(); i++) {
+        const ObjCorner &corner = corners[i];
+        // Multiplicative hash, taking the well-mixed high bits
+        std::uint64_t key = (corner.position | std::uint64_t(corner.texcoord) << 32) * 0x9e3779b97f4a7c15ull;
+        key ^= corner.normal * 0xc2b2ae3d27d4eb4full;
+        std::size_t slot = shift < 64 ? std::size_t(key >> shift) : 0;
+        while (table[slot] != objNoIndex && !(vertices[table[slot]] == corner)) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (table[slot] == objNoIndex) {
+            table[slot] = vertices.size();
+            vertices.push_back(corner);
+        }
+        indices[i] = table[slot];
     }
 }
 } // namespace
@@ -125,51 +585,177 @@ glm::mat4 trackballGetRotationMatrix(Trackball &trackball)
     return glm::mat4_cast(trackball.qCurrent);
 }
 
-// Read an OBJMesh from an .obj file
+// Read an OBJMesh from an .obj file. Positions, texture coordinates,
+// normals and faces are read, where faces may refer to records by negative
+// indices and polygons are split into fans of triangles. Corners with the
+// same position, texture coordinate and normal share a vertex. Normals are
+// computed unless every corner has one.
+//
+// The file is memory-mapped and split into chunks at line boundaries. A
+// first pass counts the records of each chunk, so that the arrays are sized
+// once and every chunk knows where its output goes, and a second pass
+// parses the chunks in parallel straight into place.
 bool objMeshLoad(OBJMesh &mesh, const std::string &filename)
 {
-    const std::string VERTEX_LINE("v ");
-    const std::string FACE_LINE("f ");
-
     // Open OBJ file
-    std::ifstream f(filename.c_str());
-    if (!f.is_open()) {
+    MappedFile file;
+    if (!mappedFileOpen(file, filename)) {
         std::cerr << "Could not open " << filename << std::endl;
         return false;
     }
+    const char *data = file.data;
+    const char *end = file.data + file.size;
+
+    // -- Split the file into chunks that start at a line
+    int numChunks = int(std::min<std::size_t>(hardwareThreads(), file.size / objMinChunkSize));
+    numChunks = std::max(numChunks, 1);
+    std::vector<const char *> chunkStart(numChunks + 1, end);
+    chunkStart[0] = data;
+    for (int i = 1; i < numChunks; i++) {
+        const char *p = std::max(data + file.size / numChunks * i, chunkStart[i - 1]);
+        chunkStart[i] = p == data ? p : std::min(objLineEnd(p - 1, end) + 1, end);
+    }
 
-    // Extract vertices and indices
-    std::string line;
-    glm::vec3 vertex;
-    std::uint32_t vertexIndex0, vertexIndex1, vertexIndex2;
-    while (!f.eof()) {
-        std::getline(f, line);
-        if (line.substr(0, 2) == VERTEX_LINE) {
-            std::istringstream vertexLine(line.substr(2));
-            vertexLine >> vertex.x;
-            vertexLine >> vertex.y;
-            vertexLine >> vertex.z;
-            mesh.vertices.push_back(vertex);
-        }
-        else if (line.substr(0, 2) == FACE_LINE) {
-            std::istringstream faceLine(line.substr(2));
-            faceLine >> vertexIndex0;
-            faceLine >> vertexIndex1;
-            faceLine >> vertexIndex2;
-            mesh.indices.push_back(vertexIndex0 - 1);
-            mesh.indices.push_back(vertexIndex1 - 1);
-            mesh.indices.push_back(vertexIndex2 - 1);
+    // -- Count the records of each chunk, then turn the counts into the
+    // number of records before each chunk
+    std::vector<ObjCounts> counts(numChunks + 1);
+    parallelRun(numChunks, [&](int chunk) {
+        ObjCounts &count = counts[chunk + 1];
+        for (const char *p = chunkStart[chunk]; p < chunkStart[chunk + 1];) {
+            const char *lineEnd = objLineEnd(p, chunkStart[chunk + 1]);
+            switch (objRecordType(p, lineEnd)) {
+            case 'v': count.positions++; break;
+            case 't': count.texcoords++; break;
+            case 'n': count.normals++; break;
+            case 'f': count.triangles += std::max(objCountWords(p, lineEnd) - 2, 0); break;
+            default: break;
+            }
+            p = lineEnd + 1;
         }
-        else {
-            // Ignore line
+    });
+    for (int i = 0; i < numChunks; i++) {
+        counts[i + 1].positions += counts[i].positions;
+        counts[i + 1].texcoords += counts[i].texcoords;
+        counts[i + 1].normals += counts[i].normals;
+        counts[i + 1].triangles += counts[i].triangles;
+    }
+    const ObjCounts &total = counts[numChunks];
+
+    std::vector<glm::vec3> positions(total.positions);
+    std::vector<glm::vec2> texcoords(total.texcoords);
+    std::vector<glm::vec3> normals(total.normals);
+    std::vector<ObjCorner> corners(total.triangles * 3);
+
+    // -- Extract the records. Faces are stored as corners of triangles.
+    std::vector<char> chunkValid(numChunks, 1);
+    std::vector<char> chunkHasTexcoords(numChunks, 0);
+    std::vector<char> chunkHasNormals(numChunks, 1);
+    parallelRun(numChunks, [&](int chunk) {
+        ObjCounts read = counts[chunk];
+        ObjCorner *corner = corners.data() + read.triangles * 3;
+        std::vector<ObjCorner> polygon;
+        for (const char *p = chunkStart[chunk]; p < chunkStart[chunk + 1];) {
+            const char *lineEnd = objLineEnd(p, chunkStart[chunk + 1]);
+            switch (objRecordType(p, lineEnd)) {
+            case 'v': {
+                glm::vec3 &position = positions[read.positions++];
+                p = objParseFloat(p, lineEnd, position.x);
+                p = objParseFloat(p, lineEnd, position.y);
+                p = objParseFloat(p, lineEnd, position.z);
+                break;
+            }
+            case 't': {
+                glm::vec2 &texcoord = texcoords[read.texcoords++];
+                p = objParseFloat(p, lineEnd, texcoord.x);
+                p = objParseFloat(p, lineEnd, texcoord.y);
+                break;
+            }
+            case 'n': {
+                glm::vec3 &normal = normals[read.normals++];
+                p = objParseFloat(p, lineEnd, normal.x);
+                p = objParseFloat(p, lineEnd, normal.y);
+                p = objParseFloat(p, lineEnd, normal.z);
+                break;
+            }
+            case 'f': {
+                polygon.clear();
+                for (;;) {
+                    while (p < lineEnd && objIsSpace(*p)) {
+                        p++;
+                    }
+                    if (p == lineEnd) {
+                        break;
+                    }
+                    ObjCorner c;
+                    chunkValid[chunk] &= objParseCorner(p, lineEnd, read, c);
+                    chunkHasTexcoords[chunk] |= c.texcoord != objNoIndex;
+                    chunkHasNormals[chunk] &= c.normal != objNoIndex;
+                    polygon.push_back(c);
+                }
+                for (std::size_t i = 1; i + 1 < polygon.size(); i++) {
+                    *corner++ = polygon[0];
+                    *corner++ = polygon[i];
+                    *corner++ = polygon[i + 1];
+                }
+                break;
+            }
+            default:
+                // Ignore line
+                break;
+            }
+            p = lineEnd + 1;
         }
+    });
+
+    // A bad index would make everything downstream read out of bounds
+    if (std::find(chunkValid.begin(), chunkValid.end(), 0) != chunkValid.end()) {
+        std::cerr << "Invalid face in " << filename << std::endl;
+        return false;
     }
 
-    // Close OBJ file
-    f.close();
+    // -- Build the indexed vertices. Missing texture coordinates are zero,
+    // and normal indices are dropped unless every corner has one.
+    bool hasTexcoords = std::find(chunkHasTexcoords.begin(), chunkHasTexcoords.end(), 1) != chunkHasTexcoords.end();
+    bool hasNormals = !corners.empty() &&
+                      std::find(chunkHasNormals.begin(), chunkHasNormals.end(), 0) == chunkHasNormals.end();
+    if (!hasTexcoords && !hasNormals) {
+        // Positions alone need no merging, and keep their order in the file
+        mesh.vertices.swap(positions);
+        mesh.texcoords.clear();
+        mesh.indices.resize(corners.size());
+        for (std::size_t i = 0; i < corners.size(); i++) {
+            mesh.indices[i] = corners[i].position;
+        }
+    }
+    else {
+        if (!hasNormals) {
+            for (std::size_t i = 0; i < corners.size(); i++) {
+                corners[i].normal = objNoIndex;
+            }
+        }
+        std::vector<ObjCorner> vertices;
+        objMergeCorners(corners, vertices, mesh.indices);
+
+        mesh.vertices.resize(vertices.size());
+        mesh.texcoords.assign(hasTexcoords ? vertices.size() : 0, glm::vec2(0.0f));
+        mesh.normals.resize(hasNormals ? vertices.size() : 0);
+        for (std::size_t i = 0; i < vertices.size(); i++) {
+            const ObjCorner &vertex = vertices[i];
+            mesh.vertices[i] = positions[vertex.position];
+            if (hasTexcoords && vertex.texcoord != objNoIndex) {
+                mesh.texcoords[i] = texcoords[vertex.texcoord];
+            }
+            if (hasNormals) {
+                mesh.normals[i] = normals[vertex.normal];
+            }
+        }
+    }
 
     // Compute normals
-    computeNormals(mesh.vertices, mesh.indices, &mesh.normals);
+    if (!hasNormals) {
+        mesh.normals.clear();
+        computeNormals(mesh.vertices, mesh.indices, &mesh.normals);
+    }
 
     // Display log message
     std::cout << "Loaded OBJ file " << filename << std::endl;